@@ -0,0 +1,232 @@
+// Compares Table against the linear-probing table it replaced on the
+// operations the VM leans on: set, get and the intern table's findString.
+// Build with -DCPPLOX_BUILD_BENCHMARKS=ON and run cpplox_table_bench.
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+
+using namespace cpplox;
+
+namespace {
+
+// The previous Table: linear probing over 16-byte entries, with tombstones
+// marked by a null key and a non-nil value.
+class LinearProbeTable {
+public:
+  bool get(ObjString *key, Value *value) const {
+    if (count_ == 0)
+      return false;
+    const Entry *entry = findEntry(entries_, key);
+    if (entry->key == nullptr)
+      return false;
+    *value = entry->value;
+    return true;
+  }
+  bool set(ObjString *key, Value value) {
+    if (count_ + 1 > static_cast<double>(entries_.size()) * 0.75)
+      adjustCapacity(growCapacity(static_cast<int>(entries_.size())));
+    Entry *entry = findEntry(entries_, key);
+    bool isNewKey = entry->key == nullptr;
+    if (isNewKey && isNil(entry->value))
+      count_++;
+    entry->key = key;
+    entry->value = value;
+    return isNewKey;
+  }
+  bool remove(ObjString *key) {
+    if (count_ == 0)
+      return false;
+    Entry *entry = findEntry(entries_, key);
+    if (entry->key == nullptr)
+      return false;
+    entry->key = nullptr;
+    entry->value = boolValue(true);
+    return true;
+  }
+  ObjString *findString(const char *chars, int length, uint32_t hash) const {
+    if (count_ == 0)
+      return nullptr;
+    size_t mask = entries_.size() - 1;
+    for (size_t index = hash & mask;; index = (index + 1) & mask) {
+      const Entry &entry = entries_[index];
+      if (entry.key == nullptr) {
+        if (isNil(entry.value))
+          return nullptr;
+      } else if (entry.key->length == length && entry.key->hash == hash &&
+                 std::memcmp(entry.key->chars, chars, length) == 0) {
+        return entry.key;
+      }
+    }
+  }
+
+private:
+  static Entry *findEntry(std::vector<Entry> &entries, ObjString *key) {
+    size_t mask = entries.size() - 1;
+    Entry *tombstone = nullptr;
+    for (size_t index = key->hash & mask;; index = (index + 1) & mask) {
+      Entry *entry = &entries[index];
+      if (entry->key == nullptr) {
+        if (isNil(entry->value))
+          return tombstone != nullptr ? tombstone : entry;
+        if (tombstone == nullptr)
+          tombstone = entry;
+      } else if (entry->key == key) {
+        return entry;
+      }
+    }
+  }
+  static const Entry *findEntry(const std::vector<Entry> &entries,
+                                ObjString *key) {
+    return findEntry(const_cast<std::vector<Entry> &>(entries), key);
+  }
+  void adjustCapacity(int capacity) {
+    std::vector<Entry> entries(static_cast<size_t>(capacity));
+    count_ = 0;
+    for (const Entry &entry : entries_) {
+      if (entry.key == nullptr)
+        continue;
+      Entry *dest = findEntry(entries, entry.key);
+      *dest = entry;
+      count_++;
+    }
+    entries_.swap(entries);
+  }
+
+  int count_ = 0;
+  std::vector<Entry> entries_;
+};
+
+// Interned-looking strings with the VM's hash, plus copies of their text at
+// other addresses to look up the way the intern table is probed.
+struct Keys {
+  explicit Keys(size_t count, const char *prefix) {
+    std::mt19937 random(static_cast<uint32_t>(count));
+    text.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+      text.push_back(prefix + std::to_string(random()) + "_" +
+                     std::to_string(i));
+    }
+    copies = text;
+    strings.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      ObjString &string = strings[i];
+      string.type = OBJ_STRING;
+      string.length = static_cast<int>(text[i].size());
+      string.chars = text[i].data();
+      string.hash = hashString(text[i].data(), string.length);
+    }
+    order.resize(count);
+    for (size_t i = 0; i < count; i++)
+      order[i] = i;
+    std::shuffle(order.begin(), order.end(), random);
+  }
+
+  std::vector<std::string> text;
+  std::vector<std::string> copies;
+  std::vector<ObjString> strings;
+  std::vector<size_t> order;
+};
+
+volatile uint64_t sink;
+
+// Best of several runs, in nanoseconds per operation.
+template <typename F> double measure(size_t operations, F body) {
+  double best = 1e300;
+  for (int run = 0; run < 5; run++) {
+    auto start = std::chrono::steady_clock::now();
+    body();
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count() / static_cast<double>(operations));
+  }
+  return best;
+}
+
+template <typename T> void fill(T &table, Keys &keys) {
+  for (ObjString &key : keys.strings)
+    table.set(&key, numberValue(1));
+}
+
+template <typename T>
+void runSuite(size_t count, Keys &keys, Keys &missing, double results[6]) {
+  results[0] = measure(count, [&] {
+    T table;
+    fill(table, keys);
+  });
+
+  T table;
+  fill(table, keys);
+  results[1] = measure(count, [&] {
+    uint64_t found = 0;
+    Value value;
+    for (size_t i : keys.order)
+      found += table.get(&keys.strings[i], &value);
+    sink = found;
+  });
+  results[2] = measure(count, [&] {
+    uint64_t found = 0;
+    Value value;
+    for (size_t i : missing.order)
+      found += table.get(&missing.strings[i], &value);
+    sink = found;
+  });
+  results[3] = measure(count, [&] {
+    uint64_t found = 0;
+    for (size_t i : keys.order) {
+      const std::string &copy = keys.copies[i];
+      found += table.findString(copy.data(), static_cast<int>(copy.size()),
+                                keys.strings[i].hash) != nullptr;
+    }
+    sink = found;
+  });
+  results[4] = measure(count, [&] {
+    uint64_t found = 0;
+    for (size_t i : missing.order) {
+      const std::string &copy = missing.copies[i];
+      found += table.findString(copy.data(), static_cast<int>(copy.size()),
+                                missing.strings[i].hash) != nullptr;
+    }
+    sink = found;
+  });
+  // Like the intern table after each collection: half the keys die and new
+  // ones arrive.
+  results[5] = measure(count, [&] {
+    for (size_t i = 0; i < count; i += 2)
+      table.remove(&keys.strings[keys.order[i]]);
+    for (size_t i = 0; i < count; i += 2)
+      table.set(&keys.strings[keys.order[i]], numberValue(1));
+  });
+}
+
+} // namespace
+
+int main() {
+  static const char *kOperations[] = {
+      "set",           "get hit",         "get miss",
+      "findString hit", "findString miss", "remove+set"};
+  std::printf("%-16s %9s %12s %12s %8s\n", "operation", "keys", "linear ns",
+              "swiss ns", "speedup");
+  for (size_t count : {64, 1024, 16384, 262144, 1048576}) {
+    Keys keys(count, "key");
+    Keys missing(count, "missing");
+    double linear[6];
+    double swiss[6];
+    runSuite<LinearProbeTable>(count, keys, missing, linear);
+    runSuite<Table>(count, keys, missing, swiss);
+    for (int op = 0; op < 6; op++) {
+      std::printf("%-16s %9zu %12.2f %12.2f %7.2fx\n", kOperations[op], count,
+                  linear[op], swiss[op], linear[op] / swiss[op]);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,62 @@
+# CMAKE generated file: DO NOT EDIT!
+# Generated by CMake Version 3.25
+cmake_policy(SET CMP0009 NEW)
+
+# CPPLOX_SOURCES at CMakeLists.txt:22 (file)
+file(GLOB_RECURSE NEW_GLOB LIST_DIRECTORIES false "/root/repo/cpplox/src/*.cpp")
+set(OLD_GLOB
+  "/root/repo/cpplox/src/cpplox/bytecode/chunk.cpp"
+  "/root/repo/cpplox/src/cpplox/bytecode/instruction.cpp"
+  "/root/repo/cpplox/src/cpplox/frontend/bytecode_file.cpp"
+  "/root/repo/cpplox/src/cpplox/frontend/compiler.cpp"
+  "/root/repo/cpplox/src/cpplox/frontend/optimizer.cpp"
+  "/root/repo/cpplox/src/cpplox/frontend/register_compiler.cpp"
+  "/root/repo/cpplox/src/cpplox/frontend/scanner.cpp"
+  "/root/repo/cpplox/src/cpplox/runtime/gc_telemetry.cpp"
+  "/root/repo/cpplox/src/cpplox/runtime/marker_pool.cpp"
+  "/root/repo/cpplox/src/cpplox/runtime/memory.cpp"
+  "/root/repo/cpplox/src/cpplox/runtime/object.cpp"
+  "/root/repo/cpplox/src/cpplox/runtime/profiler.cpp"
+  "/root/repo/cpplox/src/cpplox/runtime/slab.cpp"
+  "/root/repo/cpplox/src/cpplox/runtime/snapshot.cpp"
+  "/root/repo/cpplox/src/cpplox/runtime/table.cpp"
+  "/root/repo/cpplox/src/cpplox/runtime/value.cpp"
+  "/root/repo/cpplox/src/cpplox/runtime/vm.cpp"
+  "/root/repo/cpplox/src/cpplox/support/binary_io.cpp"
+  "/root/repo/cpplox/src/cpplox/support/debug.cpp"
+  "/root/repo/cpplox/src/main.cpp"
+  )
+if(NOT "${NEW_GLOB}" STREQUAL "${OLD_GLOB}")
+  message("-- GLOB mismatch!")
+  file(TOUCH_NOCREATE "/root/repo/cpplox/build/CMakeFiles/cmake.verify_globs")
+endif()
+
+# CPPLOX_HEADERS at CMakeLists.txt:23 (file)
+file(GLOB_RECURSE NEW_GLOB LIST_DIRECTORIES false "/root/repo/cpplox/src/*.h")
+set(OLD_GLOB
+  "/root/repo/cpplox/src/cpplox/bytecode/chunk.h"
+  "/root/repo/cpplox/src/cpplox/bytecode/instruction.h"
+  "/root/repo/cpplox/src/cpplox/bytecode/register_ops.h"
+  "/root/repo/cpplox/src/cpplox/frontend/bytecode_file.h"
+  "/root/repo/cpplox/src/cpplox/frontend/compiler.h"
+  "/root/repo/cpplox/src/cpplox/frontend/optimizer.h"
+  "/root/repo/cpplox/src/cpplox/frontend/register_compiler.h"
+  "/root/repo/cpplox/src/cpplox/frontend/scanner.h"
+  "/root/repo/cpplox/src/cpplox/runtime/gc_telemetry.h"
+  "/root/repo/cpplox/src/cpplox/runtime/marker_pool.h"
+  "/root/repo/cpplox/src/cpplox/runtime/memory.h"
+  "/root/repo/cpplox/src/cpplox/runtime/object.h"
+  "/root/repo/cpplox/src/cpplox/runtime/profiler.h"
+  "/root/repo/cpplox/src/cpplox/runtime/slab.h"
+  "/root/repo/cpplox/src/cpplox/runtime/snapshot.h"
+  "/root/repo/cpplox/src/cpplox/runtime/table.h"
+  "/root/repo/cpplox/src/cpplox/runtime/value.h"
+  "/root/repo/cpplox/src/cpplox/runtime/vm.h"
+  "/root/repo/cpplox/src/cpplox/support/binary_io.h"
+  "/root/repo/cpplox/src/cpplox/support/common.h"
+  "/root/repo/cpplox/src/cpplox/support/debug.h"
+  )
+if(NOT "${NEW_GLOB}" STREQUAL "${OLD_GLOB}")
+  message("-- GLOB mismatch!")
+  file(TOUCH_NOCREATE "/root/repo/cpplox/build/CMakeFiles/cmake.verify_globs")
+endif()
@@ -0,0 +1,38 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/cpplox/src/cpplox/bytecode/chunk.cpp" "CMakeFiles/cpplox.dir/src/cpplox/bytecode/chunk.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/bytecode/chunk.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/bytecode/instruction.cpp" "CMakeFiles/cpplox.dir/src/cpplox/bytecode/instruction.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/bytecode/instruction.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/frontend/bytecode_file.cpp" "CMakeFiles/cpplox.dir/src/cpplox/frontend/bytecode_file.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/frontend/bytecode_file.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/frontend/compiler.cpp" "CMakeFiles/cpplox.dir/src/cpplox/frontend/compiler.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/frontend/compiler.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/frontend/optimizer.cpp" "CMakeFiles/cpplox.dir/src/cpplox/frontend/optimizer.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/frontend/optimizer.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/frontend/register_compiler.cpp" "CMakeFiles/cpplox.dir/src/cpplox/frontend/register_compiler.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/frontend/register_compiler.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/frontend/scanner.cpp" "CMakeFiles/cpplox.dir/src/cpplox/frontend/scanner.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/frontend/scanner.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/runtime/gc_telemetry.cpp" "CMakeFiles/cpplox.dir/src/cpplox/runtime/gc_telemetry.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/runtime/gc_telemetry.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/runtime/marker_pool.cpp" "CMakeFiles/cpplox.dir/src/cpplox/runtime/marker_pool.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/runtime/marker_pool.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/runtime/memory.cpp" "CMakeFiles/cpplox.dir/src/cpplox/runtime/memory.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/runtime/memory.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/runtime/object.cpp" "CMakeFiles/cpplox.dir/src/cpplox/runtime/object.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/runtime/object.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/runtime/profiler.cpp" "CMakeFiles/cpplox.dir/src/cpplox/runtime/profiler.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/runtime/profiler.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/runtime/slab.cpp" "CMakeFiles/cpplox.dir/src/cpplox/runtime/slab.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/runtime/slab.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/runtime/snapshot.cpp" "CMakeFiles/cpplox.dir/src/cpplox/runtime/snapshot.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/runtime/snapshot.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/runtime/table.cpp" "CMakeFiles/cpplox.dir/src/cpplox/runtime/table.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/runtime/table.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/runtime/value.cpp" "CMakeFiles/cpplox.dir/src/cpplox/runtime/value.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/runtime/value.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/runtime/vm.cpp" "CMakeFiles/cpplox.dir/src/cpplox/runtime/vm.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/runtime/vm.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/support/binary_io.cpp" "CMakeFiles/cpplox.dir/src/cpplox/support/binary_io.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/support/binary_io.cpp.o.d"
+  "/root/repo/cpplox/src/cpplox/support/debug.cpp" "CMakeFiles/cpplox.dir/src/cpplox/support/debug.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/cpplox/support/debug.cpp.o.d"
+  "/root/repo/cpplox/src/main.cpp" "CMakeFiles/cpplox.dir/src/main.cpp.o" "gcc" "CMakeFiles/cpplox.dir/src/main.cpp.o.d"
+  )
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
@@ -0,0 +1,49 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/cpplox.dir/src/cpplox/bytecode/chunk.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/bytecode/chunk.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/bytecode/instruction.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/bytecode/instruction.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/frontend/bytecode_file.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/frontend/bytecode_file.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/frontend/compiler.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/frontend/compiler.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/frontend/optimizer.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/frontend/optimizer.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/frontend/register_compiler.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/frontend/register_compiler.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/frontend/scanner.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/frontend/scanner.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/gc_telemetry.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/gc_telemetry.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/marker_pool.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/marker_pool.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/memory.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/memory.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/object.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/object.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/profiler.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/profiler.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/slab.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/slab.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/snapshot.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/snapshot.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/table.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/table.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/value.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/value.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/vm.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/runtime/vm.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/support/binary_io.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/support/binary_io.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/cpplox/support/debug.cpp.o"
+  "CMakeFiles/cpplox.dir/src/cpplox/support/debug.cpp.o.d"
+  "CMakeFiles/cpplox.dir/src/main.cpp.o"
+  "CMakeFiles/cpplox.dir/src/main.cpp.o.d"
+  "Release/cpplox"
+  "Release/cpplox.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/cpplox.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
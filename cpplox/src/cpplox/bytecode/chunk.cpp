@@ -1,15 +1,29 @@
+#include <algorithm>
+#include <iterator>
+
 #include "chunk.h"
 
 namespace cpplox {
 
 void Chunk::write(uint8_t byte, int line) {
+  if (lines_.empty() || lines_.back().line != line)
+    lines_.push_back({size(), line});
   code_.push_back(byte);
-  lines_.push_back(line);
 }
 
 void Chunk::truncate(int size) {
   code_.resize(size);
-  lines_.resize(size);
+  while (!lines_.empty() && lines_.back().offset >= size)
+    lines_.pop_back();
+}
+
+int Chunk::lineAt(size_t offset) const {
+  auto run = std::upper_bound(
+      lines_.begin(), lines_.end(), offset,
+      [](size_t offset, const LineStart &start) {
+        return offset < static_cast<size_t>(start.offset);
+      });
+  return run == lines_.begin() ? 0 : std::prev(run)->line;
 }
 
 int Chunk::addConstant(Value value) {
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory>
 #include <vector>
 
 #include "common.h"
@@ -12,27 +13,69 @@ struct ObjClass;
 
 enum class InlineCacheKind : uint8_t {
   Empty,
-  Global,
   Field,
   Method,
 };
 
 inline constexpr InlineCacheKind CACHE_EMPTY = InlineCacheKind::Empty;
-inline constexpr InlineCacheKind CACHE_GLOBAL = InlineCacheKind::Global;
 inline constexpr InlineCacheKind CACHE_FIELD = InlineCacheKind::Field;
 inline constexpr InlineCacheKind CACHE_METHOD = InlineCacheKind::Method;
 
-struct InlineCache {
+// Receiver classes a property or invoke site remembers before it gives up and
+// goes megamorphic.
+inline constexpr int kInlineCacheWays = 4;
+
+// What a site learned about one receiver class: the field slot, or the method
+// and whether a field of the same name can shadow it (entryIndex).
+struct ClassCacheEntry {
   InlineCacheKind kind = CACHE_EMPTY;
-  ObjString *key = nullptr;
-  Entry *entry = nullptr;
-  uint32_t tableVersion = 0;
   ObjClass *ownerClass = nullptr;
+  uint32_t tableVersion = 0;
   uint32_t secondaryVersion = 0;
   int entryIndex = -1;
   Value value = nilValue();
 };
 
+// Every constant has one. Global sites use entry and tableVersion; property
+// and invoke sites fill one way per receiver class and, once a site has seen
+// more than kInlineCacheWays classes, stop caching for good. The ways are
+// allocated by the first claim, so constants that are never a property or
+// invoke site don't pay for them, and freed again when the site goes
+// megamorphic.
+struct InlineCache {
+  ObjString *key = nullptr;
+  Entry *entry = nullptr;
+  uint32_t tableVersion = 0;
+  uint8_t classCount = 0;
+  bool megamorphic = false;
+  std::unique_ptr<ClassCacheEntry[]> classes;
+
+  ClassCacheEntry *find(ObjClass *klass) {
+    for (int i = 0; i < classCount; i++) {
+      if (classes[i].ownerClass == klass)
+        return &classes[i];
+    }
+    return nullptr;
+  }
+  // The way to refill for klass; nullptr once the site is megamorphic.
+  ClassCacheEntry *claim(ObjClass *klass) {
+    if (megamorphic)
+      return nullptr;
+    if (ClassCacheEntry *existing = find(klass))
+      return existing;
+    if (classCount < kInlineCacheWays) {
+      if (classes == nullptr)
+        classes = std::make_unique<ClassCacheEntry[]>(kInlineCacheWays);
+      classes[classCount].ownerClass = klass;
+      return &classes[classCount++];
+    }
+    megamorphic = true;
+    classCount = 0;
+    classes.reset();
+    return nullptr;
+  }
+};
+
 enum class Opcode : uint8_t {
   Constant,
   Constant0,
@@ -95,6 +138,26 @@ enum class Opcode : uint8_t {
   Class,
   Inherit,
   Method,
+  GetLocalProperty,
+  AddLocalConstant,
+  SubtractLocalConstant,
+  LessLocalConstant,
+  EqualJumpIfFalse,
+  GreaterJumpIfFalse,
+  LessJumpIfFalse,
+  TailCall,
+  TailInvoke,
+  TailSuperInvoke,
+  NotEqual,
+  NotGreater,
+  NotLess,
+  NotEqualJumpIfFalse,
+  NotGreaterJumpIfFalse,
+  NotLessJumpIfFalse,
+  AddNum,
+  AddStr,
+  GetFieldSlot,
+  GetLocalFieldSlot,
   Count
 };
 
@@ -163,8 +226,54 @@ inline constexpr uint8_t OP_RETURN = opcodeByte(Opcode::Return);
 inline constexpr uint8_t OP_CLASS = opcodeByte(Opcode::Class);
 inline constexpr uint8_t OP_INHERIT = opcodeByte(Opcode::Inherit);
 inline constexpr uint8_t OP_METHOD = opcodeByte(Opcode::Method);
+// Superinstructions the compiler emits for hot adjacent opcode sequences.
+inline constexpr uint8_t OP_GET_LOCAL_PROPERTY =
+    opcodeByte(Opcode::GetLocalProperty);
+inline constexpr uint8_t OP_ADD_LOCAL_CONSTANT =
+    opcodeByte(Opcode::AddLocalConstant);
+inline constexpr uint8_t OP_SUBTRACT_LOCAL_CONSTANT =
+    opcodeByte(Opcode::SubtractLocalConstant);
+inline constexpr uint8_t OP_LESS_LOCAL_CONSTANT =
+    opcodeByte(Opcode::LessLocalConstant);
+inline constexpr uint8_t OP_EQUAL_JUMP_IF_FALSE =
+    opcodeByte(Opcode::EqualJumpIfFalse);
+inline constexpr uint8_t OP_GREATER_JUMP_IF_FALSE =
+    opcodeByte(Opcode::GreaterJumpIfFalse);
+inline constexpr uint8_t OP_LESS_JUMP_IF_FALSE =
+    opcodeByte(Opcode::LessJumpIfFalse);
+// Calls in return position. The callee's frame replaces the caller's.
+inline constexpr uint8_t OP_TAIL_CALL = opcodeByte(Opcode::TailCall);
+inline constexpr uint8_t OP_TAIL_INVOKE = opcodeByte(Opcode::TailInvoke);
+inline constexpr uint8_t OP_TAIL_SUPER_INVOKE =
+    opcodeByte(Opcode::TailSuperInvoke);
+// What the optimizer rewrites EQUAL NOT, GREATER NOT and LESS NOT into. They
+// negate the comparison rather than flip it, so NaN <= x is still true.
+inline constexpr uint8_t OP_NOT_EQUAL = opcodeByte(Opcode::NotEqual);
+inline constexpr uint8_t OP_NOT_GREATER = opcodeByte(Opcode::NotGreater);
+inline constexpr uint8_t OP_NOT_LESS = opcodeByte(Opcode::NotLess);
+inline constexpr uint8_t OP_NOT_EQUAL_JUMP_IF_FALSE =
+    opcodeByte(Opcode::NotEqualJumpIfFalse);
+inline constexpr uint8_t OP_NOT_GREATER_JUMP_IF_FALSE =
+    opcodeByte(Opcode::NotGreaterJumpIfFalse);
+inline constexpr uint8_t OP_NOT_LESS_JUMP_IF_FALSE =
+    opcodeByte(Opcode::NotLessJumpIfFalse);
+// Quickened forms the interpreter rewrites generic opcodes into once it has
+// seen their operands. The compiler never emits them.
+inline constexpr uint8_t OP_ADD_NUM = opcodeByte(Opcode::AddNum);
+inline constexpr uint8_t OP_ADD_STR = opcodeByte(Opcode::AddStr);
+inline constexpr uint8_t OP_GET_FIELD_SLOT = opcodeByte(Opcode::GetFieldSlot);
+inline constexpr uint8_t OP_GET_LOCAL_FIELD_SLOT =
+    opcodeByte(Opcode::GetLocalFieldSlot);
 inline constexpr int OP_COUNT = static_cast<int>(Opcode::Count);
 
+// The first byte of a run of bytecode that all came from one source line.
+// Lines are only looked up for errors, the disassembler and the profiler, so a
+// chunk keeps one of these per change of line rather than one per byte.
+struct LineStart {
+  int offset;
+  int line;
+};
+
 class Chunk {
 public:
   int size() const { return static_cast<int>(code_.size()); }
@@ -174,7 +283,8 @@ public:
   const uint8_t *codeData() const { return code_.data(); }
   uint8_t byteAt(int offset) const { return code_[offset]; }
   uint8_t &byteAt(int offset) { return code_[offset]; }
-  int lineAt(size_t offset) const { return lines_[offset]; }
+  int lineAt(size_t offset) const;
+  const std::vector<LineStart> &lineStarts() const { return lines_; }
 
   void write(uint8_t byte, int line);
   void truncate(int size);
@@ -191,7 +301,7 @@ public:
 
 private:
   std::vector<uint8_t> code_;
-  std::vector<int> lines_;
+  std::vector<LineStart> lines_;
   std::vector<InlineCache> inlineCaches_;
   ValueArray constants_;
 };
@@ -0,0 +1,288 @@
+#include <algorithm>
+#include <vector>
+
+#include "instruction.h"
+#include "object.h"
+
+namespace cpplox {
+
+bool isJump(uint8_t opcode) {
+  switch (opcode) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_EQUAL_JUMP_IF_FALSE:
+  case OP_GREATER_JUMP_IF_FALSE:
+  case OP_LESS_JUMP_IF_FALSE:
+  case OP_NOT_EQUAL_JUMP_IF_FALSE:
+  case OP_NOT_GREATER_JUMP_IF_FALSE:
+  case OP_NOT_LESS_JUMP_IF_FALSE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool isUnconditionalJump(uint8_t opcode) {
+  return opcode == OP_JUMP || opcode == OP_LOOP;
+}
+
+bool fallsThrough(uint8_t opcode) {
+  return !isUnconditionalJump(opcode) && opcode != OP_RETURN;
+}
+
+int operandCount(const Chunk &chunk, int offset) {
+  switch (chunk.byteAt(offset)) {
+  case OP_CONSTANT_0:
+  case OP_CONSTANT_1:
+  case OP_CONSTANT_2:
+  case OP_CONSTANT_3:
+  case OP_CONSTANT_4:
+  case OP_CONSTANT_5:
+  case OP_CONSTANT_6:
+  case OP_CONSTANT_7:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_POP:
+  case OP_GET_LOCAL_0:
+  case OP_GET_LOCAL_1:
+  case OP_GET_LOCAL_2:
+  case OP_GET_LOCAL_3:
+  case OP_GET_LOCAL_4:
+  case OP_GET_LOCAL_5:
+  case OP_GET_LOCAL_6:
+  case OP_GET_LOCAL_7:
+  case OP_SET_LOCAL_0:
+  case OP_SET_LOCAL_1:
+  case OP_SET_LOCAL_2:
+  case OP_SET_LOCAL_3:
+  case OP_SET_LOCAL_4:
+  case OP_SET_LOCAL_5:
+  case OP_SET_LOCAL_6:
+  case OP_SET_LOCAL_7:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_NOT:
+  case OP_NEGATE:
+  case OP_PRINT:
+  case OP_CLOSE_UPVALUE:
+  case OP_RETURN:
+  case OP_INHERIT:
+  case OP_NOT_EQUAL:
+  case OP_NOT_GREATER:
+  case OP_NOT_LESS:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+    return 0;
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+  case OP_CALL:
+  case OP_CLASS:
+  case OP_METHOD:
+  case OP_TAIL_CALL:
+  case OP_GET_FIELD_SLOT:
+    return 1;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_GET_LOCAL_PROPERTY:
+  case OP_ADD_LOCAL_CONSTANT:
+  case OP_SUBTRACT_LOCAL_CONSTANT:
+  case OP_LESS_LOCAL_CONSTANT:
+  case OP_EQUAL_JUMP_IF_FALSE:
+  case OP_GREATER_JUMP_IF_FALSE:
+  case OP_LESS_JUMP_IF_FALSE:
+  case OP_TAIL_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+  case OP_NOT_EQUAL_JUMP_IF_FALSE:
+  case OP_NOT_GREATER_JUMP_IF_FALSE:
+  case OP_NOT_LESS_JUMP_IF_FALSE:
+  case OP_GET_LOCAL_FIELD_SLOT:
+    return 2;
+  case OP_CLOSURE: {
+    if (offset + 1 >= chunk.size())
+      return -1;
+    size_t constant = chunk.byteAt(offset + 1);
+    if (constant >= chunk.constants().size() ||
+        !isFunction(chunk.constantAt(constant)))
+      return -1;
+    return 1 + 2 * asFunction(chunk.constantAt(constant))->upvalueCount;
+  }
+  default:
+    return -1;
+  }
+}
+
+bool decode(const Chunk &chunk, Code *code) {
+  std::vector<int> indexAt(chunk.size(), -1);
+  for (int offset = 0; offset < chunk.size();) {
+    int operands = operandCount(chunk, offset);
+    if (operands < 0 || offset + 1 + operands > chunk.size())
+      return false;
+    indexAt[offset] = static_cast<int>(code->size());
+
+    Instruction instruction;
+    instruction.opcode = chunk.byteAt(offset);
+    instruction.line = chunk.lineAt(offset);
+    if (isJump(instruction.opcode)) {
+      int jump = (chunk.byteAt(offset + 1) << 8) | chunk.byteAt(offset + 2);
+      int next = offset + 3;
+      // An offset for now; mapped to an index once every instruction is seen.
+      instruction.target =
+          instruction.opcode == OP_LOOP ? next - jump : next + jump;
+    } else {
+      const uint8_t *bytes = chunk.codeData() + offset + 1;
+      instruction.operands.assign(bytes, bytes + operands);
+    }
+    code->push_back(std::move(instruction));
+    offset += 1 + operands;
+  }
+
+  for (Instruction &instruction : *code) {
+    if (!isJump(instruction.opcode))
+      continue;
+    if (instruction.target < 0 || instruction.target >= chunk.size() ||
+        indexAt[instruction.target] < 0)
+      return false;
+    instruction.target = indexAt[instruction.target];
+  }
+  return true;
+}
+
+namespace {
+
+// Values the instruction leaves on the stack minus those it takes off. A call
+// counts once it has returned: the callee and arguments become the result.
+int stackEffect(const Instruction &instruction) {
+  switch (instruction.opcode) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_0:
+  case OP_CONSTANT_1:
+  case OP_CONSTANT_2:
+  case OP_CONSTANT_3:
+  case OP_CONSTANT_4:
+  case OP_CONSTANT_5:
+  case OP_CONSTANT_6:
+  case OP_CONSTANT_7:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_LOCAL_0:
+  case OP_GET_LOCAL_1:
+  case OP_GET_LOCAL_2:
+  case OP_GET_LOCAL_3:
+  case OP_GET_LOCAL_4:
+  case OP_GET_LOCAL_5:
+  case OP_GET_LOCAL_6:
+  case OP_GET_LOCAL_7:
+  case OP_GET_GLOBAL:
+  case OP_GET_UPVALUE:
+  case OP_CLOSURE:
+  case OP_CLASS:
+  case OP_GET_LOCAL_PROPERTY:
+  case OP_GET_LOCAL_FIELD_SLOT:
+  case OP_ADD_LOCAL_CONSTANT:
+  case OP_SUBTRACT_LOCAL_CONSTANT:
+  case OP_LESS_LOCAL_CONSTANT:
+    return 1;
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return -instruction.operands[0];
+  case OP_INVOKE:
+  case OP_TAIL_INVOKE:
+    return -instruction.operands[1];
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+    return -instruction.operands[1] - 1;
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_PRINT:
+  case OP_CLOSE_UPVALUE:
+  case OP_RETURN:
+  case OP_INHERIT:
+  case OP_METHOD:
+  case OP_EQUAL_JUMP_IF_FALSE:
+  case OP_GREATER_JUMP_IF_FALSE:
+  case OP_LESS_JUMP_IF_FALSE:
+  case OP_NOT_EQUAL:
+  case OP_NOT_GREATER:
+  case OP_NOT_LESS:
+  case OP_NOT_EQUAL_JUMP_IF_FALSE:
+  case OP_NOT_GREATER_JUMP_IF_FALSE:
+  case OP_NOT_LESS_JUMP_IF_FALSE:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+    return -1;
+  default:
+    return 0;
+  }
+}
+
+} // namespace
+
+int maxStackDepth(const Chunk &chunk) {
+  Code code;
+  if (chunk.empty() || !decode(chunk, &code))
+    return -1;
+
+  // Depth on entry to each instruction. Every path into an instruction has to
+  // agree, as it does for anything the compiler emits.
+  int count = static_cast<int>(code.size());
+  std::vector<int> depthAt(count, -1);
+  std::vector<int> pending = {0};
+  depthAt[0] = 0;
+  int maxDepth = 0;
+  while (!pending.empty()) {
+    int i = pending.back();
+    pending.pop_back();
+    const Instruction &instruction = code[i];
+    int depth = depthAt[i] + stackEffect(instruction);
+    if (depth < 0)
+      return -1;
+    maxDepth = std::max(maxDepth, depth);
+
+    auto flowTo = [&](int next) {
+      if (next >= count)
+        return false;
+      if (depthAt[next] < 0) {
+        depthAt[next] = depth;
+        pending.push_back(next);
+      }
+      return depthAt[next] == depth;
+    };
+    if (fallsThrough(instruction.opcode) && !flowTo(i + 1))
+      return -1;
+    if (isJump(instruction.opcode) && !flowTo(instruction.target))
+      return -1;
+  }
+  return maxDepth;
+}
+
+} // namespace cpplox
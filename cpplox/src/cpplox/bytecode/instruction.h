@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+
+#include "chunk.h"
+
+namespace cpplox {
+
+// The chunk decoded into one entry per instruction, so passes can delete and
+// merge instructions without moving jump offsets around by hand.
+struct Instruction {
+  uint8_t opcode;
+  int line;
+  // The instruction a jump lands on, as an index into the list.
+  int target = -1;
+  std::vector<uint8_t> operands;
+  bool removed = false;
+};
+
+using Code = std::vector<Instruction>;
+
+bool isJump(uint8_t opcode);
+bool isUnconditionalJump(uint8_t opcode);
+bool fallsThrough(uint8_t opcode);
+// Operand bytes after the opcode at offset, or -1 for an opcode the decoder
+// does not know or a CLOSURE whose constant is not a function.
+int operandCount(const Chunk &chunk, int offset);
+// Fails when an instruction does not decode or a jump lands outside the chunk
+// or inside another instruction.
+bool decode(const Chunk &chunk, Code *code);
+
+// The most values the chunk's code can hold on the stack above the slots its
+// caller pushed, measured between instructions. Calls reserve this much, so
+// every chunk the VM runs must have it. Returns -1 when the code does not
+// decode, a jump leaves the chunk, or two paths into one instruction disagree
+// on the depth.
+int maxStackDepth(const Chunk &chunk);
+
+} // namespace cpplox
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "common.h"
+
+namespace cpplox {
+
+// Instruction set of the register tier. Register code is stored in an ordinary
+// Chunk. Operands are one-byte frame slots (A, B, C), one-byte constant
+// indexes (K) or big-endian 16-bit jump offsets, in the order listed.
+enum class RegisterOpcode : uint8_t {
+  Move,                     // A B      R[A] = R[B]
+  LoadConstant,             // A K      R[A] = K
+  LoadNil,                  // A
+  LoadTrue,                 // A
+  LoadFalse,                // A
+  GetGlobal,                // A K      R[A] = globals[K]
+  DefineGlobal,             // A K      globals[K] = R[A]
+  SetGlobal,                // A K      globals[K] = R[A], must exist
+  Equal,                    // A B C    R[A] = R[B] == R[C]
+  Greater,                  // A B C
+  Less,                     // A B C
+  Add,                      // A B C    R[A] = R[B] + R[C]
+  Subtract,                 // A B C
+  Multiply,                 // A B C
+  Divide,                   // A B C
+  AddConstant,              // A B K    R[A] = R[B] + K
+  SubtractConstant,         // A B K
+  Not,                      // A B
+  Negate,                   // A B
+  Print,                    // A
+  Jump,                     // off
+  Loop,                     // off      backward jump
+  JumpIfFalse,              // A off
+  JumpIfTrue,               // A off
+  JumpIfNotEqual,           // B C off
+  JumpIfEqual,              // B C off
+  JumpIfNotLess,            // B C off
+  JumpIfLess,               // B C off
+  JumpIfNotGreater,         // B C off
+  JumpIfGreater,            // B C off
+  JumpIfNotLessConstant,    // B K off
+  JumpIfNotGreaterConstant, // B K off
+  CallGlobal,               // K A argc R[A] = globals[K], then Call A argc
+  Call,                     // A argc   callee and arguments in R[A]...,
+                            //          result in R[A]
+  Closure,                  // A K
+  Return,                   // A
+  Count
+};
+
+constexpr uint8_t registerOpcodeByte(RegisterOpcode opcode) {
+  return static_cast<uint8_t>(opcode);
+}
+
+inline constexpr uint8_t ROP_MOVE = registerOpcodeByte(RegisterOpcode::Move);
+inline constexpr uint8_t ROP_LOAD_CONSTANT =
+    registerOpcodeByte(RegisterOpcode::LoadConstant);
+inline constexpr uint8_t ROP_LOAD_NIL =
+    registerOpcodeByte(RegisterOpcode::LoadNil);
+inline constexpr uint8_t ROP_LOAD_TRUE =
+    registerOpcodeByte(RegisterOpcode::LoadTrue);
+inline constexpr uint8_t ROP_LOAD_FALSE =
+    registerOpcodeByte(RegisterOpcode::LoadFalse);
+inline constexpr uint8_t ROP_GET_GLOBAL =
+    registerOpcodeByte(RegisterOpcode::GetGlobal);
+inline constexpr uint8_t ROP_DEFINE_GLOBAL =
+    registerOpcodeByte(RegisterOpcode::DefineGlobal);
+inline constexpr uint8_t ROP_SET_GLOBAL =
+    registerOpcodeByte(RegisterOpcode::SetGlobal);
+inline constexpr uint8_t ROP_EQUAL = registerOpcodeByte(RegisterOpcode::Equal);
+inline constexpr uint8_t ROP_GREATER =
+    registerOpcodeByte(RegisterOpcode::Greater);
+inline constexpr uint8_t ROP_LESS = registerOpcodeByte(RegisterOpcode::Less);
+inline constexpr uint8_t ROP_ADD = registerOpcodeByte(RegisterOpcode::Add);
+inline constexpr uint8_t ROP_SUBTRACT =
+    registerOpcodeByte(RegisterOpcode::Subtract);
+inline constexpr uint8_t ROP_MULTIPLY =
+    registerOpcodeByte(RegisterOpcode::Multiply);
+inline constexpr uint8_t ROP_DIVIDE =
+    registerOpcodeByte(RegisterOpcode::Divide);
+inline constexpr uint8_t ROP_ADD_CONSTANT =
+    registerOpcodeByte(RegisterOpcode::AddConstant);
+inline constexpr uint8_t ROP_SUBTRACT_CONSTANT =
+    registerOpcodeByte(RegisterOpcode::SubtractConstant);
+inline constexpr uint8_t ROP_NOT = registerOpcodeByte(RegisterOpcode::Not);
+inline constexpr uint8_t ROP_NEGATE =
+    registerOpcodeByte(RegisterOpcode::Negate);
+inline constexpr uint8_t ROP_PRINT = registerOpcodeByte(RegisterOpcode::Print);
+inline constexpr uint8_t ROP_JUMP = registerOpcodeByte(RegisterOpcode::Jump);
+inline constexpr uint8_t ROP_LOOP = registerOpcodeByte(RegisterOpcode::Loop);
+inline constexpr uint8_t ROP_JUMP_IF_FALSE =
+    registerOpcodeByte(RegisterOpcode::JumpIfFalse);
+inline constexpr uint8_t ROP_JUMP_IF_TRUE =
+    registerOpcodeByte(RegisterOpcode::JumpIfTrue);
+inline constexpr uint8_t ROP_JUMP_IF_NOT_EQUAL =
+    registerOpcodeByte(RegisterOpcode::JumpIfNotEqual);
+inline constexpr uint8_t ROP_JUMP_IF_EQUAL =
+    registerOpcodeByte(RegisterOpcode::JumpIfEqual);
+inline constexpr uint8_t ROP_JUMP_IF_NOT_LESS =
+    registerOpcodeByte(RegisterOpcode::JumpIfNotLess);
+inline constexpr uint8_t ROP_JUMP_IF_LESS =
+    registerOpcodeByte(RegisterOpcode::JumpIfLess);
+inline constexpr uint8_t ROP_JUMP_IF_NOT_GREATER =
+    registerOpcodeByte(RegisterOpcode::JumpIfNotGreater);
+inline constexpr uint8_t ROP_JUMP_IF_GREATER =
+    registerOpcodeByte(RegisterOpcode::JumpIfGreater);
+inline constexpr uint8_t ROP_JUMP_IF_NOT_LESS_CONSTANT =
+    registerOpcodeByte(RegisterOpcode::JumpIfNotLessConstant);
+inline constexpr uint8_t ROP_JUMP_IF_NOT_GREATER_CONSTANT =
+    registerOpcodeByte(RegisterOpcode::JumpIfNotGreaterConstant);
+inline constexpr uint8_t ROP_CALL_GLOBAL =
+    registerOpcodeByte(RegisterOpcode::CallGlobal);
+inline constexpr uint8_t ROP_CALL = registerOpcodeByte(RegisterOpcode::Call);
+inline constexpr uint8_t ROP_CLOSURE =
+    registerOpcodeByte(RegisterOpcode::Closure);
+inline constexpr uint8_t ROP_RETURN =
+    registerOpcodeByte(RegisterOpcode::Return);
+inline constexpr int ROP_COUNT = static_cast<int>(RegisterOpcode::Count);
+
+inline constexpr const char *kRegisterOpcodeNames[] = {
+    "ROP_MOVE",
+    "ROP_LOAD_CONSTANT",
+    "ROP_LOAD_NIL",
+    "ROP_LOAD_TRUE",
+    "ROP_LOAD_FALSE",
+    "ROP_GET_GLOBAL",
+    "ROP_DEFINE_GLOBAL",
+    "ROP_SET_GLOBAL",
+    "ROP_EQUAL",
+    "ROP_GREATER",
+    "ROP_LESS",
+    "ROP_ADD",
+    "ROP_SUBTRACT",
+    "ROP_MULTIPLY",
+    "ROP_DIVIDE",
+    "ROP_ADD_CONSTANT",
+    "ROP_SUBTRACT_CONSTANT",
+    "ROP_NOT",
+    "ROP_NEGATE",
+    "ROP_PRINT",
+    "ROP_JUMP",
+    "ROP_LOOP",
+    "ROP_JUMP_IF_FALSE",
+    "ROP_JUMP_IF_TRUE",
+    "ROP_JUMP_IF_NOT_EQUAL",
+    "ROP_JUMP_IF_EQUAL",
+    "ROP_JUMP_IF_NOT_LESS",
+    "ROP_JUMP_IF_LESS",
+    "ROP_JUMP_IF_NOT_GREATER",
+    "ROP_JUMP_IF_GREATER",
+    "ROP_JUMP_IF_NOT_LESS_CONSTANT",
+    "ROP_JUMP_IF_NOT_GREATER_CONSTANT",
+    "ROP_CALL_GLOBAL",
+    "ROP_CALL",
+    "ROP_CLOSURE",
+    "ROP_RETURN",
+};
+static_assert(sizeof(kRegisterOpcodeNames) / sizeof(kRegisterOpcodeNames[0]) ==
+                  ROP_COUNT,
+              "every register opcode needs a name");
+
+} // namespace cpplox
@@ -0,0 +1,221 @@
+#include <cstddef>
+#include <vector>
+
+#include "bytecode_file.h"
+#include "chunk.h"
+#include "instruction.h"
+#include "vm.h"
+
+namespace cpplox {
+
+namespace {
+
+constexpr uint32_t kMagic = 0x43584f4c; // "LOXC" read as a little-endian word.
+constexpr uint32_t kFormatVersion = 2;
+// Header flags.
+constexpr uint32_t kOptimized = 1;
+
+enum class ConstantTag : uint8_t { Number, String, Function };
+
+struct Header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t opcodeCount;
+  uint32_t flags;
+  uint64_t sourceHash;
+  // Of everything after the header.
+  uint64_t checksum;
+};
+
+void putString(BinaryWriter &writer, const ObjString *string) {
+  writer.put<uint32_t>(static_cast<uint32_t>(string->length));
+  writer.putBytes(string->chars, static_cast<size_t>(string->length));
+}
+
+bool writeFunction(BinaryWriter &writer, const ObjFunction *function) {
+  if (!function->lazySource.empty())
+    return false;
+  writer.put<int32_t>(function->arity);
+  writer.put<int32_t>(function->upvalueCount);
+  writer.put<uint8_t>(function->name != nullptr);
+  if (function->name != nullptr)
+    putString(writer, function->name);
+
+  const Chunk &chunk = function->chunk;
+  writeCode(writer, chunk);
+
+  writer.put<uint32_t>(static_cast<uint32_t>(chunk.constants().size()));
+  for (Value constant : chunk.constants()) {
+    if (isNumber(constant)) {
+      writer.put(ConstantTag::Number);
+      writer.put<double>(asNumber(constant));
+    } else if (isString(constant)) {
+      writer.put(ConstantTag::String);
+      putString(writer, asString(constant));
+    } else if (isFunction(constant)) {
+      writer.put(ConstantTag::Function);
+      if (!writeFunction(writer, asFunction(constant)))
+        return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+ObjString *readString(Vm &vm, BinaryReader &reader) {
+  uint32_t length = reader.get<uint32_t>();
+  const uint8_t *chars = reader.take(length);
+  if (chars == nullptr || length > INT32_MAX)
+    return nullptr;
+  return vm.copyString(reinterpret_cast<const char *>(chars),
+                       static_cast<int>(length));
+}
+
+// Fills a function that is already registered as a compiler root, so
+// everything allocated while reading it stays reachable.
+bool readFunctionBody(Vm &vm, BinaryReader &reader, ObjFunction *function);
+
+ObjFunction *readFunction(Vm &vm, BinaryReader &reader) {
+  ObjFunction *function = vm.newFunction();
+  vm.addCompilerRoot(function);
+  bool ok = readFunctionBody(vm, reader, function);
+  vm.popCompilerRoot();
+  return ok ? function : nullptr;
+}
+
+bool readFunctionBody(Vm &vm, BinaryReader &reader, ObjFunction *function) {
+  function->arity = reader.get<int32_t>();
+  function->upvalueCount = reader.get<int32_t>();
+  if (function->arity < 0 || function->arity >= kUint8Count ||
+      function->upvalueCount < 0 || function->upvalueCount > kUint8Count)
+    return false;
+  if (reader.get<uint8_t>() != 0) {
+    function->name = readString(vm, reader);
+    if (function->name == nullptr)
+      return false;
+    vm.heap.shade(function->name);
+  }
+
+  Chunk &chunk = function->chunk;
+  if (!readCode(reader, chunk))
+    return false;
+
+  uint32_t constantCount = reader.get<uint32_t>();
+  if (constantCount > kUint8Count)
+    return false;
+  for (uint32_t i = 0; i < constantCount; i++) {
+    Value constant;
+    switch (reader.get<ConstantTag>()) {
+    case ConstantTag::Number:
+      constant = numberValue(reader.get<double>());
+      break;
+    case ConstantTag::String: {
+      ObjString *string = readString(vm, reader);
+      if (string == nullptr)
+        return false;
+      constant = objectValue(string);
+      break;
+    }
+    case ConstantTag::Function: {
+      ObjFunction *nested = readFunction(vm, reader);
+      if (nested == nullptr)
+        return false;
+      constant = objectValue(nested);
+      break;
+    }
+    default:
+      return false;
+    }
+    if (!reader.ok() || chunk.addConstant(constant) != static_cast<int>(i))
+      return false;
+    if (isObj(constant))
+      vm.heap.shade(asObj(constant));
+  }
+  function->maxStack = maxStackDepth(chunk);
+  return reader.ok() && function->maxStack >= 0;
+}
+
+} // namespace
+
+void writeCode(BinaryWriter &writer, const Chunk &chunk) {
+  writer.put<uint32_t>(static_cast<uint32_t>(chunk.size()));
+  writer.putBytes(chunk.codeData(), static_cast<size_t>(chunk.size()));
+
+  // Lines as (line, length) runs, the chunk's own line table.
+  const std::vector<LineStart> &starts = chunk.lineStarts();
+  writer.put<uint32_t>(static_cast<uint32_t>(starts.size()));
+  for (size_t i = 0; i < starts.size(); i++) {
+    int end = i + 1 < starts.size() ? starts[i + 1].offset : chunk.size();
+    writer.put<int32_t>(starts[i].line);
+    writer.put<uint32_t>(static_cast<uint32_t>(end - starts[i].offset));
+  }
+}
+
+bool readCode(BinaryReader &reader, Chunk &chunk) {
+  uint32_t codeSize = reader.get<uint32_t>();
+  const uint8_t *code = reader.take(codeSize);
+  uint32_t runCount = reader.get<uint32_t>();
+  if (code == nullptr || !reader.ok())
+    return false;
+
+  uint32_t offset = 0;
+  for (uint32_t run = 0; run < runCount; run++) {
+    int32_t line = reader.get<int32_t>();
+    uint32_t length = reader.get<uint32_t>();
+    if (!reader.ok() || length > codeSize - offset)
+      return false;
+    for (uint32_t i = 0; i < length; i++) {
+      chunk.write(code[offset++], line);
+    }
+  }
+  return offset == codeSize;
+}
+
+std::string bytecodePath(std::string_view sourcePath) {
+  return std::string(sourcePath) + "c";
+}
+
+uint64_t hashSource(std::string_view source) {
+  return checksum(source.data(), source.size());
+}
+
+bool writeBytecodeFile(const std::string &path, const ObjFunction *function,
+                       uint64_t sourceHash, bool optimized) {
+  BinaryWriter writer;
+  writer.put(Header{kMagic, kFormatVersion, static_cast<uint32_t>(OP_COUNT),
+                    optimized ? kOptimized : 0, sourceHash, 0});
+  if (!writeFunction(writer, function))
+    return false;
+  const std::string &buffer = writer.buffer();
+  writer.patch(offsetof(Header, checksum),
+               checksum(buffer.data() + sizeof(Header),
+                        buffer.size() - sizeof(Header)));
+
+  return writeFileAtomically(path, writer.buffer());
+}
+
+ObjFunction *readBytecodeFile(Vm &vm, const std::string &path,
+                              uint64_t sourceHash, bool optimized) {
+  MappedFile file(path);
+  if (file.data() == nullptr)
+    return nullptr;
+
+  BinaryReader reader(file.data(), file.size());
+  Header header = reader.get<Header>();
+  if (!reader.ok() || header.magic != kMagic ||
+      header.version != kFormatVersion ||
+      header.opcodeCount != static_cast<uint32_t>(OP_COUNT) ||
+      header.flags != (optimized ? kOptimized : 0) ||
+      header.sourceHash != sourceHash ||
+      header.checksum != checksum(file.data() + sizeof(Header),
+                                  file.size() - sizeof(Header)))
+    return nullptr;
+
+  ObjFunction *function = readFunction(vm, reader);
+  if (function == nullptr || !reader.atEnd())
+    return nullptr;
+  return function;
+}
+
+} // namespace cpplox
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "binary_io.h"
+#include "object.h"
+
+namespace cpplox {
+
+class Vm;
+
+// A compiled script cached next to its source, script.lox -> script.loxc. The
+// header records the format version, the opcode count, whether the optimizer
+// ran, a hash of the source and a checksum of the rest of the file, so an
+// edited script, a different build of cpplox, a run with --no-optimize or a
+// damaged file is ignored.
+std::string bytecodePath(std::string_view sourcePath);
+uint64_t hashSource(std::string_view source);
+bool writeBytecodeFile(const std::string &path, const ObjFunction *function,
+                       uint64_t sourceHash, bool optimized);
+// Maps the file read-only and rebuilds the script function and every function
+// nested in it, interning their strings. Returns nullptr when the file is
+// missing, stale or malformed.
+ObjFunction *readBytecodeFile(Vm &vm, const std::string &path,
+                              uint64_t sourceHash, bool optimized);
+
+// A chunk's code and line table, shared with heap snapshots. readCode appends
+// to the chunk and returns false when the data is malformed.
+void writeCode(BinaryWriter &writer, const Chunk &chunk);
+bool readCode(BinaryReader &reader, Chunk &chunk);
+
+} // namespace cpplox
@@ -2,12 +2,16 @@
 #include <cstring>
 
 #include <array>
+#include <initializer_list>
 #include <iostream>
 #include <string_view>
+#include <utility>
 
 #include "common.h"
 #include "compiler.h"
+#include "instruction.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -58,6 +62,14 @@ inline constexpr FunctionType TYPE_INITIALIZER = FunctionType::Initializer;
 inline constexpr FunctionType TYPE_METHOD = FunctionType::Method;
 inline constexpr FunctionType TYPE_SCRIPT = FunctionType::Script;
 
+// An instruction at the end of the chunk that a following one may fuse with.
+struct FusibleOp {
+  uint8_t opcode = 0;
+  uint8_t operand = 0;
+  int start = -1;
+  int end = -1;
+};
+
 struct FunctionCompiler {
   FunctionCompiler *enclosing;
   ObjFunction *function;
@@ -68,6 +80,9 @@ struct FunctionCompiler {
   std::array<Upvalue, kUint8Count> upvalues;
   int scopeDepth;
   int logicalByteCount;
+  // The last two fusible instructions, oldest first. Cleared at every jump
+  // target and rewrite so a superinstruction never spans either.
+  std::array<FusibleOp, 2> fusibleOps;
 };
 
 struct LoopStart {
@@ -95,8 +110,10 @@ static int chunkSize(Chunk *chunk) {
 
 class Compiler {
 public:
-  Compiler(Vm &vm, std::string_view source);
+  Compiler(Vm &vm, std::string_view source, int line = 1);
   ObjFunction *compile();
+  bool compileLazy(ObjFunction *function);
+  bool deferredAny() const { return deferredAny_; }
 
 private:
   Chunk *currentChunk();
@@ -116,6 +133,12 @@ private:
   uint8_t makeConstant(Value value);
   void emitConstant(Value value);
   void patchJump(int offset);
+  void noteFusible(uint8_t opcode, int start, uint8_t operand = 0);
+  void forgetFusible();
+  bool tailIsLocalConstant();
+  void rewriteTail(int start, std::initializer_list<uint8_t> bytes, int line);
+  void emitBinaryOp(uint8_t opcode, uint8_t localConstantOp);
+  void emitTailCall();
   void initCompiler(FunctionCompiler *compiler, FunctionType type);
   ObjFunction *endCompiler();
   void beginScope();
@@ -154,6 +177,9 @@ private:
   void this_(bool canAssign);
   void unary(bool canAssign);
   void block();
+  void skipBlock();
+  void parameters();
+  bool canDeferBody() const;
   void function(FunctionType type);
   void method();
   void classDeclaration();
@@ -176,10 +202,11 @@ private:
   ClassCompiler *currentClass = nullptr;
   std::array<ObjString *, kUint8Count> knownGlobals{};
   int knownGlobalCount = 0;
+  bool deferredAny_ = false;
 };
 
-Compiler::Compiler(Vm &vm, std::string_view source) : vm(vm) {
-  scanner.reset(source);
+Compiler::Compiler(Vm &vm, std::string_view source, int line) : vm(vm) {
+  scanner.reset(source, line);
 }
 
 Chunk *Compiler::currentChunk() { return &current->function->chunk; }
@@ -188,6 +215,7 @@ LoopStart Compiler::currentLoopStart() {
   LoopStart start;
   start.code = chunkSize(currentChunk());
   start.logical = current->logicalByteCount;
+  forgetFusible();
   return start;
 }
 
@@ -264,6 +292,25 @@ void Compiler::emitLoop(LoopStart loopStart) {
   emitByte(offset & 0xff);
 }
 int Compiler::emitJump(uint8_t instruction) {
+  const FusibleOp &condition = current->fusibleOps[1];
+  if (instruction == OP_JUMP_IF_FALSE &&
+      condition.end == chunkSize(currentChunk())) {
+    uint8_t fused = 0;
+    if (condition.opcode == OP_EQUAL) {
+      fused = OP_EQUAL_JUMP_IF_FALSE;
+    } else if (condition.opcode == OP_GREATER) {
+      fused = OP_GREATER_JUMP_IF_FALSE;
+    } else if (condition.opcode == OP_LESS) {
+      fused = OP_LESS_JUMP_IF_FALSE;
+    }
+    if (fused != 0) {
+      rewriteTail(condition.start, {fused, 0xff, 0xff},
+                  currentChunk()->lineAt(condition.start));
+      current->logicalByteCount += 3;
+      return chunkSize(currentChunk()) - 2;
+    }
+  }
+
   emitByte(instruction);
   emitByte(0xff);
   emitByte(0xff);
@@ -290,11 +337,13 @@ uint8_t Compiler::makeConstant(Value value) {
 }
 void Compiler::emitConstant(Value value) {
   uint8_t constant = makeConstant(value);
+  int start = chunkSize(currentChunk());
   if (constant <= 7) {
     emitByte((uint8_t)(OP_CONSTANT_0 + constant));
   } else {
     emitBytes(OP_CONSTANT, constant);
   }
+  noteFusible(OP_CONSTANT, start, constant);
 }
 void Compiler::patchJump(int offset) {
 
@@ -306,6 +355,45 @@ void Compiler::patchJump(int offset) {
 
   currentChunk()->byteAt(offset) = (jump >> 8) & 0xff;
   currentChunk()->byteAt(offset + 1) = jump & 0xff;
+  forgetFusible();
+}
+void Compiler::noteFusible(uint8_t opcode, int start, uint8_t operand) {
+  current->fusibleOps[0] = current->fusibleOps[1];
+  current->fusibleOps[1] = {opcode, operand, start, chunkSize(currentChunk())};
+}
+void Compiler::forgetFusible() { current->fusibleOps = {}; }
+bool Compiler::tailIsLocalConstant() {
+  const FusibleOp &local = current->fusibleOps[0];
+  const FusibleOp &constant = current->fusibleOps[1];
+  return local.opcode == OP_GET_LOCAL && constant.opcode == OP_CONSTANT &&
+         local.end == constant.start &&
+         constant.end == chunkSize(currentChunk());
+}
+// Replaces the instructions from start onward with a superinstruction. The
+// logical byte count is left alone; callers add the size of the instruction
+// they would otherwise have emitted.
+void Compiler::rewriteTail(int start, std::initializer_list<uint8_t> bytes,
+                           int line) {
+  Chunk *chunk = currentChunk();
+  chunk->truncate(start);
+  for (uint8_t byte : bytes) {
+    writeChunk(chunk, byte, line);
+  }
+  forgetFusible();
+}
+void Compiler::emitBinaryOp(uint8_t opcode, uint8_t localConstantOp) {
+  if (localConstantOp != 0 && tailIsLocalConstant()) {
+    const FusibleOp &local = current->fusibleOps[0];
+    const FusibleOp &constant = current->fusibleOps[1];
+    rewriteTail(local.start, {localConstantOp, local.operand, constant.operand},
+                parser.previous.line);
+    current->logicalByteCount++;
+    return;
+  }
+
+  int start = chunkSize(currentChunk());
+  emitByte(opcode);
+  noteFusible(opcode, start);
 }
 
 void Compiler::initCompiler(FunctionCompiler *compiler, FunctionType type) {
@@ -315,6 +403,7 @@ void Compiler::initCompiler(FunctionCompiler *compiler, FunctionType type) {
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
   compiler->logicalByteCount = 0;
+  compiler->fusibleOps = {};
   current = compiler;
   compiler->function = vm.newFunction();
   vm.addCompilerRoot(compiler->function);
@@ -339,6 +428,15 @@ void Compiler::initCompiler(FunctionCompiler *compiler, FunctionType type) {
 ObjFunction *Compiler::endCompiler() {
   emitReturn();
   ObjFunction *function = current->function;
+  if (vm.optimizeBytecode && !parser.hadError)
+    optimizeChunk(function->chunk);
+  if (!parser.hadError) {
+    function->maxStack = maxStackDepth(function->chunk);
+    // Calls reserve maxStack slots, so code whose depth can't be bounded must
+    // not run. The compiler only emits such code if it has a bug.
+    if (function->maxStack < 0)
+      error("Internal error: could not bound the stack depth.");
+  }
 
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
@@ -441,6 +539,7 @@ bool Compiler::discardPureExpression(int start) {
   }
   if (depth == 1) {
     chunk->truncate(start);
+    forgetFusible();
     return true;
   }
   return false;
@@ -600,25 +699,25 @@ void Compiler::binary(bool canAssign) {
     emitBytes(OP_EQUAL, OP_NOT);
     break;
   case TOKEN_EQUAL_EQUAL:
-    emitByte(OP_EQUAL);
+    emitBinaryOp(OP_EQUAL, 0);
     break;
   case TOKEN_GREATER:
-    emitByte(OP_GREATER);
+    emitBinaryOp(OP_GREATER, 0);
     break;
   case TOKEN_GREATER_EQUAL:
     emitBytes(OP_LESS, OP_NOT);
     break;
   case TOKEN_LESS:
-    emitByte(OP_LESS);
+    emitBinaryOp(OP_LESS, OP_LESS_LOCAL_CONSTANT);
     break;
   case TOKEN_LESS_EQUAL:
     emitBytes(OP_GREATER, OP_NOT);
     break;
   case TOKEN_PLUS:
-    emitByte(OP_ADD);
+    emitBinaryOp(OP_ADD, OP_ADD_LOCAL_CONSTANT);
     break;
   case TOKEN_MINUS:
-    emitByte(OP_SUBTRACT);
+    emitBinaryOp(OP_SUBTRACT, OP_SUBTRACT_LOCAL_CONSTANT);
     break;
   case TOKEN_STAR:
     emitByte(OP_MULTIPLY);
@@ -632,7 +731,9 @@ void Compiler::binary(bool canAssign) {
 }
 void Compiler::call(bool canAssign) {
   uint8_t argCount = argumentList();
+  int start = chunkSize(currentChunk());
   emitBytes(OP_CALL, argCount);
+  noteFusible(OP_CALL, start);
 }
 void Compiler::dot(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
@@ -643,10 +744,20 @@ void Compiler::dot(bool canAssign) {
     emitBytes(OP_SET_PROPERTY, name);
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
+    int start = chunkSize(currentChunk());
     emitBytes(OP_INVOKE, name);
     emitByte(argCount);
+    noteFusible(OP_INVOKE, start);
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    const FusibleOp &receiver = current->fusibleOps[1];
+    if (receiver.opcode == OP_GET_LOCAL &&
+        receiver.end == chunkSize(currentChunk())) {
+      rewriteTail(receiver.start, {OP_GET_LOCAL_PROPERTY, receiver.operand, name},
+                  parser.previous.line);
+      current->logicalByteCount += 2;
+    } else {
+      emitBytes(OP_GET_PROPERTY, name);
+    }
   }
 }
 
@@ -719,12 +830,14 @@ void Compiler::namedVariable(Token name, bool canAssign) {
       emitBytes(setOp, (uint8_t)arg);
     }
   } else {
-
+    int start = chunkSize(currentChunk());
     if (getOp == OP_GET_LOCAL && arg >= 0 && arg <= 7) {
       emitByte((uint8_t)(OP_GET_LOCAL_0 + arg));
     } else {
       emitBytes(getOp, (uint8_t)arg);
     }
+    if (getOp == OP_GET_LOCAL)
+      noteFusible(OP_GET_LOCAL, start, (uint8_t)arg);
   }
 }
 
@@ -753,8 +866,10 @@ void Compiler::super_(bool canAssign) {
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
+    int start = chunkSize(currentChunk());
     emitBytes(OP_SUPER_INVOKE, name);
     emitByte(argCount);
+    noteFusible(OP_SUPER_INVOKE, start);
   } else {
     namedVariable(syntheticToken("super"), false);
     emitBytes(OP_GET_SUPER, name);
@@ -873,9 +988,23 @@ void Compiler::block() {
 
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
-void Compiler::function(FunctionType type) {
-  FunctionCompiler compiler;
-  initCompiler(&compiler, type);
+// Passes over a block without compiling it, matching braces by token so
+// strings and comments are skipped correctly. Scanner errors are still
+// reported.
+void Compiler::skipBlock() {
+  int depth = 1;
+  while (!check(TOKEN_EOF)) {
+    if (check(TOKEN_LEFT_BRACE)) {
+      depth++;
+    } else if (check(TOKEN_RIGHT_BRACE) && --depth == 0) {
+      break;
+    }
+    advance();
+  }
+
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+void Compiler::parameters() {
   beginScope();
 
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
@@ -891,9 +1020,36 @@ void Compiler::function(FunctionType type) {
   }
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
   consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  block();
+}
+// A function declared at the top level of the script has no enclosing locals
+// to capture, so its body can be compiled on its own later.
+bool Compiler::canDeferBody() const {
+  return vm.lazyFunctions && !parser.hadError &&
+         current->enclosing->type == TYPE_SCRIPT &&
+         current->enclosing->scopeDepth == 0;
+}
+void Compiler::function(FunctionType type) {
+  FunctionCompiler compiler;
+  initCompiler(&compiler, type);
+  Token header = parser.current;
+  parameters();
 
-  ObjFunction *function = endCompiler();
+  ObjFunction *function;
+  if (canDeferBody()) {
+    skipBlock();
+    function = current->function;
+    const char *end = parser.previous.start + parser.previous.length;
+    function->lazySource = {header.start,
+                            static_cast<size_t>(end - header.start)};
+    function->lazyLine = header.line;
+    function->lazyMethod = type != TYPE_FUNCTION;
+    deferredAny_ = true;
+    current = current->enclosing;
+    vm.popCompilerRoot();
+  } else {
+    block();
+    function = endCompiler();
+  }
 
   emitBytes(OP_CLOSURE, makeConstant(objectValue(function)));
 
@@ -1056,6 +1212,22 @@ void Compiler::printStatement() {
   consume(TOKEN_SEMICOLON, "Expect ';' after value.");
   emitByte(OP_PRINT);
 }
+// A call that ends a return value becomes a tail call. The OP_RETURN after it
+// still runs when the callee is native and pushes no frame.
+void Compiler::emitTailCall() {
+  const FusibleOp &last = current->fusibleOps[1];
+  if (last.end != chunkSize(currentChunk()))
+    return;
+
+  uint8_t &opcode = currentChunk()->byteAt(last.start);
+  if (last.opcode == OP_CALL) {
+    opcode = OP_TAIL_CALL;
+  } else if (last.opcode == OP_INVOKE) {
+    opcode = OP_TAIL_INVOKE;
+  } else if (last.opcode == OP_SUPER_INVOKE) {
+    opcode = OP_TAIL_SUPER_INVOKE;
+  }
+}
 void Compiler::returnStatement() {
   if (current->type == TYPE_SCRIPT) {
     error("Can't return from top-level code.");
@@ -1070,6 +1242,7 @@ void Compiler::returnStatement() {
 
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    emitTailCall();
     emitByte(OP_RETURN);
   }
 }
@@ -1166,9 +1339,58 @@ ObjFunction *Compiler::compile() {
   return parser.hadError ? nullptr : function;
 }
 
+// Compiles into a new function, as the script compiler would have, and moves
+// the code over. The lazy function may already have been marked by a cycle in
+// progress, so its constants go through the write barrier.
+bool Compiler::compileLazy(ObjFunction *function) {
+  ClassCompiler classCompiler{nullptr, false};
+  FunctionType type = TYPE_FUNCTION;
+  if (function->lazyMethod) {
+    currentClass = &classCompiler;
+    type = function->name->length == 4 &&
+                   std::memcmp(function->name->chars, "init", 4) == 0
+               ? TYPE_INITIALIZER
+               : TYPE_METHOD;
+  }
+
+  parser.previous = syntheticToken(function->name->chars);
+  FunctionCompiler compiler;
+  initCompiler(&compiler, type);
+  advance();
+  parameters();
+  block();
+  ObjFunction *compiled = endCompiler();
+  if (parser.hadError)
+    return false;
+
+  function->chunk = std::move(compiled->chunk);
+  function->maxStack = compiled->maxStack;
+  function->lazySource = {};
+  for (Value constant : function->chunk.constants()) {
+    vm.heap.writeBarrier(function, constant);
+  }
+  return true;
+}
+
 ObjFunction *compile(Vm &vm, std::string_view source) {
-  Compiler compiler(vm, source);
-  return compiler.compile();
+  if (!vm.lazyFunctions) {
+    Compiler compiler(vm, source);
+    return compiler.compile();
+  }
+
+  // Skipped bodies point into the source, so the VM keeps a copy of it for as
+  // long as it runs.
+  std::string_view retained = vm.retainedSources.emplace_back(source);
+  Compiler compiler(vm, retained);
+  ObjFunction *function = compiler.compile();
+  if (function == nullptr || !compiler.deferredAny())
+    vm.retainedSources.pop_back();
+  return function;
+}
+
+bool compileLazyFunction(Vm &vm, ObjFunction *function) {
+  Compiler compiler(vm, function->lazySource, function->lazyLine);
+  return compiler.compileLazy(function);
 }
 
 } // namespace cpplox
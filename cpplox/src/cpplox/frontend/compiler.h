@@ -8,5 +8,8 @@
 namespace cpplox {
 
 ObjFunction *compile(Vm &vm, std::string_view source);
+// Compiles a body compile() skipped under --lazy-functions. Reports errors the
+// way compile() does and returns false.
+bool compileLazyFunction(Vm &vm, ObjFunction *function);
 
 } // namespace cpplox
@@ -0,0 +1,490 @@
+#include <bitset>
+#include <initializer_list>
+#include <vector>
+
+#include "common.h"
+#include "instruction.h"
+#include "object.h"
+#include "optimizer.h"
+
+namespace cpplox {
+
+namespace {
+
+using Slots = std::bitset<kUint8Count>;
+
+// Every pass shrinks the code or shortens a jump chain, so this is only a
+// guard against a pass that keeps undoing another.
+constexpr int kMaxRounds = 16;
+
+std::vector<bool> jumpTargets(const Code &code) {
+  std::vector<bool> targets(code.size(), false);
+  for (const Instruction &instruction : code) {
+    if (isJump(instruction.opcode))
+      targets[instruction.target] = true;
+  }
+  return targets;
+}
+
+// Drops removed instructions. A jump to one lands on the next survivor, which
+// is where control would have gone through it.
+void compact(Code *code) {
+  std::vector<int> newIndex(code->size());
+  int count = 0;
+  for (size_t i = 0; i < code->size(); i++) {
+    newIndex[i] = count;
+    if (!(*code)[i].removed)
+      count++;
+  }
+
+  Code kept;
+  kept.reserve(count);
+  for (Instruction &instruction : *code) {
+    if (instruction.removed)
+      continue;
+    if (isJump(instruction.opcode))
+      instruction.target = newIndex[instruction.target];
+    kept.push_back(std::move(instruction));
+  }
+  *code = std::move(kept);
+}
+
+int constantIndex(const Instruction &instruction) {
+  if (instruction.opcode == OP_CONSTANT)
+    return instruction.operands[0];
+  if (instruction.opcode >= OP_CONSTANT_0 &&
+      instruction.opcode <= OP_CONSTANT_7)
+    return instruction.opcode - OP_CONSTANT_0;
+  return -1;
+}
+
+bool numberConstant(const Chunk &chunk, const Instruction &instruction,
+                    double *number) {
+  int index = constantIndex(instruction);
+  if (index < 0 || !isNumber(chunk.constantAt(index)))
+    return false;
+  *number = asNumber(chunk.constantAt(index));
+  return true;
+}
+
+// Turns instruction into a load of number, reusing an identical constant.
+// Returns false when the constant table is full.
+bool loadNumber(Chunk &chunk, double number, Instruction *instruction) {
+  Value value = numberValue(number);
+  int index = -1;
+  const ValueArray &constants = chunk.constants();
+  for (size_t i = 0; i < constants.size() && index < 0; i++) {
+    if (constants[i].bits() == value.bits())
+      index = static_cast<int>(i);
+  }
+  if (index < 0) {
+    if (static_cast<int>(constants.size()) >= kUint8Count)
+      return false;
+    index = chunk.addConstant(value);
+  }
+
+  instruction->operands.clear();
+  if (index <= 7) {
+    instruction->opcode = static_cast<uint8_t>(OP_CONSTANT_0 + index);
+  } else {
+    instruction->opcode = OP_CONSTANT;
+    instruction->operands.push_back(static_cast<uint8_t>(index));
+  }
+  return true;
+}
+
+void loadBool(bool value, Instruction *instruction) {
+  instruction->opcode = value ? OP_TRUE : OP_FALSE;
+  instruction->operands.clear();
+}
+
+// Constants are numbers, strings and functions, all truthy.
+bool isLiteral(const Instruction &instruction) {
+  return constantIndex(instruction) >= 0 || instruction.opcode == OP_TRUE ||
+         instruction.opcode == OP_FALSE || instruction.opcode == OP_NIL;
+}
+
+bool isFalseyLiteral(const Instruction &instruction) {
+  return instruction.opcode == OP_FALSE || instruction.opcode == OP_NIL;
+}
+
+bool foldBinary(uint8_t opcode, double a, double b, Chunk &chunk,
+                Instruction *instruction) {
+  switch (opcode) {
+  case OP_ADD:
+    return loadNumber(chunk, a + b, instruction);
+  case OP_SUBTRACT:
+    return loadNumber(chunk, a - b, instruction);
+  case OP_MULTIPLY:
+    return loadNumber(chunk, a * b, instruction);
+  case OP_DIVIDE:
+    return loadNumber(chunk, a / b, instruction);
+  case OP_EQUAL:
+    loadBool(a == b, instruction);
+    return true;
+  case OP_GREATER:
+    loadBool(a > b, instruction);
+    return true;
+  case OP_LESS:
+    loadBool(a < b, instruction);
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Evaluates arithmetic and comparisons on two number constants, negation of
+// one, and NOT of any literal, and settles jumps on a literal condition. Only
+// numbers are folded, so nothing that could raise a runtime error is removed.
+bool foldConstants(Chunk &chunk, Code &code) {
+  std::vector<bool> targets = jumpTargets(code);
+  bool changed = false;
+  for (size_t i = 0; i + 1 < code.size(); i++) {
+    Instruction &first = code[i];
+    const Instruction &second = code[i + 1];
+    if (targets[i + 1])
+      continue;
+
+    double a;
+    double b;
+    if (i + 2 < code.size() && !targets[i + 2] &&
+        numberConstant(chunk, first, &a) &&
+        numberConstant(chunk, second, &b) &&
+        foldBinary(code[i + 2].opcode, a, b, chunk, &first)) {
+      code[i + 1].removed = true;
+      code[i + 2].removed = true;
+      changed = true;
+      i += 2;
+    } else if (second.opcode == OP_NEGATE &&
+               numberConstant(chunk, first, &a) &&
+               loadNumber(chunk, -a, &first)) {
+      code[i + 1].removed = true;
+      changed = true;
+      i++;
+    } else if (second.opcode == OP_NOT && isLiteral(first)) {
+      loadBool(isFalseyLiteral(first), &first);
+      code[i + 1].removed = true;
+      changed = true;
+      i++;
+    } else if (second.opcode == OP_JUMP_IF_FALSE && isLiteral(first)) {
+      // The condition is still popped on both paths, so it stays.
+      if (isFalseyLiteral(first)) {
+        code[i + 1].opcode = OP_JUMP;
+      } else {
+        code[i + 1].removed = true;
+      }
+      changed = true;
+      i++;
+    }
+  }
+  return changed;
+}
+
+uint8_t negatedComparison(uint8_t opcode) {
+  switch (opcode) {
+  case OP_EQUAL:
+    return OP_NOT_EQUAL;
+  case OP_GREATER:
+    return OP_NOT_GREATER;
+  case OP_LESS:
+    return OP_NOT_LESS;
+  default:
+    return 0;
+  }
+}
+
+uint8_t comparisonJump(uint8_t opcode) {
+  switch (opcode) {
+  case OP_EQUAL:
+    return OP_EQUAL_JUMP_IF_FALSE;
+  case OP_GREATER:
+    return OP_GREATER_JUMP_IF_FALSE;
+  case OP_LESS:
+    return OP_LESS_JUMP_IF_FALSE;
+  case OP_NOT_EQUAL:
+    return OP_NOT_EQUAL_JUMP_IF_FALSE;
+  case OP_NOT_GREATER:
+    return OP_NOT_GREATER_JUMP_IF_FALSE;
+  case OP_NOT_LESS:
+    return OP_NOT_LESS_JUMP_IF_FALSE;
+  default:
+    return 0;
+  }
+}
+
+// EQUAL NOT, GREATER NOT and LESS NOT become one instruction, and a comparison
+// followed by JUMP_IF_FALSE becomes the fused jump, as the compiler does for
+// the plain comparisons it can see directly.
+bool fuseComparisons(Chunk &, Code &code) {
+  std::vector<bool> targets = jumpTargets(code);
+  bool changed = false;
+  for (size_t i = 0; i + 1 < code.size(); i++) {
+    Instruction &first = code[i];
+    Instruction &second = code[i + 1];
+    if (targets[i + 1])
+      continue;
+
+    if (second.opcode == OP_NOT && negatedComparison(first.opcode) != 0) {
+      first.opcode = negatedComparison(first.opcode);
+      second.removed = true;
+    } else if (second.opcode == OP_JUMP_IF_FALSE &&
+               comparisonJump(first.opcode) != 0) {
+      first.opcode = comparisonJump(first.opcode);
+      first.target = second.target;
+      second.removed = true;
+    } else {
+      continue;
+    }
+    changed = true;
+    i++;
+  }
+  return changed;
+}
+
+// Points each jump at the end of the chain of jumps it lands on. A jump-if-
+// false may also go through another plain JUMP_IF_FALSE, since the value it
+// leaves on the stack is the falsey one that jump tests, but only forward.
+bool threadJumps(Chunk &, Code &code) {
+  bool changed = false;
+  for (size_t i = 0; i < code.size(); i++) {
+    Instruction &jump = code[i];
+    if (!isJump(jump.opcode))
+      continue;
+
+    bool conditional = !isUnconditionalJump(jump.opcode);
+    int target = jump.target;
+    for (size_t hops = 0; hops < code.size(); hops++) {
+      const Instruction &next = code[target];
+      bool passes = isUnconditionalJump(next.opcode) ||
+                    (conditional && next.opcode == OP_JUMP_IF_FALSE);
+      if (!passes || next.target == static_cast<int>(i) ||
+          next.target == target ||
+          (conditional && next.target <= static_cast<int>(i)))
+        break;
+      target = next.target;
+    }
+
+    if (target != jump.target) {
+      jump.target = target;
+      changed = true;
+    }
+    if (jump.opcode == OP_JUMP && target == static_cast<int>(i) + 1) {
+      jump.removed = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+bool removeUnreachable(Chunk &, Code &code) {
+  std::vector<bool> reached(code.size(), false);
+  std::vector<int> pending = {0};
+  while (!pending.empty()) {
+    int i = pending.back();
+    pending.pop_back();
+    if (i >= static_cast<int>(code.size()) || reached[i])
+      continue;
+    reached[i] = true;
+    if (fallsThrough(code[i].opcode))
+      pending.push_back(i + 1);
+    if (isJump(code[i].opcode))
+      pending.push_back(code[i].target);
+  }
+
+  bool changed = false;
+  for (size_t i = 0; i < code.size(); i++) {
+    if (!reached[i]) {
+      code[i].removed = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+int readSlot(const Instruction &instruction) {
+  switch (instruction.opcode) {
+  case OP_GET_LOCAL:
+  case OP_GET_LOCAL_PROPERTY:
+  case OP_ADD_LOCAL_CONSTANT:
+  case OP_SUBTRACT_LOCAL_CONSTANT:
+  case OP_LESS_LOCAL_CONSTANT:
+  case OP_GET_LOCAL_FIELD_SLOT:
+    return instruction.operands[0];
+  default:
+    if (instruction.opcode >= OP_GET_LOCAL_0 &&
+        instruction.opcode <= OP_GET_LOCAL_7)
+      return instruction.opcode - OP_GET_LOCAL_0;
+    return -1;
+  }
+}
+
+int writtenSlot(const Instruction &instruction) {
+  if (instruction.opcode == OP_SET_LOCAL)
+    return instruction.operands[0];
+  if (instruction.opcode >= OP_SET_LOCAL_0 &&
+      instruction.opcode <= OP_SET_LOCAL_7)
+    return instruction.opcode - OP_SET_LOCAL_0;
+  return -1;
+}
+
+// Drops SET_LOCALs whose value no later GET of the slot can see. The value
+// stays on the stack either way. Slots a closure captures are left alone,
+// since the closure may read them at any call.
+bool removeDeadStores(Chunk &, Code &code) {
+  Slots captured;
+  for (const Instruction &instruction : code) {
+    if (instruction.opcode != OP_CLOSURE)
+      continue;
+    for (size_t i = 1; i + 1 < instruction.operands.size(); i += 2) {
+      if (instruction.operands[i] != 0)
+        captured.set(instruction.operands[i + 1]);
+    }
+  }
+
+  int count = static_cast<int>(code.size());
+  std::vector<Slots> liveIn(count);
+  std::vector<Slots> liveOut(count);
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = count - 1; i >= 0; i--) {
+      const Instruction &instruction = code[i];
+      Slots out;
+      if (fallsThrough(instruction.opcode) && i + 1 < count)
+        out |= liveIn[i + 1];
+      if (isJump(instruction.opcode))
+        out |= liveIn[instruction.target];
+
+      Slots in = out;
+      if (int slot = writtenSlot(instruction); slot >= 0)
+        in.reset(slot);
+      if (int slot = readSlot(instruction); slot >= 0)
+        in.set(slot);
+      liveOut[i] = out;
+      if (in != liveIn[i]) {
+        liveIn[i] = in;
+        changed = true;
+      }
+    }
+  }
+
+  bool changed = false;
+  for (int i = 0; i < count; i++) {
+    int slot = writtenSlot(code[i]);
+    if (slot >= 0 && !captured.test(slot) && !liveOut[i].test(slot)) {
+      code[i].removed = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+bool pushesWithoutEffect(const Instruction &instruction) {
+  switch (instruction.opcode) {
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+    return true;
+  default:
+    return constantIndex(instruction) >= 0 ||
+           (instruction.opcode >= OP_GET_LOCAL_0 &&
+            instruction.opcode <= OP_GET_LOCAL_7);
+  }
+}
+
+// A value pushed and then popped straight away, as left behind by the
+// other passes.
+bool removeDiscardedValues(Chunk &, Code &code) {
+  std::vector<bool> targets = jumpTargets(code);
+  bool changed = false;
+  for (size_t i = 0; i + 1 < code.size(); i++) {
+    if (code[i + 1].opcode != OP_POP || targets[i + 1])
+      continue;
+    if (!pushesWithoutEffect(code[i]))
+      continue;
+    code[i].removed = true;
+    code[i + 1].removed = true;
+    changed = true;
+    i++;
+  }
+  return changed;
+}
+
+bool encode(const Code &code, Chunk &chunk) {
+  int count = static_cast<int>(code.size());
+  std::vector<int> offsets(count + 1, 0);
+  for (int i = 0; i < count; i++) {
+    int operands = isJump(code[i].opcode)
+                       ? 2
+                       : static_cast<int>(code[i].operands.size());
+    offsets[i + 1] = offsets[i] + 1 + operands;
+  }
+
+  std::vector<uint8_t> bytes;
+  std::vector<int> lines;
+  bytes.reserve(offsets[count]);
+  lines.reserve(offsets[count]);
+  auto emit = [&](uint8_t byte, int line) {
+    bytes.push_back(byte);
+    lines.push_back(line);
+  };
+  for (int i = 0; i < count; i++) {
+    const Instruction &instruction = code[i];
+    if (!isJump(instruction.opcode)) {
+      emit(instruction.opcode, instruction.line);
+      for (uint8_t operand : instruction.operands)
+        emit(operand, instruction.line);
+      continue;
+    }
+
+    if (instruction.target < 0 || instruction.target >= count)
+      return false;
+    uint8_t opcode = instruction.opcode;
+    if (isUnconditionalJump(opcode))
+      opcode = instruction.target > i ? OP_JUMP : OP_LOOP;
+    int next = offsets[i + 1];
+    int jump = opcode == OP_LOOP ? next - offsets[instruction.target]
+                                 : offsets[instruction.target] - next;
+    if (jump < 0 || jump > UINT16_MAX)
+      return false;
+    emit(opcode, instruction.line);
+    emit(static_cast<uint8_t>((jump >> 8) & 0xff), instruction.line);
+    emit(static_cast<uint8_t>(jump & 0xff), instruction.line);
+  }
+
+  chunk.truncate(0);
+  for (size_t i = 0; i < bytes.size(); i++) {
+    chunk.write(bytes[i], lines[i]);
+  }
+  return true;
+}
+
+} // namespace
+
+void optimizeChunk(Chunk &chunk) {
+  Code code;
+  if (chunk.empty() || !decode(chunk, &code))
+    return;
+
+  using Pass = bool (*)(Chunk &, Code &);
+  bool rewritten = false;
+  bool changed = true;
+  for (int round = 0; changed && round < kMaxRounds; round++) {
+    changed = false;
+    for (Pass pass : {foldConstants, fuseComparisons, threadJumps,
+                      removeUnreachable, removeDeadStores,
+                      removeDiscardedValues}) {
+      if (pass(chunk, code)) {
+        compact(&code);
+        changed = true;
+        rewritten = true;
+      }
+    }
+  }
+
+  if (rewritten)
+    encode(code, chunk);
+}
+
+} // namespace cpplox
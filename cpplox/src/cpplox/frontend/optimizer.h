@@ -0,0 +1,14 @@
+#pragma once
+
+#include "chunk.h"
+
+namespace cpplox {
+
+// Rewrites a finished chunk in place: folds numeric constants, fuses negated
+// comparisons, threads jumps to jumps and drops unreachable code, dead local
+// stores and values pushed only to be popped. Every instruction keeps the line
+// it was compiled from. Leaves the chunk alone if a rewritten jump would no
+// longer fit in 16 bits.
+void optimizeChunk(Chunk &chunk);
+
+} // namespace cpplox
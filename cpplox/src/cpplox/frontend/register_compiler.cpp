@@ -0,0 +1,1078 @@
+#include <charconv>
+#include <cstring>
+
+#include <algorithm>
+#include <deque>
+#include <initializer_list>
+#include <string_view>
+#include <vector>
+
+#include "common.h"
+#include "memory.h"
+#include "register_compiler.h"
+#include "register_ops.h"
+#include "scanner.h"
+
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif
+
+namespace cpplox {
+
+// The register compiler parses the whole script into a small AST first so it
+// can see both operands of an expression before choosing registers. It gives
+// up on anything unexpected, including every error compile() would report, so
+// the caller can compile the script again with compile() for its messages.
+
+enum class ExprKind : uint8_t {
+  Number,
+  String,
+  Nil,
+  True,
+  False,
+  Variable,
+  Assign,
+  Unary,
+  Binary,
+  Logical,
+  Call
+};
+
+struct Expr {
+  ExprKind kind;
+  // The line compile() attributes to the instruction that can fail here.
+  int line = 0;
+  // Literal, variable name, assignment target or operator.
+  Token token{};
+  // Operand, left operand, callee or assigned value.
+  Expr *left = nullptr;
+  Expr *right = nullptr;
+  std::vector<Expr *> arguments;
+};
+
+enum class StmtKind : uint8_t {
+  Print,
+  Expression,
+  Var,
+  Block,
+  If,
+  While,
+  Function,
+  Return
+};
+
+struct Stmt {
+  StmtKind kind;
+  int line = 0;
+  Token name{};
+  // Printed or evaluated value, initializer, condition or returned value.
+  Expr *expression = nullptr;
+  // Evaluated after each iteration of a desugared for loop.
+  Expr *increment = nullptr;
+  Stmt *body = nullptr;
+  Stmt *elseBranch = nullptr;
+  std::vector<Token> parameters;
+  std::vector<Stmt *> statements;
+};
+
+struct RegisterLocal {
+  Token name;
+  int depth;
+};
+
+// Locals occupy the low registers of a frame in declaration order, so a
+// local's register is its index. Temporaries are allocated above them.
+struct RegisterFunction {
+  RegisterFunction *enclosing = nullptr;
+  ObjFunction *function = nullptr;
+  std::vector<RegisterLocal> locals;
+  int scopeDepth = 0;
+  int freeRegister = 0;
+  int registerCount = 0;
+};
+
+class RegisterCompiler {
+public:
+  RegisterCompiler(Vm &vm, std::string_view source);
+  ObjFunction *compile();
+
+private:
+  void advance();
+  bool check(TokenType type);
+  bool match(TokenType type);
+  void consume(TokenType type);
+  Expr *newExpr(ExprKind kind, Token token);
+  Stmt *newStmt(StmtKind kind);
+
+  Stmt *declaration();
+  Stmt *funDeclaration();
+  Stmt *varDeclaration();
+  Stmt *statement();
+  Stmt *block();
+  Stmt *forStatement();
+  Stmt *ifStatement();
+  Stmt *whileStatement();
+  Expr *expression();
+  Expr *assignment();
+  Expr *logical(TokenType op, Expr *(RegisterCompiler::*operand)());
+  Expr *orExpression();
+  Expr *andExpression();
+  Expr *binary(std::initializer_list<TokenType> ops,
+               Expr *(RegisterCompiler::*operand)());
+  Expr *equality();
+  Expr *comparison();
+  Expr *term();
+  Expr *factor();
+  Expr *unary();
+  Expr *call();
+  Expr *primary();
+
+  Chunk *currentChunk();
+  void emit(int line, std::initializer_list<uint8_t> bytes);
+  int emitJump(int line, std::initializer_list<uint8_t> bytes);
+  void patchJump(int offset);
+  void emitLoop(int loopStart, int line);
+  uint8_t makeConstant(Value value);
+  uint8_t identifierConstant(const Token &name);
+  uint8_t numberConstant(const Token &number);
+  int allocateRegister();
+  bool isLocalRegister(int reg);
+  int resolveLocal(RegisterFunction *state, const Token &name);
+  int resolve(const Token &name);
+  static bool identifiersEqual(const Token &a, const Token &b);
+  static bool assignsTo(Expr *expr, const Token &name);
+  static bool mentions(Expr *expr, const Token &name);
+  static bool callsAnything(Expr *expr);
+  bool declaredInScope(const Token &name);
+  bool isKnownGlobal(const Token &name);
+  bool isPure(Expr *expr);
+  int operandRegister(Expr *operand, Expr *later);
+  int expressionToAny(Expr *expr);
+  void expressionTo(Expr *expr, int dest);
+  int assignTo(Expr *expr);
+  void binaryTo(Expr *expr, int dest);
+  void callTo(Expr *expr, int dest);
+  int jumpIfFalse(Expr *condition);
+  void generate(Stmt *stmt);
+  void beginScope();
+  void endScope();
+  ObjFunction *function(Stmt *stmt);
+  ObjFunction *endFunction(int line);
+
+  Vm &vm;
+  Scanner scanner;
+  Token current{};
+  Token previous{};
+  bool failed = false;
+  std::deque<Expr> exprs;
+  std::deque<Stmt> stmts;
+  RegisterFunction *state = nullptr;
+  // Globals the script has defined by the statement being compiled.
+  std::vector<Token> knownGlobals;
+};
+
+RegisterCompiler::RegisterCompiler(Vm &vm, std::string_view source)
+    : vm(vm) {
+  scanner.reset(source);
+}
+
+void RegisterCompiler::advance() {
+  previous = current;
+  current = scanner.scanToken();
+  if (current.type == TOKEN_ERROR)
+    failed = true;
+}
+bool RegisterCompiler::check(TokenType type) { return current.type == type; }
+bool RegisterCompiler::match(TokenType type) {
+  if (!check(type))
+    return false;
+  advance();
+  return true;
+}
+void RegisterCompiler::consume(TokenType type) {
+  if (!match(type))
+    failed = true;
+}
+Expr *RegisterCompiler::newExpr(ExprKind kind, Token token) {
+  Expr &expr = exprs.emplace_back();
+  expr.kind = kind;
+  expr.token = token;
+  expr.line = token.line;
+  return &expr;
+}
+Stmt *RegisterCompiler::newStmt(StmtKind kind) {
+  Stmt &stmt = stmts.emplace_back();
+  stmt.kind = kind;
+  stmt.line = previous.line;
+  return &stmt;
+}
+
+Stmt *RegisterCompiler::declaration() {
+  if (match(TOKEN_FUN))
+    return funDeclaration();
+  if (match(TOKEN_VAR))
+    return varDeclaration();
+  if (check(TOKEN_CLASS)) {
+    failed = true;
+    return nullptr;
+  }
+  return statement();
+}
+Stmt *RegisterCompiler::funDeclaration() {
+  Stmt *stmt = newStmt(StmtKind::Function);
+  consume(TOKEN_IDENTIFIER);
+  stmt->name = previous;
+  consume(TOKEN_LEFT_PAREN);
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      consume(TOKEN_IDENTIFIER);
+      stmt->parameters.push_back(previous);
+    } while (!failed && match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_PAREN);
+  consume(TOKEN_LEFT_BRACE);
+  while (!failed && !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    stmt->statements.push_back(declaration());
+  }
+  consume(TOKEN_RIGHT_BRACE);
+  stmt->line = previous.line;
+  return stmt;
+}
+Stmt *RegisterCompiler::varDeclaration() {
+  Stmt *stmt = newStmt(StmtKind::Var);
+  consume(TOKEN_IDENTIFIER);
+  stmt->name = previous;
+  if (match(TOKEN_EQUAL))
+    stmt->expression = expression();
+  consume(TOKEN_SEMICOLON);
+  return stmt;
+}
+Stmt *RegisterCompiler::statement() {
+  if (match(TOKEN_PRINT)) {
+    Stmt *stmt = newStmt(StmtKind::Print);
+    stmt->expression = expression();
+    consume(TOKEN_SEMICOLON);
+    return stmt;
+  }
+  if (match(TOKEN_FOR))
+    return forStatement();
+  if (match(TOKEN_IF))
+    return ifStatement();
+  if (match(TOKEN_RETURN)) {
+    Stmt *stmt = newStmt(StmtKind::Return);
+    if (!match(TOKEN_SEMICOLON)) {
+      stmt->expression = expression();
+      consume(TOKEN_SEMICOLON);
+    }
+    return stmt;
+  }
+  if (match(TOKEN_WHILE))
+    return whileStatement();
+  if (match(TOKEN_LEFT_BRACE))
+    return block();
+
+  Stmt *stmt = newStmt(StmtKind::Expression);
+  stmt->expression = expression();
+  consume(TOKEN_SEMICOLON);
+  return stmt;
+}
+Stmt *RegisterCompiler::block() {
+  Stmt *stmt = newStmt(StmtKind::Block);
+  while (!failed && !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    stmt->statements.push_back(declaration());
+  }
+  consume(TOKEN_RIGHT_BRACE);
+  return stmt;
+}
+// A for loop becomes a block holding the initializer and a while loop with
+// an increment.
+Stmt *RegisterCompiler::forStatement() {
+  Stmt *outer = newStmt(StmtKind::Block);
+  consume(TOKEN_LEFT_PAREN);
+  if (match(TOKEN_SEMICOLON)) {
+  } else if (match(TOKEN_VAR)) {
+    outer->statements.push_back(varDeclaration());
+  } else {
+    Stmt *initializer = newStmt(StmtKind::Expression);
+    initializer->expression = expression();
+    consume(TOKEN_SEMICOLON);
+    outer->statements.push_back(initializer);
+  }
+
+  Stmt *loop = newStmt(StmtKind::While);
+  if (!match(TOKEN_SEMICOLON)) {
+    loop->expression = expression();
+    consume(TOKEN_SEMICOLON);
+  }
+  if (!match(TOKEN_RIGHT_PAREN)) {
+    loop->increment = expression();
+    consume(TOKEN_RIGHT_PAREN);
+  }
+  loop->body = statement();
+  outer->statements.push_back(loop);
+  return outer;
+}
+Stmt *RegisterCompiler::ifStatement() {
+  Stmt *stmt = newStmt(StmtKind::If);
+  consume(TOKEN_LEFT_PAREN);
+  stmt->expression = expression();
+  consume(TOKEN_RIGHT_PAREN);
+  stmt->body = statement();
+  if (match(TOKEN_ELSE))
+    stmt->elseBranch = statement();
+  return stmt;
+}
+Stmt *RegisterCompiler::whileStatement() {
+  Stmt *stmt = newStmt(StmtKind::While);
+  consume(TOKEN_LEFT_PAREN);
+  stmt->expression = expression();
+  consume(TOKEN_RIGHT_PAREN);
+  stmt->body = statement();
+  return stmt;
+}
+
+Expr *RegisterCompiler::expression() { return assignment(); }
+Expr *RegisterCompiler::assignment() {
+  Expr *target = orExpression();
+  // A parenthesized name is not an assignment target either.
+  bool grouped = previous.type == TOKEN_RIGHT_PAREN;
+  if (failed || !match(TOKEN_EQUAL))
+    return target;
+  if (target->kind != ExprKind::Variable || grouped) {
+    failed = true;
+    return target;
+  }
+
+  Expr *expr = newExpr(ExprKind::Assign, target->token);
+  expr->left = assignment();
+  expr->line = previous.line;
+  return expr;
+}
+Expr *RegisterCompiler::logical(TokenType op,
+                                Expr *(RegisterCompiler::*operand)()) {
+  Expr *expr = (this->*operand)();
+  while (!failed && match(op)) {
+    Expr *logical = newExpr(ExprKind::Logical, previous);
+    logical->left = expr;
+    logical->right = (this->*operand)();
+    expr = logical;
+  }
+  return expr;
+}
+Expr *RegisterCompiler::orExpression() {
+  return logical(TOKEN_OR, &RegisterCompiler::andExpression);
+}
+Expr *RegisterCompiler::andExpression() {
+  return logical(TOKEN_AND, &RegisterCompiler::equality);
+}
+Expr *RegisterCompiler::binary(std::initializer_list<TokenType> ops,
+                               Expr *(RegisterCompiler::*operand)()) {
+  Expr *expr = (this->*operand)();
+  while (!failed &&
+         std::find(ops.begin(), ops.end(), current.type) != ops.end()) {
+    advance();
+    Expr *binary = newExpr(ExprKind::Binary, previous);
+    binary->left = expr;
+    binary->right = (this->*operand)();
+    binary->line = previous.line;
+    expr = binary;
+  }
+  return expr;
+}
+Expr *RegisterCompiler::equality() {
+  return binary({TOKEN_BANG_EQUAL, TOKEN_EQUAL_EQUAL},
+                &RegisterCompiler::comparison);
+}
+Expr *RegisterCompiler::comparison() {
+  return binary(
+      {TOKEN_GREATER, TOKEN_GREATER_EQUAL, TOKEN_LESS, TOKEN_LESS_EQUAL},
+      &RegisterCompiler::term);
+}
+Expr *RegisterCompiler::term() {
+  return binary({TOKEN_MINUS, TOKEN_PLUS}, &RegisterCompiler::factor);
+}
+Expr *RegisterCompiler::factor() {
+  return binary({TOKEN_SLASH, TOKEN_STAR}, &RegisterCompiler::unary);
+}
+Expr *RegisterCompiler::unary() {
+  if (match(TOKEN_BANG) || match(TOKEN_MINUS)) {
+    Expr *expr = newExpr(ExprKind::Unary, previous);
+    expr->left = unary();
+    expr->line = previous.line;
+    return expr;
+  }
+  return call();
+}
+Expr *RegisterCompiler::call() {
+  Expr *expr = primary();
+  for (;;) {
+    if (failed)
+      return expr;
+    if (match(TOKEN_LEFT_PAREN)) {
+      Expr *call = newExpr(ExprKind::Call, previous);
+      call->left = expr;
+      if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+          call->arguments.push_back(expression());
+        } while (!failed && match(TOKEN_COMMA));
+      }
+      consume(TOKEN_RIGHT_PAREN);
+      call->line = previous.line;
+      expr = call;
+    } else if (check(TOKEN_DOT)) {
+      failed = true;
+    } else {
+      return expr;
+    }
+  }
+}
+Expr *RegisterCompiler::primary() {
+  advance();
+  switch (previous.type) {
+  case TOKEN_NUMBER:
+    return newExpr(ExprKind::Number, previous);
+  case TOKEN_STRING:
+    return newExpr(ExprKind::String, previous);
+  case TOKEN_NIL:
+    return newExpr(ExprKind::Nil, previous);
+  case TOKEN_TRUE:
+    return newExpr(ExprKind::True, previous);
+  case TOKEN_FALSE:
+    return newExpr(ExprKind::False, previous);
+  case TOKEN_IDENTIFIER:
+    return newExpr(ExprKind::Variable, previous);
+  case TOKEN_LEFT_PAREN: {
+    Expr *expr = expression();
+    consume(TOKEN_RIGHT_PAREN);
+    return expr;
+  }
+  default:
+    failed = true;
+    return newExpr(ExprKind::Nil, previous);
+  }
+}
+
+Chunk *RegisterCompiler::currentChunk() { return &state->function->chunk; }
+
+void RegisterCompiler::emit(int line, std::initializer_list<uint8_t> bytes) {
+  for (uint8_t byte : bytes) {
+    writeChunk(currentChunk(), byte, line);
+  }
+}
+int RegisterCompiler::emitJump(int line, std::initializer_list<uint8_t> bytes) {
+  emit(line, bytes);
+  emit(line, {0xff, 0xff});
+  return currentChunk()->size() - 2;
+}
+void RegisterCompiler::patchJump(int offset) {
+  int jump = currentChunk()->size() - offset - 2;
+  if (jump > UINT16_MAX)
+    failed = true;
+  currentChunk()->byteAt(offset) = (jump >> 8) & 0xff;
+  currentChunk()->byteAt(offset + 1) = jump & 0xff;
+}
+void RegisterCompiler::emitLoop(int loopStart, int line) {
+  emit(line, {ROP_LOOP});
+  int offset = currentChunk()->size() - loopStart + 2;
+  if (offset > UINT16_MAX)
+    failed = true;
+  emit(line, {(uint8_t)((offset >> 8) & 0xff), (uint8_t)(offset & 0xff)});
+}
+uint8_t RegisterCompiler::makeConstant(Value value) {
+  int constant = addConstant(currentChunk(), value);
+  if (constant > UINT8_MAX) {
+    failed = true;
+    return 0;
+  }
+  return (uint8_t)constant;
+}
+uint8_t RegisterCompiler::identifierConstant(const Token &name) {
+  return makeConstant(objectValue(vm.copyString(name.start, name.length)));
+}
+uint8_t RegisterCompiler::numberConstant(const Token &number) {
+  double value = 0;
+  std::from_chars(number.start, number.start + number.length, value);
+  return makeConstant(numberValue(value));
+}
+
+int RegisterCompiler::allocateRegister() {
+  if (state->freeRegister >= kUint8Count) {
+    failed = true;
+    return 0;
+  }
+  int reg = state->freeRegister++;
+  state->registerCount = std::max(state->registerCount, state->freeRegister);
+  return reg;
+}
+bool RegisterCompiler::isLocalRegister(int reg) {
+  return reg < (int)state->locals.size();
+}
+int RegisterCompiler::resolveLocal(RegisterFunction *function,
+                                   const Token &name) {
+  for (int i = (int)function->locals.size() - 1; i >= 0; i--) {
+    if (identifiersEqual(function->locals[i].name, name))
+      return i;
+  }
+  return -1;
+}
+// Returns the register of a local, or -1 for a global. Variables of an
+// enclosing function would need upvalues, which this tier does not have.
+int RegisterCompiler::resolve(const Token &name) {
+  int local = resolveLocal(state, name);
+  if (local != -1)
+    return local;
+  for (RegisterFunction *outer = state->enclosing; outer != nullptr;
+       outer = outer->enclosing) {
+    if (resolveLocal(outer, name) != -1)
+      failed = true;
+  }
+  return -1;
+}
+bool RegisterCompiler::identifiersEqual(const Token &a, const Token &b) {
+  return a.length == b.length && std::memcmp(a.start, b.start, a.length) == 0;
+}
+bool RegisterCompiler::assignsTo(Expr *expr, const Token &name) {
+  if (expr == nullptr)
+    return false;
+  if (expr->kind == ExprKind::Assign && identifiersEqual(expr->token, name))
+    return true;
+  if (assignsTo(expr->left, name) || assignsTo(expr->right, name))
+    return true;
+  for (Expr *argument : expr->arguments) {
+    if (assignsTo(argument, name))
+      return true;
+  }
+  return false;
+}
+bool RegisterCompiler::mentions(Expr *expr, const Token &name) {
+  if (expr == nullptr)
+    return false;
+  if ((expr->kind == ExprKind::Variable || expr->kind == ExprKind::Assign) &&
+      identifiersEqual(expr->token, name))
+    return true;
+  if (mentions(expr->left, name) || mentions(expr->right, name))
+    return true;
+  for (Expr *argument : expr->arguments) {
+    if (mentions(argument, name))
+      return true;
+  }
+  return false;
+}
+bool RegisterCompiler::callsAnything(Expr *expr) {
+  if (expr == nullptr)
+    return false;
+  if (expr->kind == ExprKind::Call)
+    return true;
+  return callsAnything(expr->left) || callsAnything(expr->right);
+}
+bool RegisterCompiler::declaredInScope(const Token &name) {
+  for (int i = (int)state->locals.size() - 1; i >= 0; i--) {
+    if (state->locals[i].depth < state->scopeDepth)
+      break;
+    if (identifiersEqual(state->locals[i].name, name))
+      return true;
+  }
+  return false;
+}
+bool RegisterCompiler::isKnownGlobal(const Token &name) {
+  if (name.length == 5 && std::memcmp(name.start, "clock", 5) == 0)
+    return true;
+  for (const Token &known : knownGlobals) {
+    if (identifiersEqual(known, name))
+      return true;
+  }
+  return false;
+}
+// Whether evaluating expr can neither fail nor change anything, so an
+// expression statement made of it is dropped, as compile() does: literals,
+// defined variables, and ==, != and ! over them.
+bool RegisterCompiler::isPure(Expr *expr) {
+  switch (expr->kind) {
+  case ExprKind::Number:
+  case ExprKind::String:
+  case ExprKind::Nil:
+  case ExprKind::True:
+  case ExprKind::False:
+    return true;
+  case ExprKind::Variable:
+    return resolve(expr->token) != -1 || isKnownGlobal(expr->token);
+  case ExprKind::Unary:
+    return expr->token.type == TOKEN_BANG && isPure(expr->left);
+  case ExprKind::Binary:
+    return (expr->token.type == TOKEN_EQUAL_EQUAL ||
+            expr->token.type == TOKEN_BANG_EQUAL) &&
+           isPure(expr->left) && isPure(expr->right);
+  default:
+    return false;
+  }
+}
+
+// Evaluates an operand that is read after `later` runs. A local is used in
+// place unless `later` assigns it, in which case the current value is copied
+// out first.
+int RegisterCompiler::operandRegister(Expr *operand, Expr *later) {
+  int reg = expressionToAny(operand);
+  if (isLocalRegister(reg) && assignsTo(later, state->locals[reg].name)) {
+    int copy = allocateRegister();
+    emit(operand->line, {ROP_MOVE, (uint8_t)copy, (uint8_t)reg});
+    return copy;
+  }
+  return reg;
+}
+// Returns a register holding the value of expr. Locals are used in place;
+// anything else lands in a new temporary.
+int RegisterCompiler::expressionToAny(Expr *expr) {
+  if (expr->kind == ExprKind::Variable) {
+    int local = resolve(expr->token);
+    if (local != -1)
+      return local;
+  } else if (expr->kind == ExprKind::Assign) {
+    return assignTo(expr);
+  }
+
+  int reg = allocateRegister();
+  expressionTo(expr, reg);
+  return reg;
+}
+void RegisterCompiler::expressionTo(Expr *expr, int dest) {
+  if (failed)
+    return;
+
+  uint8_t a = (uint8_t)dest;
+  switch (expr->kind) {
+  case ExprKind::Number:
+    emit(expr->line, {ROP_LOAD_CONSTANT, a, numberConstant(expr->token)});
+    break;
+  case ExprKind::String: {
+    uint8_t constant = makeConstant(objectValue(
+        vm.copyString(expr->token.start + 1, expr->token.length - 2)));
+    emit(expr->line, {ROP_LOAD_CONSTANT, a, constant});
+    break;
+  }
+  case ExprKind::Nil:
+    emit(expr->line, {ROP_LOAD_NIL, a});
+    break;
+  case ExprKind::True:
+    emit(expr->line, {ROP_LOAD_TRUE, a});
+    break;
+  case ExprKind::False:
+    emit(expr->line, {ROP_LOAD_FALSE, a});
+    break;
+  case ExprKind::Variable: {
+    int local = resolve(expr->token);
+    if (local == -1) {
+      emit(expr->line,
+           {ROP_GET_GLOBAL, a, identifierConstant(expr->token)});
+    } else if (local != dest) {
+      emit(expr->line, {ROP_MOVE, a, (uint8_t)local});
+    }
+    break;
+  }
+  case ExprKind::Assign: {
+    int saved = state->freeRegister;
+    int value = assignTo(expr);
+    if (value != dest)
+      emit(expr->line, {ROP_MOVE, a, (uint8_t)value});
+    state->freeRegister = saved;
+    break;
+  }
+  case ExprKind::Unary: {
+    int saved = state->freeRegister;
+    int operand = expressionToAny(expr->left);
+    uint8_t op = expr->token.type == TOKEN_BANG ? ROP_NOT : ROP_NEGATE;
+    emit(expr->line, {op, a, (uint8_t)operand});
+    state->freeRegister = saved;
+    break;
+  }
+  case ExprKind::Binary:
+    binaryTo(expr, dest);
+    break;
+  case ExprKind::Logical: {
+    // The left operand is written to dest before the right one runs, so a
+    // local destination could be read back too early.
+    if (isLocalRegister(dest)) {
+      int saved = state->freeRegister;
+      int temp = allocateRegister();
+      expressionTo(expr, temp);
+      emit(expr->line, {ROP_MOVE, a, (uint8_t)temp});
+      state->freeRegister = saved;
+      break;
+    }
+    expressionTo(expr->left, dest);
+    uint8_t op =
+        expr->token.type == TOKEN_AND ? ROP_JUMP_IF_FALSE : ROP_JUMP_IF_TRUE;
+    int jump = emitJump(expr->line, {op, a});
+    expressionTo(expr->right, dest);
+    patchJump(jump);
+    break;
+  }
+  case ExprKind::Call:
+    callTo(expr, dest);
+    break;
+  }
+}
+// Stores the assigned value and returns the register holding it.
+int RegisterCompiler::assignTo(Expr *expr) {
+  int local = resolve(expr->token);
+  if (local != -1) {
+    expressionTo(expr->left, local);
+    return local;
+  }
+
+  int value = expressionToAny(expr->left);
+  emit(expr->line,
+       {ROP_SET_GLOBAL, (uint8_t)value, identifierConstant(expr->token)});
+  return value;
+}
+void RegisterCompiler::binaryTo(Expr *expr, int dest) {
+  int saved = state->freeRegister;
+  TokenType op = expr->token.type;
+  uint8_t a = (uint8_t)dest;
+  uint8_t b = (uint8_t)operandRegister(expr->left, expr->right);
+
+  if ((op == TOKEN_PLUS || op == TOKEN_MINUS) &&
+      expr->right->kind == ExprKind::Number) {
+    uint8_t constant = numberConstant(expr->right->token);
+    uint8_t opcode = op == TOKEN_PLUS ? ROP_ADD_CONSTANT : ROP_SUBTRACT_CONSTANT;
+    emit(expr->line, {opcode, a, b, constant});
+    state->freeRegister = saved;
+    return;
+  }
+
+  uint8_t c = (uint8_t)expressionToAny(expr->right);
+  switch (op) {
+  case TOKEN_BANG_EQUAL:
+    emit(expr->line, {ROP_EQUAL, a, b, c, ROP_NOT, a, a});
+    break;
+  case TOKEN_EQUAL_EQUAL:
+    emit(expr->line, {ROP_EQUAL, a, b, c});
+    break;
+  case TOKEN_GREATER:
+    emit(expr->line, {ROP_GREATER, a, b, c});
+    break;
+  case TOKEN_GREATER_EQUAL:
+    emit(expr->line, {ROP_LESS, a, b, c, ROP_NOT, a, a});
+    break;
+  case TOKEN_LESS:
+    emit(expr->line, {ROP_LESS, a, b, c});
+    break;
+  case TOKEN_LESS_EQUAL:
+    emit(expr->line, {ROP_GREATER, a, b, c, ROP_NOT, a, a});
+    break;
+  case TOKEN_PLUS:
+    emit(expr->line, {ROP_ADD, a, b, c});
+    break;
+  case TOKEN_MINUS:
+    emit(expr->line, {ROP_SUBTRACT, a, b, c});
+    break;
+  case TOKEN_STAR:
+    emit(expr->line, {ROP_MULTIPLY, a, b, c});
+    break;
+  case TOKEN_SLASH:
+    emit(expr->line, {ROP_DIVIDE, a, b, c});
+    break;
+  default:
+    failed = true;
+    break;
+  }
+  state->freeRegister = saved;
+}
+// The callee and arguments go in consecutive registers at the top of the
+// frame, which become slot 0 and the parameters of the callee's frame.
+void RegisterCompiler::callTo(Expr *expr, int dest) {
+  int saved = state->freeRegister;
+  int base = dest;
+  if (isLocalRegister(dest) || dest != state->freeRegister - 1)
+    base = allocateRegister();
+
+  // A global callee is loaded by the call itself, after the arguments. That
+  // is only the same as loading it first if it is already defined and no
+  // argument can change it.
+  bool globalCallee = expr->left->kind == ExprKind::Variable &&
+                      resolve(expr->left->token) == -1 &&
+                      isKnownGlobal(expr->left->token);
+  for (Expr *argument : expr->arguments) {
+    if (assignsTo(argument, expr->left->token) || callsAnything(argument))
+      globalCallee = false;
+  }
+  if (!globalCallee)
+    expressionTo(expr->left, base);
+  for (Expr *argument : expr->arguments) {
+    expressionTo(argument, allocateRegister());
+  }
+  if (expr->arguments.size() > UINT8_MAX)
+    failed = true;
+  if (globalCallee) {
+    emit(expr->line, {ROP_CALL_GLOBAL, identifierConstant(expr->left->token),
+                      (uint8_t)base, (uint8_t)expr->arguments.size()});
+  } else {
+    emit(expr->line,
+         {ROP_CALL, (uint8_t)base, (uint8_t)expr->arguments.size()});
+  }
+  if (base != dest)
+    emit(expr->line, {ROP_MOVE, (uint8_t)dest, (uint8_t)base});
+  state->freeRegister = saved;
+}
+// Emits a branch taken when the condition is falsey and returns the offset of
+// its jump operand for patchJump().
+int RegisterCompiler::jumpIfFalse(Expr *condition) {
+  int saved = state->freeRegister;
+  int jump;
+  TokenType op = condition->token.type;
+  bool comparison =
+      condition->kind == ExprKind::Binary &&
+      (op == TOKEN_BANG_EQUAL || op == TOKEN_EQUAL_EQUAL ||
+       op == TOKEN_GREATER || op == TOKEN_GREATER_EQUAL || op == TOKEN_LESS ||
+       op == TOKEN_LESS_EQUAL);
+
+  if (comparison) {
+    uint8_t b = (uint8_t)operandRegister(condition->left, condition->right);
+    if ((op == TOKEN_LESS || op == TOKEN_GREATER) &&
+        condition->right->kind == ExprKind::Number) {
+      uint8_t constant = numberConstant(condition->right->token);
+      uint8_t opcode = op == TOKEN_LESS ? ROP_JUMP_IF_NOT_LESS_CONSTANT
+                                        : ROP_JUMP_IF_NOT_GREATER_CONSTANT;
+      jump = emitJump(condition->line, {opcode, b, constant});
+    } else {
+      uint8_t c = (uint8_t)expressionToAny(condition->right);
+      uint8_t opcode = ROP_JUMP_IF_NOT_EQUAL;
+      if (op == TOKEN_BANG_EQUAL) {
+        opcode = ROP_JUMP_IF_EQUAL;
+      } else if (op == TOKEN_GREATER) {
+        opcode = ROP_JUMP_IF_NOT_GREATER;
+      } else if (op == TOKEN_GREATER_EQUAL) {
+        opcode = ROP_JUMP_IF_LESS;
+      } else if (op == TOKEN_LESS) {
+        opcode = ROP_JUMP_IF_NOT_LESS;
+      } else if (op == TOKEN_LESS_EQUAL) {
+        opcode = ROP_JUMP_IF_GREATER;
+      }
+      jump = emitJump(condition->line, {opcode, b, c});
+    }
+  } else {
+    uint8_t a = (uint8_t)expressionToAny(condition);
+    jump = emitJump(condition->line, {ROP_JUMP_IF_FALSE, a});
+  }
+
+  state->freeRegister = saved;
+  return jump;
+}
+
+void RegisterCompiler::beginScope() { state->scopeDepth++; }
+void RegisterCompiler::endScope() {
+  state->scopeDepth--;
+  while (!state->locals.empty() &&
+         state->locals.back().depth > state->scopeDepth) {
+    state->locals.pop_back();
+  }
+  state->freeRegister = (int)state->locals.size();
+}
+
+void RegisterCompiler::generate(Stmt *stmt) {
+  if (failed || stmt == nullptr) {
+    failed = true;
+    return;
+  }
+
+  int saved = state->freeRegister;
+  switch (stmt->kind) {
+  case StmtKind::Print: {
+    uint8_t a = (uint8_t)expressionToAny(stmt->expression);
+    emit(stmt->line, {ROP_PRINT, a});
+    break;
+  }
+  case StmtKind::Expression:
+    if (!isPure(stmt->expression))
+      expressionToAny(stmt->expression);
+    break;
+  case StmtKind::Var: {
+    if (state->scopeDepth == 0) {
+      int value;
+      if (stmt->expression != nullptr) {
+        value = expressionToAny(stmt->expression);
+      } else {
+        value = allocateRegister();
+        emit(stmt->line, {ROP_LOAD_NIL, (uint8_t)value});
+      }
+      emit(stmt->line, {ROP_DEFINE_GLOBAL, (uint8_t)value,
+                        identifierConstant(stmt->name)});
+      knownGlobals.push_back(stmt->name);
+      break;
+    }
+
+    // compile() rejects both, so the script falls back to it for the error.
+    if (declaredInScope(stmt->name) || mentions(stmt->expression, stmt->name)) {
+      failed = true;
+      return;
+    }
+    int reg = allocateRegister();
+    if (reg != (int)state->locals.size()) {
+      failed = true;
+      return;
+    }
+    if (stmt->expression != nullptr) {
+      expressionTo(stmt->expression, reg);
+    } else {
+      emit(stmt->line, {ROP_LOAD_NIL, (uint8_t)reg});
+    }
+    state->locals.push_back({stmt->name, state->scopeDepth});
+    return;
+  }
+  case StmtKind::Block:
+    beginScope();
+    for (Stmt *inner : stmt->statements) {
+      generate(inner);
+    }
+    endScope();
+    return;
+  case StmtKind::If: {
+    int thenJump = jumpIfFalse(stmt->expression);
+    generate(stmt->body);
+    if (stmt->elseBranch == nullptr) {
+      patchJump(thenJump);
+      break;
+    }
+    int elseJump = emitJump(stmt->line, {ROP_JUMP});
+    patchJump(thenJump);
+    generate(stmt->elseBranch);
+    patchJump(elseJump);
+    break;
+  }
+  case StmtKind::While: {
+    int loopStart = currentChunk()->size();
+    int exitJump = -1;
+    if (stmt->expression != nullptr)
+      exitJump = jumpIfFalse(stmt->expression);
+    generate(stmt->body);
+    if (stmt->increment != nullptr) {
+      expressionToAny(stmt->increment);
+      state->freeRegister = saved;
+    }
+    emitLoop(loopStart, stmt->line);
+    if (exitJump != -1)
+      patchJump(exitJump);
+    break;
+  }
+  case StmtKind::Function: {
+    bool global = state->scopeDepth == 0;
+    if (!global && declaredInScope(stmt->name)) {
+      failed = true;
+      return;
+    }
+    int reg = allocateRegister();
+    if (!global) {
+      if (reg != (int)state->locals.size()) {
+        failed = true;
+        return;
+      }
+      state->locals.push_back({stmt->name, state->scopeDepth});
+    }
+    // The body can only run once the closure is stored, so it may treat its
+    // own name as defined.
+    if (global)
+      knownGlobals.push_back(stmt->name);
+    ObjFunction *compiled = function(stmt);
+    if (failed)
+      return;
+    emit(stmt->line,
+         {ROP_CLOSURE, (uint8_t)reg, makeConstant(objectValue(compiled))});
+    if (!global)
+      return;
+    emit(stmt->line, {ROP_DEFINE_GLOBAL, (uint8_t)reg,
+                      identifierConstant(stmt->name)});
+    break;
+  }
+  case StmtKind::Return: {
+    if (state->enclosing == nullptr) {
+      failed = true;
+      return;
+    }
+    int value;
+    if (stmt->expression != nullptr) {
+      value = expressionToAny(stmt->expression);
+    } else {
+      value = allocateRegister();
+      emit(stmt->line, {ROP_LOAD_NIL, (uint8_t)value});
+    }
+    emit(stmt->line, {ROP_RETURN, (uint8_t)value});
+    break;
+  }
+  }
+  state->freeRegister = saved;
+}
+
+ObjFunction *RegisterCompiler::function(Stmt *stmt) {
+  RegisterFunction function;
+  function.enclosing = state;
+  function.function = vm.newFunction();
+  vm.addCompilerRoot(function.function);
+  state = &function;
+
+  function.function->name = vm.copyString(stmt->name.start, stmt->name.length);
+  function.function->arity = (int)stmt->parameters.size();
+  function.scopeDepth = 1;
+  function.locals.push_back({Token{}, 0});
+  allocateRegister();
+  if (stmt->parameters.size() > UINT8_MAX)
+    failed = true;
+  for (const Token &parameter : stmt->parameters) {
+    if (declaredInScope(parameter))
+      failed = true;
+    allocateRegister();
+    function.locals.push_back({parameter, 1});
+  }
+
+  for (Stmt *inner : stmt->statements) {
+    generate(inner);
+  }
+  return endFunction(stmt->line);
+}
+ObjFunction *RegisterCompiler::endFunction(int line) {
+  int value = allocateRegister();
+  emit(line, {ROP_LOAD_NIL, (uint8_t)value, ROP_RETURN, (uint8_t)value});
+
+  ObjFunction *function = state->function;
+  function->registerCount = state->registerCount;
+
+#ifdef DEBUG_PRINT_CODE
+  if (!failed) {
+    disassembleRegisterChunk(currentChunk(), function->name != nullptr
+                                                 ? function->name->chars
+                                                 : "<script>");
+  }
+#endif
+
+  state = state->enclosing;
+  vm.popCompilerRoot();
+  return function;
+}
+
+ObjFunction *RegisterCompiler::compile() {
+  std::vector<Stmt *> program;
+  advance();
+  while (!failed && !match(TOKEN_EOF)) {
+    program.push_back(declaration());
+  }
+  if (failed)
+    return nullptr;
+
+  RegisterFunction script;
+  script.function = vm.newFunction();
+  vm.addCompilerRoot(script.function);
+  state = &script;
+  script.locals.push_back({Token{}, 0});
+  allocateRegister();
+
+  for (Stmt *stmt : program) {
+    generate(stmt);
+  }
+  ObjFunction *function = endFunction(previous.line);
+  return failed ? nullptr : function;
+}
+
+ObjFunction *compileRegisters(Vm &vm, std::string_view source) {
+  RegisterCompiler compiler(vm, source);
+  return compiler.compile();
+}
+
+} // namespace cpplox
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string_view>
+
+#include "object.h"
+#include "vm.h"
+
+namespace cpplox {
+
+// Compiles a script for the register tier. Returns nullptr, without reporting
+// anything, when the script fails to compile or uses something the tier does
+// not support (classes, properties, captured variables); the caller then
+// compiles it with compile(), which reports any errors.
+ObjFunction *compileRegisters(Vm &vm, std::string_view source);
+
+} // namespace cpplox
@@ -5,11 +5,11 @@
 
 namespace cpplox {
 
-void Scanner::reset(std::string_view source) {
+void Scanner::reset(std::string_view source, int line) {
   start_ = source.data();
   current_ = source.data();
   end_ = source.data() + source.size();
-  line_ = 1;
+  line_ = line;
 }
 
 bool Scanner::isAlpha(char c) {
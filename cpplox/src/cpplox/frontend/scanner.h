@@ -109,7 +109,8 @@ public:
   Scanner() = default;
   explicit Scanner(std::string_view source) { reset(source); }
 
-  void reset(std::string_view source);
+  // line is the line source starts on, for scanning part of a script again.
+  void reset(std::string_view source, int line = 1);
   Token scanToken();
 
 private:
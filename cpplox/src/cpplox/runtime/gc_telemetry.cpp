@@ -0,0 +1,95 @@
+#include <cinttypes>
+
+#include "gc_telemetry.h"
+#include "memory.h"
+#include "object.h"
+
+namespace cpplox {
+
+static_assert(objectKindIndex(OBJ_UPVALUE) + 1 == kObjectKindCount);
+
+static const char *objectKindName(int kind) {
+  static constexpr const char *kNames[kObjectKindCount] = {
+      "bound_method", "class", "closure", "function", "instance",
+      "native",       "rope",  "string",  "upvalue"};
+  return kNames[kind];
+}
+
+static const char *eventKindName(GcEventKind kind) {
+  switch (kind) {
+  case GcEventKind::Major:
+    return "major";
+  case GcEventKind::Minor:
+    return "minor";
+  case GcEventKind::Compaction:
+    return "compaction";
+  }
+  return "unknown";
+}
+
+static void printEvent(const GcEvent &event, std::FILE *out) {
+  std::fprintf(out,
+               "    {\"kind\": \"%s\", \"start_us\": %" PRIu64
+               ", \"pause_us\": %" PRIu64 ", \"pauses\": %" PRIu64
+               ", \"bytes_before\": %zu, \"bytes_after\": %zu"
+               ", \"next_gc\": %zu",
+               eventKindName(event.kind), event.startNanoseconds / 1000,
+               event.pauseNanoseconds / 1000, event.pauses, event.bytesBefore,
+               event.bytesAfter, event.nextGC);
+  if (event.kind == GcEventKind::Major) {
+    std::fprintf(out, ", \"gray_high_water\": %zu, \"live_objects\": {",
+                 event.grayHighWater);
+    for (int kind = 0; kind < kObjectKindCount; kind++) {
+      std::fprintf(out, "%s\"%s\": %zu", kind == 0 ? "" : ", ",
+                   objectKindName(kind), event.liveObjects[kind]);
+    }
+    std::fprintf(out, "}");
+  } else {
+    std::fprintf(out, ", \"%s\": %zu",
+                 event.kind == GcEventKind::Minor ? "promoted_bytes"
+                                                  : "moved_bytes",
+                 event.movedBytes);
+  }
+  std::fprintf(out, "}");
+}
+
+void printGcTelemetry(const Heap &heap, std::FILE *out) {
+  const auto &events = heap.gcEvents();
+  std::fprintf(out, "{\n  \"collections\": [\n");
+  for (size_t i = 0; i < events.size(); i++) {
+    printEvent(events[i], out);
+    std::fprintf(out, "%s\n", i + 1 < events.size() ? "," : "");
+  }
+  std::fprintf(out, "  ],\n  \"summary\": {\n");
+  std::fprintf(out, "    \"major_collections\": %" PRIu64 ",\n",
+               heap.collections());
+  std::fprintf(out, "    \"minor_collections\": %" PRIu64 ",\n",
+               heap.minorCollections());
+  std::fprintf(out, "    \"compactions\": %" PRIu64 ",\n", heap.compactions());
+  std::fprintf(out, "    \"bytes_allocated\": %zu,\n", heap.bytesAllocated());
+  std::fprintf(out, "    \"next_gc\": %zu,\n", heap.nextGC());
+  std::fprintf(out, "    \"pauses\": %" PRIu64 ",\n", heap.pauseCount());
+  std::fprintf(out, "    \"pause_total_us\": %" PRIu64 ",\n",
+               heap.totalPauseNanoseconds() / 1000);
+  std::fprintf(out, "    \"pause_max_us\": %" PRIu64 ",\n",
+               heap.maxPauseNanoseconds() / 1000);
+  // Bucket i counts pauses below 2^i microseconds; the last one is open.
+  std::fprintf(out, "    \"pause_histogram\": [");
+  bool first = true;
+  for (int i = 0; i < kPauseBuckets; i++) {
+    if (heap.pauseHistogram()[i] == 0)
+      continue;
+    if (i + 1 < kPauseBuckets) {
+      std::fprintf(out, "%s{\"below_us\": %" PRIu64 ", \"count\": %" PRIu64 "}",
+                   first ? "" : ", ", uint64_t{1} << i,
+                   heap.pauseHistogram()[i]);
+    } else {
+      std::fprintf(out, "%s{\"below_us\": null, \"count\": %" PRIu64 "}",
+                   first ? "" : ", ", heap.pauseHistogram()[i]);
+    }
+    first = false;
+  }
+  std::fprintf(out, "]\n  }\n}\n");
+}
+
+} // namespace cpplox
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+namespace cpplox {
+
+class Heap;
+
+inline constexpr int kObjectKindCount = 9;
+
+enum class GcEventKind : uint8_t { Major, Minor, Compaction };
+
+// One collection as recorded with --gc-telemetry. Byte counts are for the old
+// generation; a major cycle's pause is the sum of its marking slices, since
+// its sweep is spread over later allocations.
+struct GcEvent {
+  GcEventKind kind;
+  uint64_t startNanoseconds;
+  uint64_t pauseNanoseconds;
+  uint64_t pauses;
+  size_t bytesBefore;
+  size_t bytesAfter;
+  size_t nextGC;
+  // Major only: the deepest the gray stack got, and the old objects left
+  // after the sweep by ObjectKind.
+  size_t grayHighWater;
+  std::array<size_t, kObjectKindCount> liveObjects;
+  // Minor: bytes promoted. Compaction: bytes moved.
+  size_t movedBytes;
+};
+
+void printGcTelemetry(const Heap &heap, std::FILE *out);
+
+} // namespace cpplox
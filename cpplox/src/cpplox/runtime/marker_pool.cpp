@@ -0,0 +1,59 @@
+#include "marker_pool.h"
+
+namespace cpplox {
+
+MarkerPool::~MarkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread &helper : helpers_) {
+    helper.join();
+  }
+}
+
+void MarkerPool::run(size_t threads,
+                     const std::function<void(size_t)> &work) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // A helper started here sees the generation bumped below as new.
+    while (helpers_.size() + 1 < threads) {
+      size_t index = helpers_.size() + 1;
+      helpers_.emplace_back([this, index] { help(index); });
+    }
+    work_ = &work;
+    participants_ = threads - 1;
+    pending_ = threads - 1;
+    generation_++;
+  }
+  wake_.notify_all();
+
+  work(0);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  finished_.wait(lock, [this] { return pending_ == 0; });
+  work_ = nullptr;
+}
+
+void MarkerPool::help(size_t index) {
+  uint64_t seen = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    wake_.wait(lock, [this, seen] { return stopping_ || generation_ != seen; });
+    if (stopping_)
+      return;
+    seen = generation_;
+    if (index > participants_)
+      continue;
+
+    const std::function<void(size_t)> &work = *work_;
+    lock.unlock();
+    work(index);
+    lock.lock();
+    if (--pending_ == 0)
+      finished_.notify_one();
+  }
+}
+
+} // namespace cpplox
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cpplox {
+
+// Threads that help the VM thread drain the gray stack. They are started by
+// the first parallel mark and sleep between marks, so a mark wakes them
+// instead of creating and joining a thread per helper.
+class MarkerPool {
+public:
+  MarkerPool() = default;
+  ~MarkerPool();
+  MarkerPool(const MarkerPool &) = delete;
+  MarkerPool &operator=(const MarkerPool &) = delete;
+
+  // Calls work(0) on this thread and work(1) to work(threads - 1) on pool
+  // threads, and returns once every call has.
+  void run(size_t threads, const std::function<void(size_t)> &work);
+
+private:
+  void help(size_t index);
+
+  std::vector<std::thread> helpers_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable finished_;
+  const std::function<void(size_t)> *work_ = nullptr;
+  // Bumped by each run; a helper works once per generation it sees.
+  uint64_t generation_ = 0;
+  size_t participants_ = 0;
+  size_t pending_ = 0;
+  bool stopping_ = false;
+};
+
+} // namespace cpplox
@@ -1,4 +1,12 @@
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include "memory.h"
 #include "vm.h"
@@ -10,25 +18,252 @@
 
 namespace cpplox {
 
-inline constexpr size_t GC_HEAP_GROW_FACTOR = 2;
+// Allocation between two incremental slices.
+inline constexpr size_t kSliceBytes = 32 * 1024;
+
+static size_t initialTrigger(const GcPolicy &policy) {
+  return policy.maxHeap != 0 ? std::min(policy.initialHeap, policy.maxHeap)
+                             : policy.initialHeap;
+}
 
 void Heap::initialize() {
   bytesAllocated_ = 0;
-  nextGC_ = 1024 * 1024;
+  nextGC_ = initialTrigger(policy_);
+  markNanosecondsPerByte_ = 0;
+  mutatorNanosecondsPerByte_ = 0;
+  lastCycleEnd_ = 0;
+  lastLiveBytes_ = 0;
   objects_ = nullptr;
   grayStack_.clear();
+  nursery_.resize(kNurserySize);
+  nurseryStart_ = nursery_.data();
+  nurseryTop_ = nurseryStart_;
+  nurseryLimit_.store(nurseryStart_ + kNurseryLimit,
+                      std::memory_order_relaxed);
+  nurseryEnd_ = nurseryStart_ + kNurserySize;
+  rememberedSet_.clear();
+  globalsRemembered_ = false;
+  collections_ = 0;
+  minorCollections_ = 0;
+  promotedBytes_ = 0;
+  compactionRequested_ = false;
+  compactions_ = 0;
+  compactedBytes_ = 0;
+  payloadBlock_ = nullptr;
+  payloadBlockSize_ = 0;
+  payloadBlockLive_ = 0;
+  phase_ = GcPhase::Idle;
+  allocatedSinceSlice_ = 0;
+  sweepList_ = nullptr;
+  sweepLink_ = nullptr;
+  sweepLast_ = nullptr;
+  pauseHistogram_.fill(0);
+  pauseCount_ = 0;
+  totalPause_ = 0;
+  maxPause_ = 0;
+  lastPause_ = 0;
+  gcEvents_.clear();
+  startTime_ = std::chrono::steady_clock::now().time_since_epoch() /
+               std::chrono::nanoseconds(1);
 }
 
-void *Heap::reallocate(Vm &vm, void *pointer, size_t oldSize, size_t newSize) {
-  bytesAllocated_ += newSize - oldSize;
-  if (newSize > oldSize) {
+uint64_t Heap::elapsedNanoseconds() const {
+  int64_t now = std::chrono::steady_clock::now().time_since_epoch() /
+                std::chrono::nanoseconds(1);
+  return static_cast<uint64_t>(now - startTime_);
+}
+
+void Heap::release() {
+  for (SlabClass &slab : slabs_) {
+    for (SlabPage *page : slab.pages) {
+      SlabPage::destroy(page);
+    }
+    slab.pages.clear();
+    slab.allocPage = 0;
+  }
+  nursery_.clear();
+  nursery_.shrink_to_fit();
+  nurseryStart_ = nurseryTop_ = nurseryEnd_ = nullptr;
+  nurseryLimit_.store(nullptr, std::memory_order_relaxed);
+  rememberedSet_.clear();
+  std::free(payloadBlock_);
+  payloadBlock_ = nullptr;
+  payloadBlockSize_ = 0;
+  payloadBlockLive_ = 0;
+}
+
+void Heap::setPolicy(const GcPolicy &policy) {
+  policy_ = policy;
+  if (collections_ == 0)
+    nextGC_ = initialTrigger(policy);
+}
+
+// With live bytes L, marking cost m per live byte, mutator time a per
+// allocated byte and a fraction s of new allocation surviving, headroom H
+// costs m(L + sH) of marking against aH of mutator time. Solving
+// m(L + sH) = f(m(L + sH) + aH) for the target fraction f gives
+// H = mL(1 - f) / (fa - ms(1 - f)); with no positive solution the target is
+// out of reach and the largest headroom is used.
+static double adaptiveGrowFactor(double live, double mark, double mutator,
+                                 double survival, double target) {
+  double denominator = target * mutator - mark * survival * (1 - target);
+  if (live <= 0 || mark <= 0 || denominator <= 0)
+    return kMaxAdaptiveGrowFactor;
+  double headroom = mark * live * (1 - target) / denominator;
+  return std::clamp(1 + headroom / live, kMinAdaptiveGrowFactor,
+                    kMaxAdaptiveGrowFactor);
+}
+
+void Heap::pace() {
+  size_t live = bytesAllocated_;
+  double factor = policy_.growFactor;
+  if (policy_.adaptive) {
+    uint64_t now = elapsedNanoseconds();
+    size_t allocated = cycleStartBytes_ > lastLiveBytes_
+                           ? cycleStartBytes_ - lastLiveBytes_
+                           : 0;
+    // A cycle run outside an allocation (compactHeap(), for one) has no
+    // timed pauses and teaches nothing.
+    if (cyclePause_ > 0 && allocated > 0 && live > 0) {
+      auto smooth = [](double &average, double sample) {
+        average = average == 0 ? sample : (average + sample) / 2;
+      };
+      smooth(markNanosecondsPerByte_,
+             static_cast<double>(cyclePause_) / static_cast<double>(live));
+      uint64_t mutator =
+          cycleStart_ > lastCycleEnd_ ? cycleStart_ - lastCycleEnd_ : 0;
+      if (mutator > 0) {
+        smooth(mutatorNanosecondsPerByte_, static_cast<double>(mutator) /
+                                               static_cast<double>(allocated));
+      }
+    }
+    double survival =
+        allocated == 0 || live <= lastLiveBytes_
+            ? 0
+            : std::min(1.0, static_cast<double>(live - lastLiveBytes_) /
+                                static_cast<double>(allocated));
+    if (mutatorNanosecondsPerByte_ > 0) {
+      factor = adaptiveGrowFactor(static_cast<double>(live),
+                                  markNanosecondsPerByte_,
+                                  mutatorNanosecondsPerByte_, survival,
+                                  policy_.targetCpu);
+    }
+    lastCycleEnd_ = now;
+  }
+  lastLiveBytes_ = live;
+
+  nextGC_ = static_cast<size_t>(static_cast<double>(live) * factor);
+  if (policy_.maxHeap != 0) {
+    nextGC_ = std::max(std::min(nextGC_, policy_.maxHeap),
+                       live + kMinHeapHeadroom);
+  }
+}
+
+// Bucket i counts pauses shorter than 2^i microseconds (and at least half
+// that).
+void Heap::recordPause(uint64_t nanoseconds) {
+  uint64_t microseconds = nanoseconds / 1000;
+  int bucket = std::bit_width(microseconds);
+  if (bucket >= kPauseBuckets)
+    bucket = kPauseBuckets - 1;
+  pauseHistogram_[bucket]++;
+  pauseCount_++;
+  totalPause_ += nanoseconds;
+  if (nanoseconds > maxPause_)
+    maxPause_ = nanoseconds;
+  lastPause_ = nanoseconds;
+}
+
+namespace {
+
+class PauseTimer {
+public:
+  explicit PauseTimer(Heap &heap)
+      : heap_(heap), start_(std::chrono::steady_clock::now()) {}
+  ~PauseTimer() {
+    auto elapsed = std::chrono::steady_clock::now() - start_;
+    heap_.recordPause(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+            .count()));
+  }
+
+private:
+  Heap &heap_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace
+
+static void collectIncrementally(Vm &vm);
+static void markSlice(Vm &vm, size_t budget);
+static bool sweep(Vm &vm, size_t budget);
+static size_t sweepPage(Vm &vm, SlabPage *page);
+
+// Runs collector work owed for allocation: a lazy sweep batch, a marking
+// slice, or a new cycle once the heap has passed nextGC. Sweep batches are as
+// cheap as a few frees and are not timed as pauses.
+static void payAllocationDebt(Vm &vm, size_t bytes) {
+  Heap &heap = vm.heap;
+  if (heap.phase() == GcPhase::Sweep) {
+    sweep(vm, kLazySweepBatch);
+  } else if (heap.phase() == GcPhase::Mark) {
+    heap.allocatedSinceSlice() += bytes;
+    if (heap.allocatedSinceSlice() >= kSliceBytes) {
+      heap.allocatedSinceSlice() = 0;
+      {
+        PauseTimer timer(heap);
+        // Slices too small to keep up with allocation would never end the
+        // cycle, so once the heap has doubled past the trigger the rest of
+        // the marking is done at once.
+        if (heap.bytesAllocated() > 2 * heap.nextGC()) {
+          markSlice(vm, SIZE_MAX);
+        } else {
+          collectIncrementally(vm);
+        }
+      }
+      heap.countCyclePause();
+    }
+  } else if (heap.bytesAllocated() > heap.nextGC()) {
+    {
+      PauseTimer timer(heap);
+      if (heap.incremental()) {
+        collectIncrementally(vm);
+      } else {
+        markSlice(vm, SIZE_MAX);
+      }
+    }
+    heap.countCyclePause();
+  }
+}
+
+static void collectForAllocation(Vm &vm, size_t bytes) {
 #ifdef DEBUG_STRESS_GC
+  if (vm.heap.incremental()) {
+    collectIncrementally(vm);
+  } else {
     collectGarbage(vm);
+  }
 #endif
 
-    if (bytesAllocated_ > nextGC_) {
-      collectGarbage(vm);
+  payAllocationDebt(vm, bytes);
+}
+
+void *Heap::reallocate(Vm &vm, void *pointer, size_t oldSize, size_t newSize) {
+  bytesAllocated_ += newSize - oldSize;
+  if (newSize > oldSize) {
+    collectForAllocation(vm, newSize - oldSize);
+  }
+
+  if (inPayloadBlock(pointer)) [[unlikely]] {
+    void *result = nullptr;
+    if (newSize != 0) {
+      result = std::malloc(newSize);
+      if (result == nullptr)
+        std::exit(1);
+      std::memcpy(result, pointer, std::min(oldSize, newSize));
     }
+    releasePayload(pointer, oldSize);
+    return result;
   }
 
   if (newSize == 0) {
@@ -42,14 +277,61 @@ void *Heap::reallocate(Vm &vm, void *pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
+void Heap::releasePayload(void *pointer, size_t size) {
+  if (!inPayloadBlock(pointer)) {
+    std::free(pointer);
+    return;
+  }
+  payloadBlockLive_ -= size;
+  if (payloadBlockLive_ == 0) {
+    std::free(payloadBlock_);
+    payloadBlock_ = nullptr;
+    payloadBlockSize_ = 0;
+  }
+}
+
+void *Heap::allocateSlot(Vm &vm, size_t size) {
+  size_t slotSize = (slabClassIndex(size) + 1) * kSlabGranule;
+  bytesAllocated_ += slotSize;
+  collectForAllocation(vm, slotSize);
+  return takeSlot(vm, size);
+}
+
+void *Heap::allocatePromoted(Vm &vm, size_t size) {
+  bytesAllocated_ += (slabClassIndex(size) + 1) * kSlabGranule;
+  return takeSlot(vm, size);
+}
+
+// First fit over the class's pages. While a sweep is pending, a page is swept
+// before its free slots are handed out, so a new object is never mistaken for
+// garbage.
+void *Heap::takeSlot(Vm &vm, size_t size) {
+  int index = slabClassIndex(size);
+  SlabClass &slab = slabs_[index];
+  while (slab.allocPage < slab.pages.size()) {
+    SlabPage *page = slab.pages[slab.allocPage];
+    if (!page->swept) {
+      sweepPage(vm, page);
+    }
+    if (void *slot = page->takeFreeSlot())
+      return slot;
+    slab.allocPage++;
+  }
+
+  SlabPage *page = SlabPage::create((index + 1) * kSlabGranule);
+  slab.pages.push_back(page);
+  return page->takeFreeSlot();
+}
+
 void *reallocate(Vm &vm, void *pointer, size_t oldSize, size_t newSize) {
   return vm.heap.reallocate(vm, pointer, oldSize, newSize);
 }
 
+// Young objects are never marked: the nursery is scanned as a root instead.
 void markObject(Vm &vm, Obj *object) {
   if (object == nullptr)
     return;
-  if (object->isMarked)
+  if (vm.heap.isYoung(object) || vm.heap.isMarked(object))
     return;
 
 #ifdef DEBUG_LOG_GC
@@ -58,7 +340,7 @@ void markObject(Vm &vm, Obj *object) {
   std::printf("\n");
 #endif
 
-  object->isMarked = true;
+  vm.heap.setMarked(object);
 
   vm.heap.grayStack().push_back(object);
 }
@@ -66,83 +348,132 @@ void markValue(Vm &vm, Value value) {
   if (isObj(value))
     markObject(vm, asObj(value));
 }
-static void markArray(Vm &vm, const ValueArray &array) {
-  for (Value value : array) {
-    markValue(vm, value);
-  }
-}
-static void markInlineCaches(Vm &vm, Chunk *chunk) {
-  for (int i = 0; i < static_cast<int>(chunk->constants().size()); i++) {
-    InlineCache *cache = &chunk->inlineCache(i);
-    if ((cache->kind == CACHE_FIELD || cache->kind == CACHE_METHOD) &&
-        cache->ownerClass != nullptr) {
-      markObject(vm, cache->ownerClass);
-    }
-    if (cache->kind == CACHE_METHOD) {
-      markValue(vm, cache->value);
-    }
-  }
-}
-static void blackenObject(Vm &vm, Obj *object) {
-#ifdef DEBUG_LOG_GC
-  std::printf("%p blacken ", (void *)object);
-  printValue(objectValue(object));
-  std::printf("\n");
-#endif
+// Calls visit on every object the object references, including null and young
+// ones; the visitor filters.
+template <typename Visit> static void forEachReference(Obj *object, Visit visit) {
+  auto visitValue = [&visit](Value value) {
+    if (isObj(value))
+      visit(asObj(value));
+  };
+  auto visitTable = [&](Table &table) {
+    table.forEachEntry([&](Entry &entry) {
+      visit(entry.key);
+      visitValue(entry.value);
+    });
+  };
 
   switch (object->type) {
   case OBJ_BOUND_METHOD: {
     ObjBoundMethod *bound = static_cast<ObjBoundMethod *>(object);
-    markValue(vm, bound->receiver);
-    markObject(vm, bound->method);
+    visitValue(bound->receiver);
+    visit(bound->method);
     break;
   }
   case OBJ_CLASS: {
     ObjClass *klass = static_cast<ObjClass *>(object);
-    markObject(vm, klass->name);
-    klass->methods.mark(vm);
-    markObject(vm, klass->initializer);
-    klass->fieldSlots.mark(vm);
+    visit(klass->name);
+    visitTable(klass->methods);
+    visit(klass->initializer);
+    visitTable(klass->fieldSlots);
     break;
   }
   case OBJ_CLOSURE: {
     ObjClosure *closure = static_cast<ObjClosure *>(object);
-    markObject(vm, closure->function);
+    visit(closure->function);
     for (int i = 0; i < closure->upvalues.size(); i++) {
-      markObject(vm, closure->upvalues[i]);
+      visit(closure->upvalues[i]);
     }
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction *function = static_cast<ObjFunction *>(object);
-    markObject(vm, function->name);
-    markArray(vm, function->chunk.constants());
-    markInlineCaches(vm, &function->chunk);
+    visit(function->name);
+    Chunk &chunk = function->chunk;
+    for (int i = 0; i < static_cast<int>(chunk.constants().size()); i++) {
+      visitValue(chunk.constantAt(i));
+      const InlineCache &cache = chunk.inlineCache(i);
+      for (int way = 0; way < cache.classCount; way++) {
+        visit(cache.classes[way].ownerClass);
+        if (cache.classes[way].kind == CACHE_METHOD) {
+          visitValue(cache.classes[way].value);
+        }
+      }
+    }
     break;
   }
   case OBJ_INSTANCE: {
     ObjInstance *instance = static_cast<ObjInstance *>(object);
-    markObject(vm, instance->klass);
+    visit(instance->klass);
     for (int i = 0; i < instance->fields.capacity(); i++) {
       Value value = instance->fields.data()[i];
       if (!isUninitialized(value)) {
-        markValue(vm, value);
+        visitValue(value);
       }
     }
     break;
   }
   case OBJ_UPVALUE:
-    markValue(vm, static_cast<ObjUpvalue *>(object)->closed);
+    visitValue(static_cast<ObjUpvalue *>(object)->closed);
     break;
+  case OBJ_ROPE: {
+    ObjRope *rope = static_cast<ObjRope *>(object);
+    visit(rope->left);
+    visit(rope->right);
+    visit(rope->flat);
+    break;
+  }
   case OBJ_NATIVE:
   case OBJ_STRING:
     break;
   }
 }
+static void blackenObject(Vm &vm, Obj *object) {
+#ifdef DEBUG_LOG_GC
+  std::printf("%p blacken ", (void *)object);
+  printValue(objectValue(object));
+  std::printf("\n");
+#endif
+
+  forEachReference(object, [&vm](Obj *reference) { markObject(vm, reference); });
+}
 
 template <typename Object> void destroyObject(Vm &vm, Object *object) {
+  bool inSlab = isSlabKind(object->type);
   object->~Object();
-  release(vm, object);
+  if (inSlab) {
+    vm.heap.releaseSlot(object);
+  } else {
+    release(vm, object);
+  }
+}
+
+static size_t youngObjectSize(ObjectKind type) {
+  return type == OBJ_INSTANCE ? sizeof(ObjInstance) : sizeof(ObjBoundMethod);
+}
+
+// Calls f on every object in the nursery, in allocation order.
+template <typename F> static void forEachYoungObject(Vm &vm, F f) {
+  uint8_t *cursor = vm.heap.nurseryStart();
+  while (cursor < vm.heap.nurseryTop()) {
+    Obj *object = reinterpret_cast<Obj *>(cursor);
+    cursor += youngObjectSize(object->type);
+    f(object);
+  }
+}
+
+// Runs the destructors of young objects that were not promoted and empties
+// the nursery. Their storage is never passed to free().
+static void releaseNursery(Vm &vm) {
+  forEachYoungObject(vm, [](Obj *object) {
+    if (object->next != nullptr)
+      return;
+    if (object->type == OBJ_INSTANCE) {
+      static_cast<ObjInstance *>(object)->~ObjInstance();
+    } else {
+      static_cast<ObjBoundMethod *>(object)->~ObjBoundMethod();
+    }
+  });
+  vm.heap.nurseryTop() = vm.heap.nurseryStart();
 }
 
 static void freeObject(Vm &vm, Obj *object) {
@@ -177,6 +508,9 @@ static void freeObject(Vm &vm, Obj *object) {
   case OBJ_NATIVE:
     destroyObject(vm, static_cast<ObjNative *>(object));
     break;
+  case OBJ_ROPE:
+    destroyObject(vm, static_cast<ObjRope *>(object));
+    break;
   case OBJ_STRING: {
     ObjString *string = static_cast<ObjString *>(object);
     freeArray(vm, string->chars, string->length + 1);
@@ -205,57 +539,771 @@ static void markRoots(Vm &vm) {
   vm.globals.mark(vm);
   vm.markCompilerRoots();
   markObject(vm, vm.initString);
+  forEachYoungObject(vm, [&vm](Obj *object) { blackenObject(vm, object); });
 }
-static void traceReferences(Vm &vm) {
+namespace {
+
+// A marking thread's gray stack. Past kShareThreshold entries the owner moves
+// half of them to `shared`, where idle workers can steal them.
+struct MarkWorker {
+  std::vector<Obj *> local;
+  std::mutex mutex;
+  std::vector<Obj *> shared;
+  std::atomic<size_t> sharedSize{0};
+};
+
+inline constexpr size_t kShareThreshold = 64;
+
+class ParallelMarker {
+public:
+  ParallelMarker(Heap &heap, size_t threads)
+      : heap_(heap), workers_(threads), active_(threads) {
+    for (auto &worker : workers_) {
+      worker = std::make_unique<MarkWorker>();
+    }
+    auto &grayStack = heap.grayStack();
+    for (size_t i = 0; i < grayStack.size(); i++) {
+      workers_[i % threads]->local.push_back(grayStack[i]);
+    }
+    grayStack.clear();
+  }
+
+  void run() {
+    heap_.markerPool().run(workers_.size(), [this](size_t i) { work(i); });
+    heap_.countParallelMark(steals_.load());
+  }
+
+private:
+  void work(size_t self) {
+    MarkWorker &worker = *workers_[self];
+    auto visit = [this, &worker](Obj *object) {
+      if (object != nullptr && !heap_.isYoung(object) &&
+          heap_.tryMarkAtomic(object)) {
+        worker.local.push_back(object);
+      }
+    };
+
+    for (;;) {
+      while (!worker.local.empty()) {
+        Obj *object = worker.local.back();
+        worker.local.pop_back();
+        forEachReference(object, visit);
+        if (worker.local.size() > kShareThreshold &&
+            worker.sharedSize.load(std::memory_order_relaxed) == 0) {
+          share(worker);
+        }
+      }
+      if (takeShared(worker) || steal(self))
+        continue;
+
+      // A worker only goes idle with its shared stack empty, and only active
+      // workers add to shared stacks, so no active workers means no work.
+      active_.fetch_sub(1);
+      for (;;) {
+        if (active_.load() == 0)
+          return;
+        if (hasSharedWork()) {
+          active_.fetch_add(1);
+          if (steal(self))
+            break;
+          active_.fetch_sub(1);
+        }
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  static void share(MarkWorker &worker) {
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    size_t half = worker.local.size() / 2;
+    worker.shared.insert(worker.shared.end(), worker.local.begin(),
+                         worker.local.begin() + half);
+    worker.local.erase(worker.local.begin(), worker.local.begin() + half);
+    worker.sharedSize.store(worker.shared.size());
+  }
+
+  static bool takeShared(MarkWorker &worker) {
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.shared.empty())
+      return false;
+    worker.local.swap(worker.shared);
+    worker.sharedSize.store(0);
+    return true;
+  }
+
+  bool steal(size_t self) {
+    MarkWorker &thief = *workers_[self];
+    for (size_t i = 1; i < workers_.size(); i++) {
+      MarkWorker &victim = *workers_[(self + i) % workers_.size()];
+      if (victim.sharedSize.load() == 0)
+        continue;
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      size_t count = (victim.shared.size() + 1) / 2;
+      if (count == 0)
+        continue;
+      thief.local.insert(thief.local.end(), victim.shared.end() - count,
+                         victim.shared.end());
+      victim.shared.resize(victim.shared.size() - count);
+      victim.sharedSize.store(victim.shared.size());
+      steals_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+
+  bool hasSharedWork() const {
+    for (const auto &worker : workers_) {
+      if (worker->sharedSize.load() != 0)
+        return true;
+    }
+    return false;
+  }
+
+  Heap &heap_;
+  std::vector<std::unique_ptr<MarkWorker>> workers_;
+  std::atomic<size_t> active_;
+  std::atomic<uint64_t> steals_{0};
+};
+
+} // namespace
+
+// Blackens up to budget gray objects; returns false if any are left. A full
+// drain is shared between the configured marking threads.
+static bool traceReferences(Vm &vm, size_t budget) {
+  if (budget == SIZE_MAX && vm.heap.markThreads() > 1) {
+    vm.heap.noteGrayDepth(vm.heap.grayStack().size());
+    ParallelMarker(vm.heap, vm.heap.markThreads()).run();
+    return true;
+  }
+
   auto &grayStack = vm.heap.grayStack();
   while (!grayStack.empty()) {
+    if (budget-- == 0)
+      return false;
+    vm.heap.noteGrayDepth(grayStack.size());
     Obj *object = grayStack.back();
     grayStack.pop_back();
     blackenObject(vm, object);
   }
+  return true;
 }
-static void sweep(Vm &vm) {
-  Obj *previous = nullptr;
-  Obj *object = vm.heap.objects();
-  while (object != nullptr) {
-    if (object->isMarked) {
-      object->isMarked = false;
-      previous = object;
-      object = object->next;
-    } else {
-      Obj *unreached = object;
-      object = object->next;
-      if (previous != nullptr) {
-        previous->next = object;
-      } else {
-        vm.heap.objects() = object;
+static void beginCycle(Vm &vm) {
+#ifdef DEBUG_LOG_GC
+  std::printf("-- gc begin\n");
+#endif
+  vm.heap.cycleStartBytes() = vm.heap.bytesAllocated();
+  vm.heap.cycleStartNanoseconds() = vm.heap.elapsedNanoseconds();
+  vm.heap.cyclePauseNanoseconds() = 0;
+  vm.heap.cyclePauses() = 0;
+  vm.heap.grayHighWater() = 0;
+  vm.heap.allocatedSinceSlice() = 0;
+  vm.heap.setPhase(GcPhase::Mark);
+  vm.heap.advanceMarkEpoch();
+  for (SlabClass &slab : vm.heap.slabs()) {
+    for (SlabPage *page : slab.pages) {
+      page->clearMarks();
+    }
+  }
+  markRoots(vm);
+}
+// The atomic end of marking. Stack and global stores are not barriered, so
+// the roots are scanned again before anything is declared unreachable.
+static void finishMarking(Vm &vm) {
+  markRoots(vm);
+  traceReferences(vm, SIZE_MAX);
+  vm.strings.removeWhite(vm.heap);
+
+  auto &remembered = vm.heap.rememberedSet();
+  std::erase_if(remembered,
+                [&vm](Obj *object) { return !vm.heap.isMarked(object); });
+
+  vm.heap.sweepList() = vm.heap.objects();
+  vm.heap.objects() = nullptr;
+  vm.heap.sweepLink() = &vm.heap.sweepList();
+  vm.heap.sweepLast() = nullptr;
+  for (SlabClass &slab : vm.heap.slabs()) {
+    for (SlabPage *page : slab.pages) {
+      page->swept = false;
+    }
+    slab.allocPage = 0;
+  }
+  vm.heap.sweepClass() = 0;
+  vm.heap.sweepPageIndex() = 0;
+  vm.heap.setPhase(GcPhase::Sweep);
+}
+static void releaseEmptyPages(Heap &heap) {
+  for (SlabClass &slab : heap.slabs()) {
+    std::erase_if(slab.pages, [](SlabPage *page) {
+      if (page->liveCount != 0)
+        return false;
+      SlabPage::destroy(page);
+      return true;
+    });
+    slab.allocPage = 0;
+  }
+}
+static void checkFragmentation(Heap &heap) {
+#ifdef DEBUG_STRESS_GC
+  heap.requestCompaction();
+#else
+  size_t pages = 0;
+  size_t live = 0;
+  size_t capacity = 0;
+  for (SlabClass &slab : heap.slabs()) {
+    for (SlabPage *page : slab.pages) {
+      pages++;
+      live += page->liveCount;
+      capacity += page->slotCount;
+    }
+  }
+  if (pages >= kCompactMinPages && live * 100 < capacity * kCompactOccupancy) {
+    heap.requestCompaction();
+  }
+#endif
+}
+static void recordMajorEvent(Heap &heap) {
+  GcEvent event{};
+  event.kind = GcEventKind::Major;
+  event.startNanoseconds = heap.cycleStartNanoseconds();
+  event.pauseNanoseconds = heap.cyclePauseNanoseconds();
+  event.pauses = heap.cyclePauses();
+  event.bytesBefore = heap.cycleStartBytes();
+  event.bytesAfter = heap.bytesAllocated();
+  event.nextGC = heap.nextGC();
+  event.grayHighWater = heap.grayHighWater();
+  heap.forEachListObject([&event](Obj *object) {
+    event.liveObjects[objectKindIndex(object->type)]++;
+  });
+  for (SlabClass &slab : heap.slabs()) {
+    for (SlabPage *page : slab.pages) {
+      for (int word = 0; word < SlabPage::kWords; word++) {
+        uint64_t live = page->allocated[word];
+        while (live != 0) {
+          int bit = std::countr_zero(live);
+          live &= live - 1;
+          event.liveObjects[objectKindIndex(
+              page->objectAt(word * 64 + bit)->type)]++;
+        }
       }
+    }
+  }
+  heap.recordEvent(event);
+}
+static void finishSweep(Vm &vm) {
+  Heap &heap = vm.heap;
+  if (heap.sweepLast() != nullptr) {
+    heap.sweepLast()->next = heap.objects();
+    heap.objects() = heap.sweepList();
+  }
+  heap.sweepList() = nullptr;
+  heap.sweepLink() = nullptr;
+  heap.sweepLast() = nullptr;
+  releaseEmptyPages(heap);
+  if (heap.autoCompact()) {
+    checkFragmentation(heap);
+  }
+  heap.setPhase(GcPhase::Idle);
+  heap.countCollection();
 
-      freeObject(vm, unreached);
+  heap.pace();
+  if (heap.telemetry()) {
+    recordMajorEvent(heap);
+  }
+
+#ifdef DEBUG_LOG_GC
+  size_t before = heap.cycleStartBytes();
+  std::printf("-- gc end\n");
+  std::printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+         before - heap.bytesAllocated(), before, heap.bytesAllocated(),
+         heap.nextGC());
+#endif
+}
+// Frees the page's allocated but unmarked slots; returns how many.
+static size_t sweepPage(Vm &vm, SlabPage *page) {
+  page->swept = true;
+  size_t freed = 0;
+  for (int word = 0; word < SlabPage::kWords; word++) {
+    uint64_t dead = page->allocated[word] & ~page->marked[word];
+    while (dead != 0) {
+      int bit = std::countr_zero(dead);
+      dead &= dead - 1;
+      freeObject(vm, page->objectAt(word * 64 + bit));
+      freed++;
     }
   }
+  return freed;
+}
+// Frees about budget objects, list objects first and then whole pages; returns
+// false if the sweep is not finished.
+static bool sweep(Vm &vm, size_t budget) {
+  Heap &heap = vm.heap;
+  Obj **&link = heap.sweepLink();
+  while (*link != nullptr) {
+    if (budget-- == 0)
+      return false;
+    Obj *object = *link;
+    if (heap.isMarked(object)) {
+      heap.sweepLast() = object;
+      link = &object->next;
+    } else {
+      *link = object->next;
+      freeObject(vm, object);
+    }
+  }
+
+  auto &slabs = heap.slabs();
+  while (heap.sweepClass() < slabs.size()) {
+    auto &pages = slabs[heap.sweepClass()].pages;
+    if (heap.sweepPageIndex() == pages.size()) {
+      heap.sweepClass()++;
+      heap.sweepPageIndex() = 0;
+      continue;
+    }
+    if (budget == 0)
+      return false;
+    SlabPage *page = pages[heap.sweepPageIndex()++];
+    if (!page->swept) {
+      size_t freed = sweepPage(vm, page);
+      budget -= std::min(budget, std::max<size_t>(freed, 1));
+    }
+  }
+  finishSweep(vm);
+  return true;
+}
+// Advances marking by up to budget objects. The sweep that follows is left to
+// allocation.
+static void markSlice(Vm &vm, size_t budget) {
+  if (vm.heap.phase() == GcPhase::Sweep)
+    return;
+  if (vm.heap.phase() == GcPhase::Idle) {
+    beginCycle(vm);
+  }
+  if (traceReferences(vm, budget)) {
+    finishMarking(vm);
+  }
+}
+// Objects added to a function being compiled are not barriered, so a cycle
+// that reaches the compiler is finished in one pause.
+static void collectIncrementally(Vm &vm) {
+  markSlice(vm, vm.compilerRoots.empty() ? vm.heap.sliceBudget() : SIZE_MAX);
+}
+static void finishCycle(Vm &vm) {
+  if (vm.heap.phase() == GcPhase::Mark) {
+    markSlice(vm, SIZE_MAX);
+  }
+  if (vm.heap.phase() == GcPhase::Sweep) {
+    sweep(vm, SIZE_MAX);
+  }
 }
 void collectGarbage(Vm &vm) {
+  finishCycle(vm);
+  markSlice(vm, SIZE_MAX);
+  sweep(vm, SIZE_MAX);
+}
+// Calls f on each slot through which the object can reference the nursery.
+// Only instances, bound methods and closed upvalues hold such references.
+template <typename F> static void forEachYoungReference(Obj *object, F f) {
+  switch (object->type) {
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = static_cast<ObjInstance *>(object);
+    for (int i = 0; i < instance->fields.capacity(); i++) {
+      f(&instance->fields.data()[i]);
+    }
+    break;
+  }
+  case OBJ_BOUND_METHOD:
+    f(&static_cast<ObjBoundMethod *>(object)->receiver);
+    break;
+  case OBJ_UPVALUE:
+    f(&static_cast<ObjUpvalue *>(object)->closed);
+    break;
+  default:
+    break;
+  }
+}
+
+template <typename F> static void forEachYoungRoot(Vm &vm, F f) {
+  for (Value *slot = vm.stack.data(); slot < vm.stackTop; slot++) {
+    f(slot);
+  }
+  if (vm.heap.globalsRemembered()) {
+    vm.globals.forEachValue(f);
+  }
+  for (Obj *object : vm.heap.rememberedSet()) {
+    forEachYoungReference(object, f);
+  }
+}
+
+static void markYoung(Vm &vm, Value *slot) {
+  if (!isObj(*slot))
+    return;
+  Obj *object = asObj(*slot);
+  if (!vm.heap.isYoung(object) || object->mark != 0)
+    return;
+  object->mark = 1;
+  vm.heap.youngGrayStack().push_back(object);
+}
+
+static void forwardYoung(Vm &vm, Value *slot) {
+  if (isObj(*slot) && vm.heap.isYoung(asObj(*slot))) {
+    *slot = objectValue(asObj(*slot)->next);
+  }
+}
+
+// Survivors are found first and then copied in nursery order, so promoted
+// objects keep the allocation order that the mutator's traversals follow.
+// Returns the number of bytes promoted.
+static size_t promoteSurvivors(Vm &vm) {
 #ifdef DEBUG_LOG_GC
-  std::printf("-- gc begin\n");
+  std::printf("-- minor gc begin\n");
+#endif
+
+  auto mark = [&vm](Value *slot) { markYoung(vm, slot); };
+  auto &grayStack = vm.heap.youngGrayStack();
+  forEachYoungRoot(vm, mark);
+  while (!grayStack.empty()) {
+    Obj *object = grayStack.back();
+    grayStack.pop_back();
+    forEachYoungReference(object, mark);
+  }
+
   size_t before = vm.heap.bytesAllocated();
+  forEachYoungObject(vm, [&vm](Obj *object) {
+    if (object->mark == 0)
+      return;
+    size_t size = youngObjectSize(object->type);
+    Obj *copy = static_cast<Obj *>(vm.heap.allocatePromoted(vm, size));
+    std::memcpy(static_cast<void *>(copy), object, size);
+    copy->next = nullptr;
+    object->next = copy;
+    vm.heap.youngGrayStack().push_back(copy);
+  });
+  size_t promoted = vm.heap.bytesAllocated() - before;
+
+  auto forward = [&vm](Value *slot) { forwardYoung(vm, slot); };
+  forEachYoungRoot(vm, forward);
+  for (Obj *object : grayStack) {
+    forEachYoungReference(object, forward);
+    vm.heap.shade(object);
+  }
+  grayStack.clear();
+
+  for (Obj *object : vm.heap.rememberedSet()) {
+    object->isRemembered = false;
+  }
+  vm.heap.rememberedSet().clear();
+  vm.heap.globalsRemembered() = false;
+  releaseNursery(vm);
+  vm.heap.countMinorCollection(promoted);
+
+#ifdef DEBUG_LOG_GC
+  std::printf("-- minor gc end\n");
+  std::printf("   promoted %zu bytes\n", promoted);
 #endif
+  return promoted;
+}
+void collectYoung(Vm &vm) {
+  if (vm.heap.nurseryTop() == vm.heap.nurseryStart())
+    return;
 
-  markRoots(vm);
-  traceReferences(vm);
-  vm.strings.removeWhite();
-  sweep(vm);
+  size_t bytesBefore = vm.heap.bytesAllocated();
+  uint64_t start = vm.heap.elapsedNanoseconds();
+  size_t promoted;
+  {
+    PauseTimer timer(vm.heap);
+    promoted = promoteSurvivors(vm);
+  }
+  if (vm.heap.telemetry()) {
+    GcEvent event{};
+    event.kind = GcEventKind::Minor;
+    event.startNanoseconds = start;
+    event.pauseNanoseconds = vm.heap.lastPauseNanoseconds();
+    event.pauses = 1;
+    event.bytesBefore = bytesBefore;
+    event.bytesAfter = vm.heap.bytesAllocated();
+    event.nextGC = vm.heap.nextGC();
+    event.movedBytes = promoted;
+    vm.heap.recordEvent(event);
+  }
+  payAllocationDebt(vm, promoted);
+}
+// Returns the object's new address if compaction moved it. Slab objects keep
+// next null except while forwarded.
+static Obj *forwardedObject(Obj *object) {
+  if (object != nullptr && isSlabKind(object->type) && object->next != nullptr)
+    return object->next;
+  return object;
+}
+template <typename T> static void forwardPointer(T *&pointer) {
+  pointer = static_cast<T *>(forwardedObject(pointer));
+}
+static void forwardValue(Value *slot) {
+  if (isObj(*slot)) {
+    *slot = objectValue(forwardedObject(asObj(*slot)));
+  }
+}
+static void forwardTable(Table &table) {
+  table.forEachEntry([](Entry &entry) {
+    forwardPointer(entry.key);
+    forwardValue(&entry.value);
+  });
+}
+static void forwardReferences(Obj *object) {
+  switch (object->type) {
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound = static_cast<ObjBoundMethod *>(object);
+    forwardValue(&bound->receiver);
+    forwardPointer(bound->method);
+    break;
+  }
+  case OBJ_CLASS: {
+    ObjClass *klass = static_cast<ObjClass *>(object);
+    forwardPointer(klass->name);
+    forwardTable(klass->methods);
+    forwardPointer(klass->initializer);
+    forwardTable(klass->fieldSlots);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = static_cast<ObjClosure *>(object);
+    for (int i = 0; i < closure->upvalues.size(); i++) {
+      forwardPointer(closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = static_cast<ObjFunction *>(object);
+    forwardPointer(function->name);
+    Chunk &chunk = function->chunk;
+    for (int i = 0; i < static_cast<int>(chunk.constants().size()); i++) {
+      forwardValue(&chunk.constants()[i]);
+      InlineCache &cache = chunk.inlineCache(i);
+      forwardPointer(cache.key);
+      for (int way = 0; way < cache.classCount; way++) {
+        if (cache.classes[way].kind == CACHE_METHOD) {
+          forwardValue(&cache.classes[way].value);
+        }
+      }
+    }
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = static_cast<ObjInstance *>(object);
+    for (int i = 0; i < instance->fields.capacity(); i++) {
+      forwardValue(&instance->fields.data()[i]);
+    }
+    break;
+  }
+  case OBJ_UPVALUE:
+    forwardValue(&static_cast<ObjUpvalue *>(object)->closed);
+    break;
+  case OBJ_ROPE: {
+    ObjRope *rope = static_cast<ObjRope *>(object);
+    forwardPointer(rope->left);
+    forwardPointer(rope->right);
+    forwardPointer(rope->flat);
+    break;
+  }
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+    break;
+  }
+}
+// Moves objects from the emptiest pages of the class into free slots of the
+// fullest. The old copies stay readable, with next pointing at the new one,
+// until every reference has been forwarded. Returns the bytes moved.
+static size_t evacuatePages(SlabClass &slab) {
+  auto &pages = slab.pages;
+  if (pages.empty())
+    return 0;
+  std::sort(pages.begin(), pages.end(), [](SlabPage *a, SlabPage *b) {
+    return a->liveCount > b->liveCount;
+  });
+
+  size_t moved = 0;
+  size_t target = 0;
+  size_t source = pages.size() - 1;
+  while (target < source) {
+    SlabPage *from = pages[source];
+    Obj *object = from->firstObject();
+    if (object == nullptr) {
+      source--;
+      continue;
+    }
+    void *slot = pages[target]->takeFreeSlot();
+    if (slot == nullptr) {
+      target++;
+      continue;
+    }
+
+    std::memcpy(slot, static_cast<void *>(object), from->slotSize);
+    Obj *copy = static_cast<Obj *>(slot);
+    if (copy->type == OBJ_UPVALUE) {
+      ObjUpvalue *upvalue = static_cast<ObjUpvalue *>(copy);
+      if (upvalue->location == &static_cast<ObjUpvalue *>(object)->closed) {
+        upvalue->location = &upvalue->closed;
+      }
+    }
+    object->next = copy;
+    from->releaseSlot(object);
+    moved += from->slotSize;
+  }
+  return moved;
+}
+// Calls f on every old object, listed or in a slab page.
+template <typename F> static void forEachOldObject(Vm &vm, F f) {
+  for (Obj *object = vm.heap.objects(); object != nullptr;
+       object = object->next) {
+    f(object);
+  }
+  for (SlabClass &slab : vm.heap.slabs()) {
+    for (SlabPage *page : slab.pages) {
+      for (int word = 0; word < SlabPage::kWords; word++) {
+        uint64_t live = page->allocated[word];
+        while (live != 0) {
+          int bit = std::countr_zero(live);
+          live &= live - 1;
+          f(page->objectAt(word * 64 + bit));
+        }
+      }
+    }
+  }
+}
+static void forwardHeap(Vm &vm) {
+  for (Value *slot = vm.stack.data(); slot < vm.stackTop; slot++) {
+    forwardValue(slot);
+  }
+  for (int i = 0; i < vm.frameCount; i++) {
+    forwardPointer(vm.frames[i].closure);
+  }
+  for (ObjUpvalue **link = &vm.openUpvalues; *link != nullptr;
+       link = &(*link)->next) {
+    forwardPointer(*link);
+  }
+  forwardTable(vm.globals);
+  forwardTable(vm.strings);
+  forwardPointer(vm.initString);
+
+  forEachOldObject(vm, forwardReferences);
+}
+// Replaces each payload the object owns, string characters or a field array,
+// with move(payload, size).
+template <typename F> static void movePayloads(Obj *object, F move) {
+  switch (object->type) {
+  case OBJ_STRING: {
+    ObjString *string = static_cast<ObjString *>(object);
+    string->chars =
+        static_cast<char *>(move(string->chars, string->length + 1));
+    break;
+  }
+  case OBJ_INSTANCE: {
+    FieldStorage &fields = static_cast<ObjInstance *>(object)->fields;
+    if (fields.data() != nullptr) {
+      fields.rebase(static_cast<Value *>(
+          move(fields.data(), fields.capacity() * sizeof(Value))));
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+// Copies every live payload into a new block, in heap order, so the
+// characters and fields of objects that are used together end up together.
+// Returns the bytes moved.
+static size_t compactPayloads(Vm &vm) {
+  constexpr size_t kAlign = alignof(Value);
+  size_t blockSize = 0;
+  size_t live = 0;
+  forEachOldObject(vm, [&](Obj *object) {
+    movePayloads(object, [&](void *payload, size_t size) {
+      blockSize += (size + kAlign - 1) & ~(kAlign - 1);
+      live += size;
+      return payload;
+    });
+  });
+  if (live == 0)
+    return 0;
 
-  vm.heap.setNextGC(vm.heap.bytesAllocated() * GC_HEAP_GROW_FACTOR);
+  char *block = static_cast<char *>(std::malloc(blockSize));
+  if (block == nullptr)
+    std::exit(1);
+  char *end = block;
+  forEachOldObject(vm, [&](Obj *object) {
+    movePayloads(object, [&](void *payload, size_t size) {
+      void *copy = end;
+      std::memcpy(copy, payload, size);
+      end += (size + kAlign - 1) & ~(kAlign - 1);
+      vm.heap.releasePayload(payload, size);
+      return copy;
+    });
+  });
+  vm.heap.setPayloadBlock(block, blockSize, live);
+  return live;
+}
+// Only called at safepoints. The nursery is emptied and any cycle in progress
+// finished first, so the remembered set and gray stack are empty and every
+// allocated slot references only allocated objects.
+void compactHeap(Vm &vm) {
+  Heap &heap = vm.heap;
+  size_t bytesBefore = heap.bytesAllocated();
+  uint64_t start = heap.elapsedNanoseconds();
+  size_t moved = 0;
+  {
+    PauseTimer timer(heap);
+    if (heap.nurseryTop() != heap.nurseryStart()) {
+      promoteSurvivors(vm);
+    }
+    finishCycle(vm);
 
 #ifdef DEBUG_LOG_GC
-  std::printf("-- gc end\n");
-  std::printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-         before - vm.heap.bytesAllocated(), before, vm.heap.bytesAllocated(),
-         vm.heap.nextGC());
+    std::printf("-- compact begin\n");
+#endif
+
+    for (SlabClass &slab : heap.slabs()) {
+      moved += evacuatePages(slab);
+    }
+    if (moved != 0) {
+      forwardHeap(vm);
+    }
+    releaseEmptyPages(heap);
+    moved += compactPayloads(vm);
+    heap.countCompaction(moved);
+
+#ifdef DEBUG_LOG_GC
+    std::printf("-- compact end\n");
+    std::printf("   moved %zu bytes\n", moved);
 #endif
+  }
+  if (heap.telemetry()) {
+    GcEvent event{};
+    event.kind = GcEventKind::Compaction;
+    event.startNanoseconds = start;
+    event.pauseNanoseconds = heap.lastPauseNanoseconds();
+    event.pauses = 1;
+    event.bytesBefore = bytesBefore;
+    event.bytesAfter = heap.bytesAllocated();
+    event.nextGC = heap.nextGC();
+    event.movedBytes = moved;
+    heap.recordEvent(event);
+  }
+}
+void collectAtSafepoint(Vm &vm) {
+  if (vm.heap.compactionRequested()) {
+    compactHeap(vm);
+  } else {
+    collectYoung(vm);
+  }
 }
 void freeObjects(Vm &vm) {
+  releaseNursery(vm);
+  Obj *swept = vm.heap.sweepList();
+  while (swept != nullptr) {
+    Obj *next = swept->next;
+    freeObject(vm, swept);
+    swept = next;
+  }
+  vm.heap.sweepList() = nullptr;
   Obj *object = vm.heap.objects();
   while (object != nullptr) {
     Obj *next = object->next;
@@ -263,7 +1311,20 @@ void freeObjects(Vm &vm) {
     object = next;
   }
   vm.heap.objects() = nullptr;
+  for (SlabClass &slab : vm.heap.slabs()) {
+    for (SlabPage *page : slab.pages) {
+      for (int word = 0; word < SlabPage::kWords; word++) {
+        uint64_t live = page->allocated[word];
+        while (live != 0) {
+          int bit = std::countr_zero(live);
+          live &= live - 1;
+          freeObject(vm, page->objectAt(word * 64 + bit));
+        }
+      }
+    }
+  }
   vm.heap.grayStack().clear();
+  vm.heap.release();
 }
 
 } // namespace cpplox
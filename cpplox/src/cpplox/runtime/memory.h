@@ -1,30 +1,369 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <vector>
 
 #include "common.h"
+#include "gc_telemetry.h"
+#include "marker_pool.h"
 #include "object.h"
+#include "slab.h"
 
 namespace cpplox {
 
 class Vm;
 
+inline constexpr size_t kNurserySize = 512 * 1024;
+// A minor collection is due once the nursery is filled this far.
+inline constexpr size_t kNurseryLimit = kNurserySize / 8 * 7;
+inline constexpr size_t kDefaultSliceBudget = 1000;
+inline constexpr size_t kLazySweepBatch = 64;
+inline constexpr int kPauseBuckets = 32;
+// With --gc-compact, a sweep that leaves at least kCompactMinPages slab pages
+// less than kCompactOccupancy percent full requests a compaction.
+inline constexpr size_t kCompactMinPages = 8;
+inline constexpr size_t kCompactOccupancy = 50;
+
+enum class GcPhase : uint8_t { Idle, Mark, Sweep };
+
+inline constexpr size_t kDefaultInitialHeap = 1024 * 1024;
+inline constexpr double kDefaultGrowFactor = 2.0;
+inline constexpr double kDefaultTargetGcCpu = 0.05;
+// Adaptive pacing keeps the trigger between these multiples of the live heap.
+inline constexpr double kMinAdaptiveGrowFactor = 1.25;
+inline constexpr double kMaxAdaptiveGrowFactor = 8.0;
+// However tight maxHeap is, a cycle leaves at least this much headroom.
+inline constexpr size_t kMinHeapHeadroom = 256 * 1024;
+
+// When the next major collection starts. A fixed policy triggers it once the
+// old generation reaches growFactor times what the last cycle left live. An
+// adaptive one sizes the headroom from the measured marking cost, mutator
+// allocation rate and survival rate so collection takes about targetCpu of
+// the run time. maxHeap, when set, caps the trigger in both modes.
+struct GcPolicy {
+  size_t initialHeap = kDefaultInitialHeap;
+  double growFactor = kDefaultGrowFactor;
+  size_t maxHeap = 0;
+  bool adaptive = false;
+  double targetCpu = kDefaultTargetGcCpu;
+};
+
+struct SlabClass {
+  std::vector<SlabPage *> pages;
+  // Pages before this one had no free slot when allocation last looked.
+  size_t allocPage = 0;
+};
+
+// Instances and bound methods are bump-allocated in a fixed nursery. A minor
+// collection copies the survivors into the old generation; the remembered set
+// lists old objects that were given a pointer into the nursery.
+//
+// Old objects of the common kinds live in slab pages, one list of pages per
+// size class, and are marked in the pages' side bitmaps. The remaining kinds
+// are malloc-backed and linked through objects(); they carry their mark in the
+// header and each cycle bumps markEpoch, so survivors are never written to
+// unmark them.
+//
+// The old generation is collected by mark-sweep. Marking runs in one pause or,
+// in incremental mode, in slices of at most sliceBudget objects; while it is
+// in progress the write barrier shades stored objects gray, and a final atomic
+// remark rescans the roots. Sweeping is lazy: every allocation frees a small
+// batch of list objects or pages until both are done, and allocation sweeps a
+// page itself before reusing its slots.
+//
+// A full drain of the gray stack can be split across markThreads workers, each
+// with its own gray stack; idle workers steal from the others. The helper
+// threads are kept in markerPool between drains.
+//
+// Compaction evacuates the emptiest pages of each size class into the fullest
+// ones and returns the emptied pages. Like a minor collection it moves objects,
+// so a request is only acted on at a safepoint. It then copies the live
+// strings' characters and instances' field arrays into one payload block.
+// Those payloads are grown and freed through reallocate like any others; the
+// block goes with the last of them, at the latest at the next compaction.
 class Heap {
 public:
   void initialize();
+  void release();
   void *reallocate(Vm &vm, void *pointer, size_t oldSize, size_t newSize);
+  // Storage for an old object of a slab kind.
+  void *allocateSlot(Vm &vm, size_t size);
+  // Promotion target. Never collects: a minor collection is in progress.
+  void *allocatePromoted(Vm &vm, size_t size);
+  void releaseSlot(Obj *object) {
+    SlabPage *page = SlabPage::of(object);
+    page->releaseSlot(object);
+    bytesAllocated_ -= page->slotSize;
+  }
+
+  // Returns nullptr when the nursery is full; the caller allocates old.
+  void *allocateYoung(size_t size) {
+    if (size > static_cast<size_t>(nurseryEnd_ - nurseryTop_))
+      return nullptr;
+    void *result = nurseryTop_;
+    nurseryTop_ += size;
+    return result;
+  }
+  bool isYoung(const Obj *object) const {
+    const uint8_t *address = reinterpret_cast<const uint8_t *>(object);
+    return address >= nurseryStart_ && address < nurseryEnd_;
+  }
+  // Minor collections and compaction only run at VM safepoints, where every
+  // live reference is reachable from the roots. A compaction request drops
+  // the nursery limit, so the VM checks a single pointer. The profiler's timer
+  // thread drops it the same way to get a sample taken.
+  bool hasSafepointWork() const {
+#ifdef DEBUG_STRESS_GC
+    return nurseryTop_ != nurseryStart_ || compactionRequested_ ||
+           nurseryLimit_.load(std::memory_order_relaxed) == nurseryStart_;
+#else
+    return nurseryTop_ >= nurseryLimit_.load(std::memory_order_relaxed);
+#endif
+  }
+  void requestSafepoint() {
+    nurseryLimit_.store(nurseryStart_, std::memory_order_relaxed);
+  }
+  // Undoes requestSafepoint unless a compaction still needs the safepoint.
+  void clearSafepointRequest() {
+    if (!compactionRequested_)
+      nurseryLimit_.store(nurseryStart_ + kNurseryLimit,
+                          std::memory_order_relaxed);
+  }
+  void shade(Obj *object) {
+    if (phase_ == GcPhase::Mark && object != nullptr && !isYoung(object) &&
+        !isMarked(object)) {
+      setMarked(object);
+      grayStack_.push_back(object);
+    }
+  }
+  void writeBarrier(Obj *owner, Value value) {
+    if (!isObj(value))
+      return;
+    Obj *target = asObj(value);
+    if (isYoung(target)) {
+      if (!owner->isRemembered && !isYoung(owner)) {
+        owner->isRemembered = true;
+        rememberedSet_.push_back(owner);
+      }
+    } else if (phase_ == GcPhase::Mark && !isYoung(owner) &&
+               isMarked(owner)) {
+      // Only a marked owner can have been scanned already. A white owner
+      // that turns out reachable is scanned with the new value in place, and
+      // the remark rescans the nursery, so shading for those would only keep
+      // new garbage alive.
+      shade(target);
+    }
+  }
+  bool compactionRequested() const { return compactionRequested_; }
+  void requestCompaction() {
+    compactionRequested_ = true;
+    nurseryLimit_.store(nurseryStart_, std::memory_order_relaxed);
+  }
+  void globalWriteBarrier(Value value) {
+    if (isObj(value) && isYoung(asObj(value)))
+      globalsRemembered_ = true;
+  }
 
   size_t bytesAllocated() const { return bytesAllocated_; }
   size_t nextGC() const { return nextGC_; }
   void setNextGC(size_t nextGC) { nextGC_ = nextGC; }
+  const GcPolicy &policy() const { return policy_; }
+  // Also moves the first trigger if no cycle has run yet.
+  void setPolicy(const GcPolicy &policy);
+  // Sets nextGC after a cycle that started at cycleStartBytes() and left
+  // bytesAllocated() live.
+  void pace();
   Obj *&objects() { return objects_; }
+  // Every malloc-backed object, including those a lazy sweep has detached.
+  template <typename F> void forEachListObject(F visit) const {
+    for (Obj *object = objects_; object != nullptr; object = object->next)
+      visit(object);
+    for (Obj *object = sweepList_; object != nullptr; object = object->next)
+      visit(object);
+  }
   std::vector<Obj *> &grayStack() { return grayStack_; }
+  std::vector<Obj *> &youngGrayStack() { return youngGrayStack_; }
+  uint8_t *nurseryStart() { return nurseryStart_; }
+  uint8_t *&nurseryTop() { return nurseryTop_; }
+  std::vector<Obj *> &rememberedSet() { return rememberedSet_; }
+  bool &globalsRemembered() { return globalsRemembered_; }
+  uint64_t collections() const { return collections_; }
+  uint64_t minorCollections() const { return minorCollections_; }
+  size_t promotedBytes() const { return promotedBytes_; }
+  uint64_t compactions() const { return compactions_; }
+  size_t compactedBytes() const { return compactedBytes_; }
+  bool autoCompact() const { return autoCompact_; }
+  void setAutoCompact(bool autoCompact) { autoCompact_ = autoCompact; }
+  std::array<SlabClass, kSlabClassCount> &slabs() { return slabs_; }
+  size_t &sweepClass() { return sweepClass_; }
+  size_t &sweepPageIndex() { return sweepPageIndex_; }
+  // Not valid for young objects, which have no mark outside a minor collection.
+  bool isMarked(const Obj *object) const {
+    if (isSlabKind(object->type))
+      return SlabPage::of(object)->isMarked(object);
+    return object->mark == markEpoch_;
+  }
+  void setMarked(Obj *object) {
+    if (isSlabKind(object->type)) {
+      SlabPage::of(object)->setMarked(object);
+    } else {
+      object->mark = markEpoch_;
+    }
+  }
+  // Marks the object unless another marking thread got there first; returns
+  // whether this call marked it.
+  bool tryMarkAtomic(Obj *object) {
+    if (isSlabKind(object->type))
+      return SlabPage::of(object)->tryMarkAtomic(object);
+    std::atomic_ref<uint8_t> mark(object->mark);
+    if (mark.load(std::memory_order_relaxed) == markEpoch_)
+      return false;
+    return mark.exchange(markEpoch_, std::memory_order_relaxed) != markEpoch_;
+  }
+  // New objects are white for the cycle in progress, or for the next one.
+  uint8_t allocationMark() const {
+    return phase_ == GcPhase::Mark ? static_cast<uint8_t>(markEpoch_ - 1)
+                                   : markEpoch_;
+  }
+  void advanceMarkEpoch() { markEpoch_++; }
+  GcPhase phase() const { return phase_; }
+  void setPhase(GcPhase phase) { phase_ = phase; }
+  size_t markThreads() const { return markThreads_; }
+  void setMarkThreads(size_t threads) { markThreads_ = threads; }
+  MarkerPool &markerPool() { return markerPool_; }
+  uint64_t parallelMarks() const { return parallelMarks_; }
+  uint64_t markSteals() const { return markSteals_; }
+  void countParallelMark(uint64_t steals) {
+    parallelMarks_++;
+    markSteals_ += steals;
+  }
+  bool incremental() const { return incremental_; }
+  void setIncremental(bool incremental) { incremental_ = incremental; }
+  size_t sliceBudget() const { return sliceBudget_; }
+  void setSliceBudget(size_t budget) { sliceBudget_ = budget; }
+  size_t &allocatedSinceSlice() { return allocatedSinceSlice_; }
+  Obj *&sweepList() { return sweepList_; }
+  Obj **&sweepLink() { return sweepLink_; }
+  Obj *&sweepLast() { return sweepLast_; }
+  size_t &cycleStartBytes() { return cycleStartBytes_; }
+  void recordPause(uint64_t nanoseconds);
+  const std::array<uint64_t, kPauseBuckets> &pauseHistogram() const {
+    return pauseHistogram_;
+  }
+  uint64_t pauseCount() const { return pauseCount_; }
+  uint64_t lastPauseNanoseconds() const { return lastPause_; }
+  uint64_t totalPauseNanoseconds() const { return totalPause_; }
+  uint64_t maxPauseNanoseconds() const { return maxPause_; }
+  void countCollection() { collections_++; }
+  bool telemetry() const { return telemetry_; }
+  void setTelemetry(bool telemetry) { telemetry_ = telemetry; }
+  const std::vector<GcEvent> &gcEvents() const { return gcEvents_; }
+  void recordEvent(const GcEvent &event) { gcEvents_.push_back(event); }
+  // Nanoseconds since initialize().
+  uint64_t elapsedNanoseconds() const;
+  void noteGrayDepth(size_t depth) {
+    if (depth > grayHighWater_)
+      grayHighWater_ = depth;
+  }
+  size_t &grayHighWater() { return grayHighWater_; }
+  uint64_t &cycleStartNanoseconds() { return cycleStart_; }
+  uint64_t &cyclePauseNanoseconds() { return cyclePause_; }
+  uint64_t &cyclePauses() { return cyclePauses_; }
+  // Charges the pause just recorded to the major cycle in progress.
+  void countCyclePause() {
+    cyclePause_ += lastPause_;
+    cyclePauses_++;
+  }
+  void countMinorCollection(size_t promoted) {
+    minorCollections_++;
+    promotedBytes_ += promoted;
+  }
+  // Frees a malloc'd payload, or drops its share of the payload block.
+  void releasePayload(void *pointer, size_t size);
+  // Only called by compaction, once every payload has left the old block.
+  void setPayloadBlock(char *block, size_t size, size_t live) {
+    payloadBlock_ = block;
+    payloadBlockSize_ = size;
+    payloadBlockLive_ = live;
+  }
+  void countCompaction(size_t moved) {
+    compactionRequested_ = false;
+    nurseryLimit_.store(nurseryStart_ + kNurseryLimit,
+                        std::memory_order_relaxed);
+    compactions_++;
+    compactedBytes_ += moved;
+  }
 
 private:
+  void *takeSlot(Vm &vm, size_t size);
+  bool inPayloadBlock(const void *pointer) const {
+    const char *address = static_cast<const char *>(pointer);
+    return payloadBlock_ != nullptr && address >= payloadBlock_ &&
+           address < payloadBlock_ + payloadBlockSize_;
+  }
+
   size_t bytesAllocated_ = 0;
-  size_t nextGC_ = 1024 * 1024;
+  size_t nextGC_ = kDefaultInitialHeap;
+  GcPolicy policy_;
+  // Adaptive pacing: smoothed costs, and where the last cycle ended.
+  double markNanosecondsPerByte_ = 0;
+  double mutatorNanosecondsPerByte_ = 0;
+  uint64_t lastCycleEnd_ = 0;
+  size_t lastLiveBytes_ = 0;
   Obj *objects_ = nullptr;
   std::vector<Obj *> grayStack_;
+  std::vector<Obj *> youngGrayStack_;
+  GcPhase phase_ = GcPhase::Idle;
+  uint8_t markEpoch_ = 0;
+  bool incremental_ = false;
+  size_t sliceBudget_ = kDefaultSliceBudget;
+  size_t markThreads_ = 1;
+  MarkerPool markerPool_;
+  uint64_t parallelMarks_ = 0;
+  uint64_t markSteals_ = 0;
+  size_t allocatedSinceSlice_ = 0;
+  // During an incremental sweep the swept objects are detached from objects_,
+  // so allocation can keep prepending to it.
+  Obj *sweepList_ = nullptr;
+  Obj **sweepLink_ = nullptr;
+  Obj *sweepLast_ = nullptr;
+  size_t cycleStartBytes_ = 0;
+  std::array<SlabClass, kSlabClassCount> slabs_;
+  // The lazy sweep's position among the pages.
+  size_t sweepClass_ = 0;
+  size_t sweepPageIndex_ = 0;
+  std::vector<uint8_t> nursery_;
+  uint8_t *nurseryStart_ = nullptr;
+  uint8_t *nurseryTop_ = nullptr;
+  std::atomic<uint8_t *> nurseryLimit_ = nullptr;
+  uint8_t *nurseryEnd_ = nullptr;
+  std::vector<Obj *> rememberedSet_;
+  bool globalsRemembered_ = false;
+  uint64_t collections_ = 0;
+  uint64_t minorCollections_ = 0;
+  size_t promotedBytes_ = 0;
+  bool autoCompact_ = false;
+  bool compactionRequested_ = false;
+  uint64_t compactions_ = 0;
+  size_t compactedBytes_ = 0;
+  // Bytes of payloads still in the block; it is freed when this reaches 0.
+  char *payloadBlock_ = nullptr;
+  size_t payloadBlockSize_ = 0;
+  size_t payloadBlockLive_ = 0;
+  std::array<uint64_t, kPauseBuckets> pauseHistogram_{};
+  uint64_t pauseCount_ = 0;
+  uint64_t totalPause_ = 0;
+  uint64_t maxPause_ = 0;
+  uint64_t lastPause_ = 0;
+  // Pauses of the major cycle in progress.
+  uint64_t cycleStart_ = 0;
+  uint64_t cyclePause_ = 0;
+  uint64_t cyclePauses_ = 0;
+  size_t grayHighWater_ = 0;
+  bool telemetry_ = false;
+  std::vector<GcEvent> gcEvents_;
+  int64_t startTime_ = 0;
 };
 
 void *reallocate(Vm &vm, void *pointer, size_t oldSize, size_t newSize);
@@ -52,6 +391,9 @@ template <typename T> void freeArray(Vm &vm, T *pointer, int oldCount) {
 void markObject(Vm &vm, Obj *object);
 void markValue(Vm &vm, Value value);
 void collectGarbage(Vm &vm);
+void collectYoung(Vm &vm);
+void compactHeap(Vm &vm);
+void collectAtSafepoint(Vm &vm);
 void freeObjects(Vm &vm);
 
 } // namespace cpplox
@@ -1,9 +1,11 @@
+#include <bit>
 #include <cstdio>
 #include <cstring>
 
 #include <iostream>
 #include <new>
 #include <ostream>
+#include <vector>
 
 #include "memory.h"
 #include "object.h"
@@ -65,14 +67,21 @@ void FieldStorage::write(int slot, Value value) {
 
 template <typename Object>
 static Object *allocateObject(Vm &vm, ObjectKind type) {
-  void *storage = allocate<Object>(vm);
+  bool inSlab = isSlabKind(type);
+  void *storage = inSlab ? vm.heap.allocateSlot(vm, sizeof(Object))
+                         : allocate<Object>(vm);
   Object *object = new (storage) Object();
   Obj *header = static_cast<Obj *>(object);
   header->type = type;
-  header->isMarked = false;
+  header->mark = vm.heap.allocationMark();
+  header->isRemembered = false;
 
-  header->next = vm.heap.objects();
-  vm.heap.objects() = header;
+  if (inSlab) {
+    header->next = nullptr;
+  } else {
+    header->next = vm.heap.objects();
+    vm.heap.objects() = header;
+  }
 
 #ifdef DEBUG_LOG_GC
   std::printf("%p allocate %zu for %d\n", (void *)object, sizeof(Object),
@@ -81,11 +90,33 @@ static Object *allocateObject(Vm &vm, ObjectKind type) {
 
   return object;
 }
+
+template <typename Object>
+static Object *allocateYoungObject(Vm &vm, ObjectKind type) {
+  void *storage = vm.heap.allocateYoung(sizeof(Object));
+  if (storage == nullptr)
+    return allocateObject<Object>(vm, type);
+
+  Object *object = new (storage) Object();
+  Obj *header = static_cast<Obj *>(object);
+  header->type = type;
+  header->mark = 0;
+  header->isRemembered = false;
+  header->next = nullptr;
+
+#ifdef DEBUG_LOG_GC
+  std::printf("%p allocate young %zu for %d\n", (void *)object,
+              sizeof(Object), objectKindIndex(type));
+#endif
+
+  return object;
+}
 ObjBoundMethod *Vm::newBoundMethod(Value receiver, ObjClosure *method) {
   ObjBoundMethod *bound =
-      allocateObject<ObjBoundMethod>(*this, OBJ_BOUND_METHOD);
+      allocateYoungObject<ObjBoundMethod>(*this, OBJ_BOUND_METHOD);
   bound->receiver = receiver;
   bound->method = method;
+  heap.writeBarrier(bound, receiver);
   return bound;
 }
 ObjClass *Vm::newClass(ObjString *name) {
@@ -111,11 +142,16 @@ ObjFunction *Vm::newFunction() {
   ObjFunction *function = allocateObject<ObjFunction>(*this, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->registerCount = 0;
+  function->maxStack = 0;
   function->name = nullptr;
+  function->lazySource = {};
+  function->lazyLine = 0;
+  function->lazyMethod = false;
   return function;
 }
 ObjInstance *Vm::newInstance(ObjClass *klass) {
-  ObjInstance *instance = allocateObject<ObjInstance>(*this, OBJ_INSTANCE);
+  ObjInstance *instance = allocateYoungObject<ObjInstance>(*this, OBJ_INSTANCE);
   instance->klass = klass;
   instance->fields.initialize(*this);
   return instance;
@@ -126,6 +162,37 @@ ObjNative *Vm::newNative(NativeFn function) {
   return native;
 }
 
+ObjRope *Vm::newRope(Obj *left, Obj *right, int length) {
+  ObjRope *rope = allocateObject<ObjRope>(*this, OBJ_ROPE);
+  rope->length = length;
+  rope->left = left;
+  rope->right = right;
+  rope->flat = nullptr;
+  return rope;
+}
+
+// Calls visit on each string of the rope's text in order. Ropes built by a
+// loop are as deep as the loop ran, so this keeps its own stack.
+template <typename F> static void forEachRopePiece(const ObjRope *rope, F visit) {
+  std::vector<const Obj *> pending{rope};
+  while (!pending.empty()) {
+    const Obj *piece = pending.back();
+    pending.pop_back();
+    if (piece->type == OBJ_STRING) {
+      visit(static_cast<const ObjString *>(piece));
+      continue;
+    }
+    const ObjRope *node = static_cast<const ObjRope *>(piece);
+    if (node->flat != nullptr) {
+      visit(node->flat);
+    } else {
+      pending.push_back(node->right);
+      pending.push_back(node->left);
+    }
+  }
+}
+
+// Only called after findString missed, so the string is known to be new.
 static ObjString *allocateString(Vm &vm, char *chars, int length,
                                  uint32_t hash) {
   ObjString *string = allocateObject<ObjString>(vm, OBJ_STRING);
@@ -134,18 +201,33 @@ static ObjString *allocateString(Vm &vm, char *chars, int length,
   string->hash = hash;
 
   vm.push(objectValue(string));
-  vm.strings.set(string, nilValue());
+  vm.strings.insertNew(string, nilValue());
   vm.pop();
 
   return string;
 }
-static uint32_t hashString(const char *key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+uint32_t hashString(const char *chars, int length) {
+  constexpr uint64_t kMultiplier = 0x9e3779b97f4a7c15ull;
+  uint64_t hash = static_cast<uint64_t>(length) * kMultiplier;
+  int i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, chars + i, 8);
+    hash = (std::rotl(hash, 5) ^ word) * kMultiplier;
   }
-  return hash;
+  if (i < length) {
+    uint64_t word = 0;
+    std::memcpy(&word, chars + i, static_cast<size_t>(length - i));
+    hash = (std::rotl(hash, 5) ^ word) * kMultiplier;
+  }
+  // Mix the high bits down, since the table takes its probe bits from the
+  // low 32.
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb33fa2c9b4bbull;
+  hash ^= hash >> 33;
+  return static_cast<uint32_t>(hash);
 }
 ObjString *Vm::takeString(char *chars, int length) {
   uint32_t hash = hashString(chars, length);
@@ -169,6 +251,25 @@ ObjString *Vm::copyString(const char *chars, int length) {
 
   return allocateString(*this, heapChars, length, hash);
 }
+ObjString *Vm::flattenRope(ObjRope *rope) {
+  if (rope->flat != nullptr)
+    return rope->flat;
+
+  char *chars = allocate<char>(*this, rope->length + 1);
+  char *end = chars;
+  forEachRopePiece(rope, [&end](const ObjString *piece) {
+    std::memcpy(end, piece->chars, piece->length);
+    end += piece->length;
+  });
+  *end = '\0';
+
+  ObjString *flat = takeString(chars, rope->length);
+  rope->flat = flat;
+  rope->left = nullptr;
+  rope->right = nullptr;
+  heap.shade(flat);
+  return flat;
+}
 ObjUpvalue *Vm::newUpvalue(Value *slot) {
   ObjUpvalue *upvalue = allocateObject<ObjUpvalue>(*this, OBJ_UPVALUE);
   upvalue->closed = nilValue();
@@ -204,6 +305,11 @@ void printObject(std::ostream &out, Value value) {
   case OBJ_NATIVE:
     out << "<native fn>";
     break;
+  case OBJ_ROPE:
+    forEachRopePiece(asRope(value), [&out](const ObjString *piece) {
+      out.write(piece->chars, piece->length);
+    });
+    break;
   case OBJ_STRING:
     out << asCString(value);
     break;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <iosfwd>
+#include <string_view>
 
 #include "chunk.h"
 #include "common.h"
@@ -18,6 +19,7 @@ enum class ObjectKind : uint8_t {
   Function,
   Instance,
   Native,
+  Rope,
   String,
   Upvalue
 };
@@ -28,6 +30,7 @@ inline constexpr ObjectKind OBJ_CLOSURE = ObjectKind::Closure;
 inline constexpr ObjectKind OBJ_FUNCTION = ObjectKind::Function;
 inline constexpr ObjectKind OBJ_INSTANCE = ObjectKind::Instance;
 inline constexpr ObjectKind OBJ_NATIVE = ObjectKind::Native;
+inline constexpr ObjectKind OBJ_ROPE = ObjectKind::Rope;
 inline constexpr ObjectKind OBJ_STRING = ObjectKind::String;
 inline constexpr ObjectKind OBJ_UPVALUE = ObjectKind::Upvalue;
 
@@ -37,18 +40,33 @@ inline constexpr int objectKindIndex(ObjectKind kind) {
 
 struct Obj {
   ObjectKind type;
-  bool isMarked;
+  // Old objects are marked when this equals Heap::markEpoch(). Young objects
+  // use it only as the minor collection's survivor flag.
+  uint8_t mark;
+  bool isRemembered;
+  // Old objects: the next object in the heap list. Young objects: the
+  // promoted copy once a minor collection has moved them, else nullptr.
   Obj *next;
 };
 
 struct ObjFunction : Obj {
   int arity;
   int upvalueCount;
+  // Frame size of register-tier code; zero for stack bytecode.
+  int registerCount;
+  // Most values stack bytecode pushes above its arguments (maxStackDepth()).
+  int maxStack;
   Chunk chunk;
   ObjString *name;
+  // Under --lazy-functions, a body the compiler skipped: its source from the
+  // parameter list to the closing brace, compiled on the first call. Empty
+  // once the function has code.
+  std::string_view lazySource;
+  int lazyLine;
+  bool lazyMethod;
 };
 
-using NativeFn = Value (*)(int argCount, Value *args);
+using NativeFn = Value (*)(Vm &vm, int argCount, Value *args);
 
 struct ObjNative : Obj {
   NativeFn function;
@@ -59,6 +77,24 @@ struct ObjString : Obj {
   char *chars;
   uint32_t hash;
 };
+// The result of a concatenation too long to copy eagerly. It keeps its two
+// halves, each a string or another rope, until equality needs an interned
+// string; flattening then stores that as flat and drops the halves.
+struct ObjRope : Obj {
+  int length;
+  Obj *left;
+  Obj *right;
+  ObjString *flat;
+};
+
+// Concatenations shorter than this are copied and interned right away,
+// unless --lazy-intern makes every concatenation a rope.
+inline constexpr int kMinRopeLength = 64;
+
+// Hashes eight bytes at a time. Only ever compared within one process, so the
+// result may differ between builds.
+uint32_t hashString(const char *chars, int length);
+
 struct ObjUpvalue : Obj {
   Value *location;
   Value closed;
@@ -110,6 +146,9 @@ public:
   int capacity() const { return capacity_; }
   Value *data() { return values_; }
   const Value *data() const { return values_; }
+  // Compaction copies the array into its payload block and hands back the
+  // copy.
+  void rebase(Value *values) { values_ = values; }
 
 private:
   void ensureCapacity(int slot);
@@ -145,7 +184,12 @@ inline bool isClosure(Value value) { return isObjType(value, OBJ_CLOSURE); }
 inline bool isFunction(Value value) { return isObjType(value, OBJ_FUNCTION); }
 inline bool isInstance(Value value) { return isObjType(value, OBJ_INSTANCE); }
 inline bool isNative(Value value) { return isObjType(value, OBJ_NATIVE); }
+inline bool isRope(Value value) { return isObjType(value, OBJ_ROPE); }
 inline bool isString(Value value) { return isObjType(value, OBJ_STRING); }
+inline bool isStringOrRope(Value value) {
+  return isObj(value) &&
+         (asObj(value)->type == OBJ_STRING || asObj(value)->type == OBJ_ROPE);
+}
 
 inline ObjBoundMethod *asBoundMethod(Value value) {
   return static_cast<ObjBoundMethod *>(asObj(value));
@@ -165,6 +209,9 @@ inline ObjInstance *asInstance(Value value) {
 inline NativeFn asNative(Value value) {
   return static_cast<ObjNative *>(asObj(value))->function;
 }
+inline ObjRope *asRope(Value value) {
+  return static_cast<ObjRope *>(asObj(value));
+}
 inline ObjString *asString(Value value) {
   return static_cast<ObjString *>(asObj(value));
 }
@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <utility>
+#include <vector>
+
+#include "memory.h"
+#include "object.h"
+#include "profiler.h"
+#include "vm.h"
+
+namespace cpplox {
+
+static constexpr size_t kTopProfileEntries = 20;
+
+Profiler::Profiler(uint64_t intervalMicroseconds)
+    : interval_(intervalMicroseconds) {}
+
+Profiler::~Profiler() { stop(); }
+
+void Profiler::start(Heap &heap) {
+  stopping_ = false;
+  timer_ = std::thread([this, &heap] {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopped_.wait_for(lock, std::chrono::microseconds(interval_),
+                              [this] { return stopping_; })) {
+      sampleDue.store(true, std::memory_order_relaxed);
+      heap.requestSafepoint();
+    }
+  });
+}
+
+void Profiler::stop() {
+  if (!timer_.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  stopped_.notify_one();
+  timer_.join();
+  sampleDue.store(false, std::memory_order_relaxed);
+}
+
+static std::string frameName(const CallFrame &frame, const uint8_t *ip) {
+  const ObjFunction *function = frame.closure->function;
+  size_t instruction = static_cast<size_t>(ip - function->chunk.codeData() - 1);
+  std::string name =
+      function->name != nullptr ? function->name->chars : "script";
+  return name + ":" + std::to_string(function->chunk.lineAt(instruction));
+}
+
+void Profiler::sample(Vm &vm, const uint8_t *ip) {
+  if (vm.frameCount == 0)
+    return;
+
+  std::string stack;
+  std::string leaf;
+  for (int i = 0; i < vm.frameCount; i++) {
+    const CallFrame &frame = vm.frames[i];
+    leaf = frameName(frame, i == vm.frameCount - 1 ? ip : frame.ip);
+    if (i > 0)
+      stack += ';';
+    stack += leaf;
+  }
+  samples_++;
+  stacks_[stack]++;
+  lineSelf_[leaf]++;
+  functionSelf_[leaf.substr(0, leaf.rfind(':'))]++;
+}
+
+bool Profiler::writeFoldedStacks(const std::string &path) const {
+  std::ofstream file(path, std::ios::trunc);
+  if (!file)
+    return false;
+  for (const auto &[stack, count] : stacks_) {
+    file << stack << ' ' << count << '\n';
+  }
+  return static_cast<bool>(file);
+}
+
+static void printTop(const char *title,
+                     const std::unordered_map<std::string, uint64_t> &counts,
+                     uint64_t samples) {
+  std::vector<std::pair<std::string, uint64_t>> entries(counts.begin(),
+                                                        counts.end());
+  size_t count = std::min(entries.size(), kTopProfileEntries);
+  std::partial_sort(entries.begin(), entries.begin() + count, entries.end(),
+                    [](const auto &a, const auto &b) {
+                      if (a.second != b.second)
+                        return a.second > b.second;
+                      return a.first < b.first;
+                    });
+  std::fprintf(stderr, "  %s:\n", title);
+  for (size_t i = 0; i < count; i++) {
+    std::fprintf(stderr, "    %-30s %8" PRIu64 " %5.1f%%\n",
+                 entries[i].first.c_str(), entries[i].second,
+                 100.0 * static_cast<double>(entries[i].second) /
+                     static_cast<double>(samples));
+  }
+}
+
+void Profiler::printReport() const {
+  std::fprintf(stderr, "cpplox profile:\n");
+  std::fprintf(stderr, "  interval_us: %" PRIu64 "\n", interval_);
+  std::fprintf(stderr, "  samples: %" PRIu64 "\n", samples_);
+  if (samples_ == 0)
+    return;
+  printTop("self_by_function", functionSelf_, samples_);
+  printTop("self_by_line", lineSelf_, samples_);
+}
+
+} // namespace cpplox
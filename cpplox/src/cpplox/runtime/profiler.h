@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace cpplox {
+
+class Heap;
+class Vm;
+
+inline constexpr uint64_t kDefaultProfileInterval = 1000;
+
+// A sampling profiler for Lox code. A timer thread raises sampleDue every
+// interval and requests a safepoint, and the interpreter records the call
+// stack at its next loop back-edge or call. The request rides on the heap's
+// existing safepoint check, so profiling adds nothing to the dispatch loop.
+class Profiler {
+public:
+  // Set by the timer thread; checked at every safepoint.
+  inline static std::atomic<bool> sampleDue{false};
+
+  explicit Profiler(uint64_t intervalMicroseconds);
+  ~Profiler();
+  Profiler(const Profiler &) = delete;
+  Profiler &operator=(const Profiler &) = delete;
+
+  void start(Heap &heap);
+  void stop();
+  // ip is the running frame's instruction pointer, which run() keeps in a
+  // local.
+  void sample(Vm &vm, const uint8_t *ip);
+
+  // One line per distinct stack, "script:3;fib:5;fib:5 42", the input format
+  // of flamegraph.pl and speedscope.
+  bool writeFoldedStacks(const std::string &path) const;
+  // Self samples per function and per source line, most frequent first.
+  void printReport() const;
+
+private:
+  uint64_t interval_;
+  uint64_t samples_ = 0;
+  std::unordered_map<std::string, uint64_t> stacks_;
+  std::unordered_map<std::string, uint64_t> functionSelf_;
+  std::unordered_map<std::string, uint64_t> lineSelf_;
+  std::thread timer_;
+  std::mutex mutex_;
+  std::condition_variable stopped_;
+  bool stopping_ = false;
+};
+
+} // namespace cpplox
@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+#include "slab.h"
+
+namespace cpplox {
+
+SlabPage *SlabPage::create(size_t slotSize) {
+#ifdef _MSC_VER
+  void *memory = _aligned_malloc(kSlabPageSize, kSlabPageSize);
+#else
+  void *memory = std::aligned_alloc(kSlabPageSize, kSlabPageSize);
+#endif
+  if (memory == nullptr)
+    std::exit(1);
+
+  SlabPage *page = static_cast<SlabPage *>(memory);
+  page->slotSize = static_cast<uint32_t>(slotSize);
+  page->slotCount = static_cast<uint32_t>(
+      std::min<size_t>((kSlabPageSize - kSlabHeaderSize) / slotSize, kMaxSlots));
+  page->liveCount = 0;
+  page->cursor = 0;
+  page->swept = true;
+  std::memset(page->allocated, 0, sizeof(page->allocated));
+  std::memset(page->marked, 0, sizeof(page->marked));
+  return page;
+}
+
+void SlabPage::destroy(SlabPage *page) {
+#ifdef _MSC_VER
+  _aligned_free(page);
+#else
+  std::free(page);
+#endif
+}
+
+void SlabPage::clearMarks() { std::memset(marked, 0, sizeof(marked)); }
+
+Obj *SlabPage::firstObject() {
+  for (int word = 0; word < kWords; word++) {
+    if (allocated[word] != 0)
+      return objectAt(word * 64 + std::countr_zero(allocated[word]));
+  }
+  return nullptr;
+}
+
+void *SlabPage::takeFreeSlot() {
+  for (int word = static_cast<int>(cursor); word < kWords; word++) {
+    uint64_t free = ~allocated[word] & slotMask(word);
+    if (free == 0)
+      continue;
+
+    int bit = std::countr_zero(free);
+    allocated[word] |= uint64_t{1} << bit;
+    cursor = static_cast<uint32_t>(word);
+    liveCount++;
+    return objectAt(word * 64 + bit);
+  }
+  cursor = kWords;
+  return nullptr;
+}
+
+void SlabPage::releaseSlot(const Obj *object) {
+  int index = indexOf(object);
+  uint64_t bit = uint64_t{1} << (index % 64);
+  allocated[index / 64] &= ~bit;
+  marked[index / 64] &= ~bit;
+  liveCount--;
+  if (static_cast<uint32_t>(index / 64) < cursor) {
+    cursor = static_cast<uint32_t>(index / 64);
+  }
+}
+
+} // namespace cpplox
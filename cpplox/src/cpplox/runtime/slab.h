@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+
+#include "common.h"
+#include "object.h"
+
+namespace cpplox {
+
+inline constexpr size_t kSlabPageSize = 64 * 1024;
+inline constexpr size_t kSlabGranule = 16;
+inline constexpr int kSlabClassCount = 4;
+
+// Strings, ropes, instances, closures, upvalues and bound methods live in slab
+// pages once they are old; the rarer kinds stay malloc-backed on
+// Heap::objects().
+constexpr bool isSlabKind(ObjectKind kind) {
+  return kind == OBJ_STRING || kind == OBJ_ROPE || kind == OBJ_INSTANCE ||
+         kind == OBJ_CLOSURE || kind == OBJ_UPVALUE ||
+         kind == OBJ_BOUND_METHOD;
+}
+
+constexpr int slabClassIndex(size_t size) {
+  return static_cast<int>((size + kSlabGranule - 1) / kSlabGranule) - 1;
+}
+
+static_assert(slabClassIndex(sizeof(ObjString)) < kSlabClassCount);
+static_assert(slabClassIndex(sizeof(ObjRope)) < kSlabClassCount);
+static_assert(slabClassIndex(sizeof(ObjInstance)) < kSlabClassCount);
+static_assert(slabClassIndex(sizeof(ObjClosure)) < kSlabClassCount);
+static_assert(slabClassIndex(sizeof(ObjUpvalue)) < kSlabClassCount);
+static_assert(slabClassIndex(sizeof(ObjBoundMethod)) < kSlabClassCount);
+
+// A page-aligned run of equally sized slots. The header keeps side bitmaps of
+// allocated and marked slots, so sweeping reads the header a word at a time
+// instead of touching every object.
+struct SlabPage {
+  static constexpr int kMaxSlots = static_cast<int>(kSlabPageSize / 32);
+  static constexpr int kWords = kMaxSlots / 64;
+
+  uint32_t slotSize;
+  uint32_t slotCount;
+  uint32_t liveCount;
+  // First bitmap word that may still have a free slot.
+  uint32_t cursor;
+  bool swept;
+  uint64_t allocated[kWords];
+  uint64_t marked[kWords];
+
+  static SlabPage *create(size_t slotSize);
+  static void destroy(SlabPage *page);
+  static SlabPage *of(const Obj *object) {
+    return reinterpret_cast<SlabPage *>(reinterpret_cast<uintptr_t>(object) &
+                                        ~(uintptr_t{kSlabPageSize} - 1));
+  }
+
+  Obj *objectAt(int index);
+  int indexOf(const Obj *object) const;
+  // Bits of bitmap word `word` that correspond to real slots.
+  uint64_t slotMask(int word) const;
+
+  bool isMarked(const Obj *object) const {
+    int index = indexOf(object);
+    return (marked[index / 64] >> (index % 64)) & 1;
+  }
+  void setMarked(const Obj *object) {
+    int index = indexOf(object);
+    marked[index / 64] |= uint64_t{1} << (index % 64);
+  }
+  // Test-and-set for parallel marking; returns whether this call set the bit.
+  bool tryMarkAtomic(const Obj *object) {
+    int index = indexOf(object);
+    uint64_t bit = uint64_t{1} << (index % 64);
+    std::atomic_ref<uint64_t> word(marked[index / 64]);
+    if (word.load(std::memory_order_relaxed) & bit)
+      return false;
+    return (word.fetch_or(bit, std::memory_order_relaxed) & bit) == 0;
+  }
+  void clearMarks();
+  Obj *firstObject();
+  void *takeFreeSlot();
+  void releaseSlot(const Obj *object);
+};
+
+inline constexpr size_t kSlabHeaderSize = (sizeof(SlabPage) + 63) & ~size_t{63};
+
+inline Obj *SlabPage::objectAt(int index) {
+  return reinterpret_cast<Obj *>(reinterpret_cast<uint8_t *>(this) +
+                                 kSlabHeaderSize +
+                                 static_cast<size_t>(index) * slotSize);
+}
+
+inline int SlabPage::indexOf(const Obj *object) const {
+  size_t offset = reinterpret_cast<const uint8_t *>(object) -
+                  reinterpret_cast<const uint8_t *>(this) - kSlabHeaderSize;
+  return static_cast<int>(offset / slotSize);
+}
+
+inline uint64_t SlabPage::slotMask(int word) const {
+  int remaining = static_cast<int>(slotCount) - word * 64;
+  if (remaining >= 64)
+    return ~uint64_t{0};
+  return remaining <= 0 ? 0 : (uint64_t{1} << remaining) - 1;
+}
+
+} // namespace cpplox
@@ -0,0 +1,583 @@
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "binary_io.h"
+#include "bytecode_file.h"
+#include "chunk.h"
+#include "instruction.h"
+#include "memory.h"
+#include "object.h"
+#include "snapshot.h"
+#include "vm.h"
+
+namespace cpplox {
+
+namespace {
+
+constexpr uint32_t kMagic = 0x53584f4c; // "LOXS" read as a little-endian word.
+constexpr uint32_t kFormatVersion = 4;
+constexpr uint32_t kNoObject = UINT32_MAX;
+
+struct Header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t opcodeCount;
+  uint32_t objectCount;
+  uint32_t globalCount;
+  uint32_t reserved;
+  // Of everything after the header.
+  uint64_t checksum;
+};
+
+enum class ValueTag : uint8_t {
+  Nil,
+  False,
+  True,
+  Number,
+  Object,
+  Uninitialized
+};
+
+// Records are written grouped in this order, so a function's upvalue count is
+// known before its closures are created and a class exists before its
+// instances.
+constexpr ObjectKind kRecordOrder[] = {
+    OBJ_STRING,  OBJ_NATIVE, OBJ_FUNCTION, OBJ_UPVALUE,
+    OBJ_CLOSURE, OBJ_CLASS,  OBJ_INSTANCE, OBJ_BOUND_METHOD,
+};
+
+int recordRank(ObjectKind kind) {
+  for (int i = 0; i < static_cast<int>(std::size(kRecordOrder)); i++) {
+    if (kRecordOrder[i] == kind)
+      return i;
+  }
+  return static_cast<int>(std::size(kRecordOrder));
+}
+
+template <typename F> void forEachTableEntry(Table &table, F visit) {
+  table.forEachEntry([&](Entry &entry) {
+    if (entry.key != nullptr)
+      visit(entry.key, entry.value);
+  });
+}
+
+class SnapshotWriter {
+public:
+  explicit SnapshotWriter(Vm &vm) : vm_(vm) {}
+
+  bool write(const std::string &path) {
+    forEachTableEntry(vm_.globals, [&](ObjString *key, Value value) {
+      discover(key);
+      discoverValue(value);
+      globalCount_++;
+    });
+    while (!pending_.empty()) {
+      Obj *object = pending_.back();
+      pending_.pop_back();
+      if (!discoverReferences(object))
+        return false;
+    }
+
+    std::stable_sort(objects_.begin(), objects_.end(), [](Obj *a, Obj *b) {
+      return recordRank(a->type) < recordRank(b->type);
+    });
+    for (uint32_t i = 0; i < objects_.size(); i++) {
+      indices_[objects_[i]] = i;
+    }
+
+    writer_.put(Header{kMagic, kFormatVersion, static_cast<uint32_t>(OP_COUNT),
+                       static_cast<uint32_t>(objects_.size()), globalCount_,
+                       0, 0});
+    for (Obj *object : objects_) {
+      writeRecord(object);
+    }
+    forEachTableEntry(vm_.globals, [&](ObjString *key, Value value) {
+      putObject(key);
+      putValue(value);
+    });
+    const std::string &buffer = writer_.buffer();
+    writer_.patch(offsetof(Header, checksum),
+                  checksum(buffer.data() + sizeof(Header),
+                           buffer.size() - sizeof(Header)));
+    return writeFileAtomically(path, writer_.buffer());
+  }
+
+private:
+  // A rope is written as its flattened string.
+  void discover(Obj *object) {
+    if (object != nullptr && object->type == OBJ_ROPE)
+      object = vm_.flattenRope(static_cast<ObjRope *>(object));
+    if (object == nullptr || indices_.contains(object))
+      return;
+    indices_[object] = static_cast<uint32_t>(objects_.size());
+    objects_.push_back(object);
+    pending_.push_back(object);
+  }
+  void discoverValue(Value value) {
+    if (isObj(value))
+      discover(asObj(value));
+  }
+  void discoverTable(Table &table) {
+    forEachTableEntry(table, [&](ObjString *key, Value value) {
+      discover(key);
+      discoverValue(value);
+    });
+  }
+
+  bool discoverReferences(Obj *object) {
+    switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod *bound = static_cast<ObjBoundMethod *>(object);
+      discoverValue(bound->receiver);
+      discover(bound->method);
+      return true;
+    }
+    case OBJ_CLASS: {
+      ObjClass *klass = static_cast<ObjClass *>(object);
+      discover(klass->name);
+      discover(klass->initializer);
+      discoverTable(klass->methods);
+      discoverTable(klass->fieldSlots);
+      return true;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure *closure = static_cast<ObjClosure *>(object);
+      discover(closure->function);
+      for (int i = 0; i < closure->upvalues.size(); i++) {
+        discover(closure->upvalues[i]);
+      }
+      return true;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction *function = static_cast<ObjFunction *>(object);
+      discover(function->name);
+      for (Value constant : function->chunk.constants()) {
+        discoverValue(constant);
+      }
+      // A body never compiled exists only in this process's source.
+      return function->lazySource.empty();
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance *instance = static_cast<ObjInstance *>(object);
+      discover(instance->klass);
+      for (int i = 0; i < instance->fields.capacity(); i++) {
+        discoverValue(instance->fields.data()[i]);
+      }
+      return true;
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue *upvalue = static_cast<ObjUpvalue *>(object);
+      discoverValue(upvalue->closed);
+      return upvalue->location == &upvalue->closed;
+    }
+    case OBJ_NATIVE:
+      return nativeName(static_cast<ObjNative *>(object)->function) != nullptr;
+    case OBJ_ROPE:
+      return false;
+    case OBJ_STRING:
+      return true;
+    }
+    return false;
+  }
+
+  void putObject(const Obj *object) {
+    if (object != nullptr && object->type == OBJ_ROPE)
+      object = static_cast<const ObjRope *>(object)->flat;
+    writer_.put<uint32_t>(object == nullptr ? kNoObject : indices_.at(object));
+  }
+  void putValue(Value value) {
+    if (isNil(value)) {
+      writer_.put(ValueTag::Nil);
+    } else if (isBool(value)) {
+      writer_.put(asBool(value) ? ValueTag::True : ValueTag::False);
+    } else if (isNumber(value)) {
+      writer_.put(ValueTag::Number);
+      writer_.put<double>(asNumber(value));
+    } else if (isUninitialized(value)) {
+      writer_.put(ValueTag::Uninitialized);
+    } else {
+      writer_.put(ValueTag::Object);
+      putObject(asObj(value));
+    }
+  }
+  void putChars(const char *chars, size_t length) {
+    writer_.put<uint32_t>(static_cast<uint32_t>(length));
+    writer_.putBytes(chars, length);
+  }
+  void putTable(Table &table) {
+    writer_.put<uint32_t>(static_cast<uint32_t>(table.count()));
+    forEachTableEntry(table, [&](ObjString *key, Value value) {
+      putObject(key);
+      putValue(value);
+    });
+  }
+
+  // Each record is its kind and payload size, so a reader can skip it.
+  void writeRecord(Obj *object) {
+    writer_.put(object->type);
+    size_t sizeOffset = writer_.size();
+    writer_.put<uint32_t>(0);
+    size_t start = writer_.size();
+
+    switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod *bound = static_cast<ObjBoundMethod *>(object);
+      putValue(bound->receiver);
+      putObject(bound->method);
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass *klass = static_cast<ObjClass *>(object);
+      putObject(klass->name);
+      putObject(klass->initializer);
+      writer_.put<int32_t>(klass->fieldSlotCount);
+      writer_.put<uint32_t>(klass->fieldVersion);
+      putTable(klass->methods);
+      putTable(klass->fieldSlots);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure *closure = static_cast<ObjClosure *>(object);
+      putObject(closure->function);
+      for (int i = 0; i < closure->upvalues.size(); i++) {
+        putObject(closure->upvalues[i]);
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction *function = static_cast<ObjFunction *>(object);
+      writer_.put<int32_t>(function->arity);
+      writer_.put<int32_t>(function->upvalueCount);
+      putObject(function->name);
+      writeCode(writer_, function->chunk);
+      writer_.put<uint32_t>(
+          static_cast<uint32_t>(function->chunk.constants().size()));
+      for (Value constant : function->chunk.constants()) {
+        putValue(constant);
+      }
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance *instance = static_cast<ObjInstance *>(object);
+      putObject(instance->klass);
+      writer_.put<int32_t>(instance->fields.capacity());
+      for (int i = 0; i < instance->fields.capacity(); i++) {
+        putValue(instance->fields.data()[i]);
+      }
+      break;
+    }
+    case OBJ_NATIVE: {
+      const char *name = nativeName(static_cast<ObjNative *>(object)->function);
+      putChars(name, std::string_view(name).size());
+      break;
+    }
+    case OBJ_STRING: {
+      ObjString *string = static_cast<ObjString *>(object);
+      putChars(string->chars, static_cast<size_t>(string->length));
+      break;
+    }
+    case OBJ_UPVALUE:
+      putValue(static_cast<ObjUpvalue *>(object)->closed);
+      break;
+    case OBJ_ROPE:
+      break;
+    }
+
+    writer_.patch<uint32_t>(sizeOffset,
+                            static_cast<uint32_t>(writer_.size() - start));
+  }
+
+  Vm &vm_;
+  BinaryWriter writer_;
+  std::vector<Obj *> objects_;
+  std::vector<Obj *> pending_;
+  std::unordered_map<const Obj *, uint32_t> indices_;
+  uint32_t globalCount_ = 0;
+};
+
+// Creates every object in a first pass over the records, then reads them
+// again to fill in references. The new objects are held as compiler roots
+// until the globals refer to them.
+class SnapshotReader {
+public:
+  SnapshotReader(Vm &vm, const uint8_t *data, size_t size)
+      : vm_(vm), data_(data), size_(size), reader_(data, size),
+        rootBase_(vm.compilerRoots.size()) {}
+  ~SnapshotReader() { vm_.compilerRoots.resize(rootBase_); }
+  SnapshotReader(const SnapshotReader &) = delete;
+  SnapshotReader &operator=(const SnapshotReader &) = delete;
+
+  bool read() {
+    Header header = reader_.get<Header>();
+    if (!reader_.ok() || header.magic != kMagic ||
+        header.version != kFormatVersion ||
+        header.opcodeCount != static_cast<uint32_t>(OP_COUNT) ||
+        header.checksum != checksum(data_ + sizeof(Header),
+                                    size_ - sizeof(Header)))
+      return false;
+
+    for (uint32_t i = 0; i < header.objectCount; i++) {
+      if (!createObject())
+        return false;
+    }
+    size_t globalsOffset = reader_.offset();
+    for (size_t i = 0; i < objects_.size(); i++) {
+      reader_.seek(offsets_[i]);
+      if (!fillObject(objects_[i]))
+        return false;
+    }
+
+    reader_.seek(globalsOffset);
+    for (uint32_t i = 0; i < header.globalCount; i++) {
+      ObjString *name = getObject<ObjString>(OBJ_STRING);
+      Value value = getValue();
+      if (name == nullptr || !reader_.ok())
+        return false;
+      vm_.globals.set(name, value);
+      vm_.heap.globalWriteBarrier(value);
+    }
+    return reader_.ok() && reader_.atEnd();
+  }
+
+private:
+  template <typename T> T *getObject(ObjectKind kind, bool optional = false) {
+    uint32_t index = reader_.get<uint32_t>();
+    if (optional && index == kNoObject)
+      return nullptr;
+    if (index >= objects_.size() || objects_[index]->type != kind) {
+      ok_ = false;
+      return nullptr;
+    }
+    return static_cast<T *>(objects_[index]);
+  }
+  Value getValue() {
+    switch (reader_.get<ValueTag>()) {
+    case ValueTag::Nil:
+      return nilValue();
+    case ValueTag::False:
+      return falseValue();
+    case ValueTag::True:
+      return trueValue();
+    case ValueTag::Number:
+      return numberValue(reader_.get<double>());
+    case ValueTag::Uninitialized:
+      return uninitializedValue();
+    case ValueTag::Object: {
+      uint32_t index = reader_.get<uint32_t>();
+      if (index < objects_.size())
+        return objectValue(objects_[index]);
+      break;
+    }
+    }
+    ok_ = false;
+    return nilValue();
+  }
+  std::string_view getChars() {
+    uint32_t length = reader_.get<uint32_t>();
+    const uint8_t *chars = reader_.take(length);
+    if (chars == nullptr || length > INT32_MAX) {
+      ok_ = false;
+      return {};
+    }
+    return {reinterpret_cast<const char *>(chars), length};
+  }
+  bool ok() const { return ok_ && reader_.ok(); }
+
+  void store(Obj *owner, Value *slot, Value value) {
+    *slot = value;
+    vm_.heap.writeBarrier(owner, value);
+  }
+  template <typename T> void store(Obj *owner, T **slot, T *object) {
+    *slot = object;
+    if (object != nullptr)
+      vm_.heap.writeBarrier(owner, objectValue(object));
+  }
+  bool readTable(Obj *owner, Table &table) {
+    uint32_t count = reader_.get<uint32_t>();
+    for (uint32_t i = 0; i < count && ok(); i++) {
+      ObjString *key = getObject<ObjString>(OBJ_STRING);
+      Value value = getValue();
+      if (!ok())
+        return false;
+      table.set(key, value);
+      vm_.heap.writeBarrier(owner, objectValue(key));
+      vm_.heap.writeBarrier(owner, value);
+    }
+    return ok();
+  }
+
+  bool createObject() {
+    ObjectKind kind = reader_.get<ObjectKind>();
+    uint32_t size = reader_.get<uint32_t>();
+    size_t start = reader_.offset();
+    if (!reader_.ok())
+      return false;
+
+    Obj *object = nullptr;
+    switch (kind) {
+    case OBJ_BOUND_METHOD:
+      object = vm_.newBoundMethod(nilValue(), nullptr);
+      break;
+    case OBJ_CLASS:
+      object = vm_.newClass(nullptr);
+      break;
+    case OBJ_CLOSURE: {
+      ObjFunction *function = getObject<ObjFunction>(OBJ_FUNCTION);
+      if (function == nullptr)
+        return false;
+      object = vm_.newClosure(function);
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction *function = vm_.newFunction();
+      function->arity = reader_.get<int32_t>();
+      function->upvalueCount = reader_.get<int32_t>();
+      if (function->arity < 0 || function->arity >= kUint8Count ||
+          function->upvalueCount < 0 || function->upvalueCount > kUint8Count)
+        return false;
+      object = function;
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjClass *klass = getObject<ObjClass>(OBJ_CLASS);
+      if (klass == nullptr)
+        return false;
+      object = vm_.newInstance(klass);
+      break;
+    }
+    case OBJ_NATIVE: {
+      NativeFn function = findNative(getChars());
+      if (function == nullptr)
+        return false;
+      object = vm_.newNative(function);
+      break;
+    }
+    case OBJ_STRING: {
+      std::string_view chars = getChars();
+      if (!ok())
+        return false;
+      object = vm_.copyString(chars.data(), static_cast<int>(chars.size()));
+      break;
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue *upvalue = vm_.newUpvalue(nullptr);
+      upvalue->location = &upvalue->closed;
+      object = upvalue;
+      break;
+    }
+    default:
+      return false;
+    }
+
+    vm_.addCompilerRoot(object);
+    objects_.push_back(object);
+    offsets_.push_back(start);
+    reader_.seek(start + size);
+    return ok();
+  }
+
+  bool fillObject(Obj *object) {
+    switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod *bound = static_cast<ObjBoundMethod *>(object);
+      store(bound, &bound->receiver, getValue());
+      store(bound, &bound->method, getObject<ObjClosure>(OBJ_CLOSURE));
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass *klass = static_cast<ObjClass *>(object);
+      store(klass, &klass->name, getObject<ObjString>(OBJ_STRING));
+      store(klass, &klass->initializer,
+            getObject<ObjClosure>(OBJ_CLOSURE, true));
+      klass->fieldSlotCount = reader_.get<int32_t>();
+      klass->fieldVersion = reader_.get<uint32_t>();
+      if (!readTable(klass, klass->methods) ||
+          !readTable(klass, klass->fieldSlots))
+        return false;
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure *closure = static_cast<ObjClosure *>(object);
+      reader_.get<uint32_t>();
+      for (int i = 0; i < closure->upvalues.size(); i++) {
+        store(closure, &closure->upvalues[i],
+              getObject<ObjUpvalue>(OBJ_UPVALUE));
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction *function = static_cast<ObjFunction *>(object);
+      reader_.take(2 * sizeof(int32_t));
+      store(function, &function->name,
+            getObject<ObjString>(OBJ_STRING, true));
+      Chunk &chunk = function->chunk;
+      if (!readCode(reader_, chunk))
+        return false;
+      uint32_t constantCount = reader_.get<uint32_t>();
+      if (constantCount > kUint8Count)
+        return false;
+      for (uint32_t i = 0; i < constantCount; i++) {
+        Value constant = getValue();
+        if (!ok() || chunk.addConstant(constant) != static_cast<int>(i))
+          return false;
+        vm_.heap.writeBarrier(function, constant);
+      }
+      function->maxStack = maxStackDepth(chunk);
+      if (function->maxStack < 0)
+        return false;
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance *instance = static_cast<ObjInstance *>(object);
+      reader_.get<uint32_t>();
+      int32_t capacity = reader_.get<int32_t>();
+      for (int32_t slot = 0; slot < capacity && ok(); slot++) {
+        Value value = getValue();
+        if (!isUninitialized(value)) {
+          instance->fields.write(slot, value);
+          vm_.heap.writeBarrier(instance, value);
+        }
+      }
+      break;
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue *upvalue = static_cast<ObjUpvalue *>(object);
+      store(upvalue, &upvalue->closed, getValue());
+      break;
+    }
+    case OBJ_NATIVE:
+    case OBJ_ROPE:
+    case OBJ_STRING:
+      break;
+    }
+    return ok();
+  }
+
+  Vm &vm_;
+  const uint8_t *data_;
+  size_t size_;
+  BinaryReader reader_;
+  size_t rootBase_;
+  std::vector<Obj *> objects_;
+  std::vector<size_t> offsets_;
+  bool ok_ = true;
+};
+
+} // namespace
+
+bool writeSnapshot(Vm &vm, const std::string &path) {
+  return SnapshotWriter(vm).write(path);
+}
+
+bool readSnapshot(Vm &vm, const std::string &path) {
+  MappedFile file(path);
+  if (file.data() == nullptr)
+    return false;
+  return SnapshotReader(vm, file.data(), file.size()).read();
+}
+
+} // namespace cpplox
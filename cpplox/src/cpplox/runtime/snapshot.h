@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+
+namespace cpplox {
+
+class Vm;
+
+// A heap snapshot holds the globals and every object reachable from them:
+// strings, functions and their bytecode, closures, upvalues, classes,
+// instances and bound methods. Objects refer to each other by record index,
+// and reading maps the file read-only, creates every object, then relocates
+// the indices into pointers. Upvalues must be closed, so snapshots are taken
+// between scripts rather than inside a call. Functions are stored as stack
+// bytecode; main() refuses snapshots together with --registers.
+bool writeSnapshot(Vm &vm, const std::string &path);
+// Adds the snapshot's globals to the VM's. Returns false when the file is
+// missing, malformed or from a different build of cpplox.
+bool readSnapshot(Vm &vm, const std::string &path);
+
+} // namespace cpplox
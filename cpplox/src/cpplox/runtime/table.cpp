@@ -1,5 +1,13 @@
+#include <algorithm>
+#include <bit>
 #include <cstring>
 
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CPPLOX_TABLE_SSE2 1
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -7,125 +15,227 @@
 
 namespace cpplox {
 
-inline constexpr double TABLE_MAX_LOAD = 0.75;
+namespace {
+
+inline constexpr int kGroupWidth = 16;
+inline constexpr int8_t kEmpty = -128;
+inline constexpr int8_t kDeleted = -2;
+
+// Live entries plus tombstones may fill 7/8 of the slots. A resize whose live
+// entries fit in 25/32 rehashes at the same capacity to drop tombstones.
+int maxLoad(int capacity) { return capacity - capacity / 8; }
+
+// The low seven bits of the hash go in the control byte; the rest choose the
+// first group to probe.
+int8_t controlHash(uint32_t hash) { return static_cast<int8_t>(hash & 0x7f); }
+size_t groupHash(uint32_t hash) { return hash >> 7; }
+
+// Bit i of each mask is set when control byte i of the group matches.
+class Group {
+public:
+#ifdef CPPLOX_TABLE_SSE2
+  explicit Group(const int8_t *control)
+      : control_(_mm_loadu_si128(reinterpret_cast<const __m128i *>(control))) {
+  }
+  uint32_t match(int8_t hash) const {
+    return static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(hash), control_)));
+  }
+  // Empty and deleted bytes are the negative ones.
+  uint32_t matchEmptyOrDeleted() const {
+    return static_cast<uint32_t>(_mm_movemask_epi8(control_));
+  }
+#else
+  explicit Group(const int8_t *control) {
+    std::memcpy(control_, control, kGroupWidth);
+  }
+  uint32_t match(int8_t hash) const {
+    uint32_t mask = 0;
+    for (int i = 0; i < kGroupWidth; i++) {
+      if (control_[i] == hash)
+        mask |= 1u << i;
+    }
+    return mask;
+  }
+  uint32_t matchEmptyOrDeleted() const {
+    uint32_t mask = 0;
+    for (int i = 0; i < kGroupWidth; i++) {
+      if (control_[i] < 0)
+        mask |= 1u << i;
+    }
+    return mask;
+  }
+#endif
+  uint32_t matchEmpty() const { return match(kEmpty); }
+
+private:
+#ifdef CPPLOX_TABLE_SSE2
+  __m128i control_;
+#else
+  int8_t control_[kGroupWidth];
+#endif
+};
+
+// A group's slots fill from its start, so below the load limit a key is
+// usually in its first eight. Fetching those two lines while the control
+// bytes load overlaps the two cache misses of a lookup in a large table.
+void prefetchGroup(const Entry *entries) {
+#ifdef CPPLOX_TABLE_SSE2
+  _mm_prefetch(reinterpret_cast<const char *>(entries), _MM_HINT_T0);
+  _mm_prefetch(reinterpret_cast<const char *>(entries + 4), _MM_HINT_T0);
+#elif defined(__GNUC__)
+  __builtin_prefetch(entries);
+  __builtin_prefetch(entries + 4);
+#else
+  (void)entries;
+#endif
+}
+
+// Visits the groups in triangular order, which reaches every group of a
+// power-of-two table. The load limit leaves an empty slot somewhere, so every
+// probe ends.
+class ProbeSequence {
+public:
+  ProbeSequence(uint32_t hash, size_t capacity)
+      : mask_(capacity / kGroupWidth - 1), group_(groupHash(hash) & mask_) {}
+  size_t offset() const { return group_ * kGroupWidth; }
+  void next() {
+    step_++;
+    group_ = (group_ + step_) & mask_;
+  }
+
+private:
+  size_t mask_;
+  size_t group_;
+  size_t step_ = 0;
+};
+
+} // namespace
 
 void Table::clear() {
   count_ = 0;
+  tombstones_ = 0;
   version_ = 0;
+  control_.clear();
+  control_.shrink_to_fit();
   entries_.clear();
   entries_.shrink_to_fit();
 }
 
-Entry *Table::findEntry(Entry *entries, int capacity, ObjString *key) {
-  uint32_t index = key->hash & (capacity - 1);
-  Entry *tombstone = nullptr;
-
-  for (;;) {
-    Entry *entry = &entries[index];
-
-    if (entry->key == nullptr) {
-      if (isNil(entry->value)) {
-
-        return tombstone != nullptr ? tombstone : entry;
-      } else {
-
-        if (tombstone == nullptr)
-          tombstone = entry;
-      }
-    } else if (entry->key == key) {
+int Table::find(ObjString *key) const {
+  if (count_ == 0)
+    return -1;
 
-      return entry;
+  for (ProbeSequence probe(key->hash, entries_.size());; probe.next()) {
+    prefetchGroup(&entries_[probe.offset()]);
+    Group group(&control_[probe.offset()]);
+    uint32_t matches = group.match(controlHash(key->hash));
+    while (matches != 0) {
+      int slot = static_cast<int>(probe.offset()) + std::countr_zero(matches);
+      if (entries_[slot].key == key)
+        return slot;
+      matches &= matches - 1;
     }
+    if (group.matchEmpty() != 0)
+      return -1;
+  }
+}
 
-    index = (index + 1) & (capacity - 1);
+int Table::findInsertSlot(uint32_t hash) const {
+  for (ProbeSequence probe(hash, entries_.size());; probe.next()) {
+    uint32_t free = Group(&control_[probe.offset()]).matchEmptyOrDeleted();
+    if (free != 0)
+      return static_cast<int>(probe.offset()) + std::countr_zero(free);
   }
 }
 
-const Entry *Table::findEntry(const Entry *entries, int capacity,
-                              ObjString *key) {
-  return findEntry(const_cast<Entry *>(entries), capacity, key);
+void Table::insertAt(int slot, ObjString *key, Value value) {
+  if (control_[slot] == kDeleted)
+    tombstones_--;
+  control_[slot] = controlHash(key->hash);
+  entries_[slot].key = key;
+  entries_[slot].value = value;
+  count_++;
 }
 
-bool Table::get(ObjString *key, Value *value) const {
-  if (count_ == 0)
-    return false;
+// A probe only passes a group that has no empty slot, so a slot in a group
+// that still has one can be emptied outright; otherwise it must stay a
+// tombstone until the next resize.
+void Table::eraseAt(int slot) {
+  int groupStart = slot & ~(kGroupWidth - 1);
+  if (Group(&control_[groupStart]).matchEmpty() != 0) {
+    control_[slot] = kEmpty;
+  } else {
+    control_[slot] = kDeleted;
+    tombstones_++;
+  }
+  entries_[slot] = Entry{};
+  count_--;
+  version_++;
+}
 
-  const Entry *entry = findEntry(entries_.data(), capacity(), key);
-  if (entry->key == nullptr)
+bool Table::get(ObjString *key, Value *value) const {
+  int slot = find(key);
+  if (slot < 0)
     return false;
 
-  *value = entry->value;
+  *value = entries_[slot].value;
   return true;
 }
-Entry *Table::findSlot(ObjString *key) {
-  if (entries_.empty())
-    return nullptr;
-
-  return findEntry(entries_.data(), capacity(), key);
-}
 Entry *Table::getEntry(ObjString *key) {
-  Entry *entry = findSlot(key);
-  if (entry == nullptr)
-    return nullptr;
-  if (entry->key == nullptr)
-    return nullptr;
-  return entry;
+  int slot = find(key);
+  return slot < 0 ? nullptr : &entries_[slot];
 }
 
 void Table::adjustCapacity(int capacity) {
+  std::vector<int8_t> control(static_cast<size_t>(capacity), kEmpty);
   std::vector<Entry> entries(static_cast<size_t>(capacity));
+  control_.swap(control);
+  entries_.swap(entries);
 
   count_ = 0;
-  for (Entry &oldEntry : entries_) {
-    Entry *entry = &oldEntry;
-    if (entry->key == nullptr)
-      continue;
-
-    Entry *dest = findEntry(entries.data(), capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    count_++;
+  tombstones_ = 0;
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (isFull(control[i])) {
+      insertAt(findInsertSlot(entries[i].key->hash), entries[i].key,
+               entries[i].value);
+    }
   }
-
-  entries_.swap(entries);
   version_++;
 }
 bool Table::set(ObjString *key, Value value) {
-  if (count_ + 1 > capacity() * TABLE_MAX_LOAD) {
-    int newCapacity = growCapacity(capacity());
-    adjustCapacity(newCapacity);
+  int slot = find(key);
+  if (slot >= 0) {
+    entries_[slot].value = value;
+    return false;
   }
 
-  Entry *entry = findEntry(entries_.data(), capacity(), key);
-  bool isNewKey = entry->key == nullptr;
-
-  if (isNewKey && isNil(entry->value)) {
-    count_++;
-    version_++;
+  insertNew(key, value);
+  return true;
+}
+void Table::insertNew(ObjString *key, Value value) {
+  if (count_ + tombstones_ + 1 > maxLoad(capacity())) {
+    int newCapacity = (count_ + 1) * 32 <= capacity() * 25
+                          ? capacity()
+                          : std::max(growCapacity(capacity()), kGroupWidth);
+    adjustCapacity(newCapacity);
   }
 
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+  insertAt(findInsertSlot(key->hash), key, value);
+  version_++;
 }
 bool Table::remove(ObjString *key) {
-  if (count_ == 0)
+  int slot = find(key);
+  if (slot < 0)
     return false;
 
-  Entry *entry = findEntry(entries_.data(), capacity(), key);
-  if (entry->key == nullptr)
-    return false;
-
-  entry->key = nullptr;
-  entry->value = boolValue(true);
-  version_++;
+  eraseAt(slot);
   return true;
 }
 void Table::addAllFrom(const Table &from) {
-  for (const Entry &oldEntry : from.entries_) {
-    const Entry *entry = &oldEntry;
-    if (entry->key != nullptr) {
-      set(entry->key, entry->value);
+  for (size_t i = 0; i < from.entries_.size(); i++) {
+    if (isFull(from.control_[i])) {
+      set(from.entries_[i].key, from.entries_[i].value);
     }
   }
 }
@@ -134,34 +244,35 @@ ObjString *Table::findString(const char *chars, int length,
   if (count_ == 0)
     return nullptr;
 
-  uint32_t index = hash & (capacity() - 1);
-  for (;;) {
-    const Entry *entry = &entries_[index];
-    if (entry->key == nullptr) {
-
-      if (isNil(entry->value))
-        return nullptr;
-    } else if (entry->key->length == length && entry->key->hash == hash &&
-               std::memcmp(entry->key->chars, chars, length) == 0) {
-
-      return entry->key;
+  for (ProbeSequence probe(hash, entries_.size());; probe.next()) {
+    prefetchGroup(&entries_[probe.offset()]);
+    Group group(&control_[probe.offset()]);
+    uint32_t matches = group.match(controlHash(hash));
+    while (matches != 0) {
+      ObjString *key =
+          entries_[probe.offset() + std::countr_zero(matches)].key;
+      if (key->hash == hash && key->length == length &&
+          std::memcmp(key->chars, chars, length) == 0)
+        return key;
+      matches &= matches - 1;
     }
-
-    index = (index + 1) & (capacity() - 1);
+    if (group.matchEmpty() != 0)
+      return nullptr;
   }
 }
-void Table::removeWhite() {
-  for (Entry &oldEntry : entries_) {
-    Entry *entry = &oldEntry;
-    if (entry->key != nullptr && !entry->key->isMarked) {
-      remove(entry->key);
+void Table::removeWhite(const Heap &heap) {
+  for (size_t i = 0; i < entries_.size(); i++) {
+    if (isFull(control_[i]) && !heap.isMarked(entries_[i].key)) {
+      eraseAt(static_cast<int>(i));
     }
   }
 }
 void Table::mark(Vm &vm) const {
-  for (const Entry &entry : entries_) {
-    markObject(vm, entry.key);
-    markValue(vm, entry.value);
+  for (size_t i = 0; i < entries_.size(); i++) {
+    if (isFull(control_[i])) {
+      markObject(vm, entries_[i].key);
+      markValue(vm, entries_[i].value);
+    }
   }
 }
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
 
 #include "common.h"
@@ -7,6 +8,7 @@
 
 namespace cpplox {
 
+class Heap;
 class Vm;
 
 struct Entry {
@@ -14,6 +16,10 @@ struct Entry {
   Value value = nilValue();
 };
 
+// Open addressing in the SwissTable style: a control byte per slot holds
+// seven bits of the key's hash, or marks the slot empty or deleted, and a
+// probe compares a whole group of control bytes at once before touching any
+// entry. Entries stay put until the table is resized, which bumps version().
 class Table {
 public:
   Table() = default;
@@ -23,27 +29,44 @@ public:
   void clear();
 
   bool get(ObjString *key, Value *value) const;
-  Entry *findSlot(ObjString *key);
   Entry *getEntry(ObjString *key);
   bool set(ObjString *key, Value value);
+  // Adds a key the caller knows is absent, without set()'s lookup.
+  void insertNew(ObjString *key, Value value);
   bool remove(ObjString *key);
   void addAllFrom(const Table &from);
   ObjString *findString(const char *chars, int length, uint32_t hash) const;
-  void removeWhite();
+  void removeWhite(const Heap &heap);
   void mark(Vm &vm) const;
+  template <typename F> void forEachValue(F f) {
+    for (size_t i = 0; i < entries_.size(); i++) {
+      if (isFull(control_[i]))
+        f(&entries_[i].value);
+    }
+  }
+  template <typename F> void forEachEntry(F f) {
+    for (size_t i = 0; i < entries_.size(); i++) {
+      if (isFull(control_[i]))
+        f(entries_[i]);
+    }
+  }
 
   int count() const { return count_; }
   int capacity() const { return static_cast<int>(entries_.size()); }
   uint32_t version() const { return version_; }
 
 private:
-  static Entry *findEntry(Entry *entries, int capacity, ObjString *key);
-  static const Entry *findEntry(const Entry *entries, int capacity,
-                                ObjString *key);
+  static bool isFull(int8_t control) { return control >= 0; }
+  int find(ObjString *key) const;
+  int findInsertSlot(uint32_t hash) const;
+  void insertAt(int slot, ObjString *key, Value value);
+  void eraseAt(int slot);
   void adjustCapacity(int capacity);
 
   int count_ = 0;
+  int tombstones_ = 0;
   uint32_t version_ = 0;
+  std::vector<int8_t> control_;
   std::vector<Entry> entries_;
 };
 
@@ -4,7 +4,9 @@
 #include <string_view>
 #include <ctime>
 #ifdef CPPLOX_ENABLE_VM_STATS
+#include <algorithm>
 #include <cinttypes>
+#include <utility>
 #endif
 
 #include "common.h"
@@ -12,6 +14,9 @@
 #include "debug.h"
 #include "memory.h"
 #include "object.h"
+#include "profiler.h"
+#include "register_compiler.h"
+#include "register_ops.h"
 #include "vm.h"
 
 namespace cpplox {
@@ -141,6 +146,46 @@ static const char *opcodeName(int opcode) {
     return "OP_INHERIT";
   case OP_METHOD:
     return "OP_METHOD";
+  case OP_GET_LOCAL_PROPERTY:
+    return "OP_GET_LOCAL_PROPERTY";
+  case OP_ADD_LOCAL_CONSTANT:
+    return "OP_ADD_LOCAL_CONSTANT";
+  case OP_SUBTRACT_LOCAL_CONSTANT:
+    return "OP_SUBTRACT_LOCAL_CONSTANT";
+  case OP_LESS_LOCAL_CONSTANT:
+    return "OP_LESS_LOCAL_CONSTANT";
+  case OP_EQUAL_JUMP_IF_FALSE:
+    return "OP_EQUAL_JUMP_IF_FALSE";
+  case OP_GREATER_JUMP_IF_FALSE:
+    return "OP_GREATER_JUMP_IF_FALSE";
+  case OP_LESS_JUMP_IF_FALSE:
+    return "OP_LESS_JUMP_IF_FALSE";
+  case OP_TAIL_CALL:
+    return "OP_TAIL_CALL";
+  case OP_TAIL_INVOKE:
+    return "OP_TAIL_INVOKE";
+  case OP_TAIL_SUPER_INVOKE:
+    return "OP_TAIL_SUPER_INVOKE";
+  case OP_NOT_EQUAL:
+    return "OP_NOT_EQUAL";
+  case OP_NOT_GREATER:
+    return "OP_NOT_GREATER";
+  case OP_NOT_LESS:
+    return "OP_NOT_LESS";
+  case OP_NOT_EQUAL_JUMP_IF_FALSE:
+    return "OP_NOT_EQUAL_JUMP_IF_FALSE";
+  case OP_NOT_GREATER_JUMP_IF_FALSE:
+    return "OP_NOT_GREATER_JUMP_IF_FALSE";
+  case OP_NOT_LESS_JUMP_IF_FALSE:
+    return "OP_NOT_LESS_JUMP_IF_FALSE";
+  case OP_ADD_NUM:
+    return "OP_ADD_NUM";
+  case OP_ADD_STR:
+    return "OP_ADD_STR";
+  case OP_GET_FIELD_SLOT:
+    return "OP_GET_FIELD_SLOT";
+  case OP_GET_LOCAL_FIELD_SLOT:
+    return "OP_GET_LOCAL_FIELD_SLOT";
   }
   return "OP_UNKNOWN";
 }
@@ -150,6 +195,10 @@ void Vm::setStatsEnabled(bool enabled) { statsEnabled = enabled; }
 void Vm::resetStats() {
   bool enabled = statsEnabled;
   opcodeCounts.fill(0);
+  registerOpcodeCounts.fill(0);
+  opcodePairCounts.assign(static_cast<size_t>(OP_COUNT) * OP_COUNT, 0);
+  opcodeTripleCounts.clear();
+  recentOpcodeCount = 0;
   instructionsExecuted = 0;
   maxStackDepth = 0;
   closureCalls = 0;
@@ -163,6 +212,8 @@ void Vm::resetStats() {
   methodCacheMisses = 0;
   fieldCacheHits = 0;
   fieldCacheMisses = 0;
+  quickenings = 0;
+  deoptimizations = 0;
   statsEnabled = enabled;
 }
 
@@ -171,16 +222,150 @@ static void recordInstruction(Vm &vm, uint8_t opcode) {
     return;
   vm.instructionsExecuted++;
   vm.opcodeCounts[opcode]++;
+  if (vm.recentOpcodeCount >= 1) {
+    vm.opcodePairCounts[vm.recentOpcodes[1] * OP_COUNT + opcode]++;
+  }
+  if (vm.recentOpcodeCount >= 2) {
+    uint32_t key = (uint32_t)vm.recentOpcodes[0] << 16 |
+                   (uint32_t)vm.recentOpcodes[1] << 8 | opcode;
+    vm.opcodeTripleCounts[key]++;
+  }
+  vm.recentOpcodes[0] = vm.recentOpcodes[1];
+  vm.recentOpcodes[1] = opcode;
+  if (vm.recentOpcodeCount < 2)
+    vm.recentOpcodeCount++;
   uint64_t depth = (uint64_t)(vm.stackTop - vm.stack.data());
   if (depth > vm.maxStackDepth)
     vm.maxStackDepth = depth;
 }
 
+static void recordRegisterInstruction(Vm &vm, uint8_t opcode) {
+  if (!vm.statsEnabled)
+    return;
+  vm.instructionsExecuted++;
+  vm.registerOpcodeCounts[opcode]++;
+  uint64_t depth = (uint64_t)(vm.stackTop - vm.stack.data());
+  if (depth > vm.maxStackDepth)
+    vm.maxStackDepth = depth;
+}
+
+static constexpr size_t kTopOpcodeSequences = 16;
+
+// Prints the most frequent dynamic opcode sequences. They are the candidates
+// for the fused opcodes the compiler emits.
+static void printOpcodeSequences(
+    const char *label, std::vector<std::pair<uint32_t, uint64_t>> sequences,
+    int length) {
+  if (sequences.empty())
+    return;
+
+  size_t count = std::min(sequences.size(), kTopOpcodeSequences);
+  std::partial_sort(sequences.begin(), sequences.begin() + count,
+                    sequences.end(), [](const auto &a, const auto &b) {
+                      return a.second > b.second;
+                    });
+
+  std::fprintf(stderr, "  %s:\n", label);
+  for (size_t i = 0; i < count; i++) {
+    std::fprintf(stderr, "   ");
+    for (int j = length - 1; j >= 0; j--) {
+      std::fprintf(stderr, " %-26s",
+                   opcodeName((int)(sequences[i].first >> (8 * j)) & 0xff));
+    }
+    std::fprintf(stderr, " %" PRIu64 "\n", sequences[i].second);
+  }
+}
+
+static constexpr size_t kTopCacheSites = 16;
+
+// Counts property and invoke sites by cache state and lists the ones that saw
+// more than one receiver class, megamorphic sites first.
+static void printInlineCacheSites(const Heap &heap) {
+  struct Site {
+    const char *function;
+    const char *name;
+    int classCount;
+    bool megamorphic;
+  };
+  uint64_t monomorphic = 0;
+  uint64_t polymorphic = 0;
+  uint64_t megamorphic = 0;
+  std::vector<Site> sites;
+  heap.forEachListObject([&](Obj *object) {
+    if (object->type != OBJ_FUNCTION)
+      return;
+    ObjFunction *function = static_cast<ObjFunction *>(object);
+    const Chunk &chunk = function->chunk;
+    for (int i = 0; i < static_cast<int>(chunk.constants().size()); i++) {
+      const InlineCache &cache = chunk.inlineCaches()[i];
+      if (cache.megamorphic) {
+        megamorphic++;
+      } else if (cache.classCount > 1) {
+        polymorphic++;
+      } else {
+        if (cache.classCount == 1)
+          monomorphic++;
+        continue;
+      }
+      sites.push_back({function->name != nullptr ? function->name->chars
+                                                 : "<script>",
+                       asString(chunk.constantAt(i))->chars, cache.classCount,
+                       cache.megamorphic});
+    }
+  });
+
+  std::fprintf(stderr, "  monomorphic_sites: %" PRIu64 "\n", monomorphic);
+  std::fprintf(stderr, "  polymorphic_sites: %" PRIu64 "\n", polymorphic);
+  std::fprintf(stderr, "  megamorphic_sites: %" PRIu64 "\n", megamorphic);
+  if (sites.empty())
+    return;
+
+  size_t count = std::min(sites.size(), kTopCacheSites);
+  std::partial_sort(sites.begin(), sites.begin() + count, sites.end(),
+                    [](const Site &a, const Site &b) {
+                      if (a.megamorphic != b.megamorphic)
+                        return a.megamorphic;
+                      return a.classCount > b.classCount;
+                    });
+  std::fprintf(stderr, "  polymorphic_cache_sites:\n");
+  for (size_t i = 0; i < count; i++) {
+    if (sites[i].megamorphic) {
+      std::fprintf(stderr, "    %-20s .%-20s megamorphic\n", sites[i].function,
+                   sites[i].name);
+    } else {
+      std::fprintf(stderr, "    %-20s .%-20s %d classes\n", sites[i].function,
+                   sites[i].name, sites[i].classCount);
+    }
+  }
+}
+
 void Vm::printStats() const {
   std::fprintf(stderr, "cpplox VM stats:\n");
   std::fprintf(stderr, "  instructions: %" PRIu64 "\n", instructionsExecuted);
   std::fprintf(stderr, "  max_stack_depth: %" PRIu64 "\n", maxStackDepth);
   std::fprintf(stderr, "  bytes_allocated: %zu\n", heap.bytesAllocated());
+  std::fprintf(stderr, "  collections: %" PRIu64 "\n", heap.collections());
+  std::fprintf(stderr, "  minor_collections: %" PRIu64 "\n",
+               heap.minorCollections());
+  std::fprintf(stderr, "  promoted_bytes: %zu\n", heap.promotedBytes());
+  std::fprintf(stderr, "  parallel_marks: %" PRIu64 "\n", heap.parallelMarks());
+  std::fprintf(stderr, "  mark_steals: %" PRIu64 "\n", heap.markSteals());
+  std::fprintf(stderr, "  compactions: %" PRIu64 "\n", heap.compactions());
+  std::fprintf(stderr, "  compacted_bytes: %zu\n", heap.compactedBytes());
+  std::fprintf(stderr, "  gc_pauses: %" PRIu64 "\n", heap.pauseCount());
+  std::fprintf(stderr, "  gc_pause_total_us: %" PRIu64 "\n",
+               heap.totalPauseNanoseconds() / 1000);
+  std::fprintf(stderr, "  gc_pause_max_us: %" PRIu64 "\n",
+               heap.maxPauseNanoseconds() / 1000);
+  if (heap.pauseCount() > 0) {
+    std::fprintf(stderr, "  gc_pause_histogram_us:\n");
+    for (int i = 0; i < kPauseBuckets; i++) {
+      if (heap.pauseHistogram()[i] == 0)
+        continue;
+      std::fprintf(stderr, "    <%-12" PRIu64 " %" PRIu64 "\n",
+                   uint64_t{1} << i, heap.pauseHistogram()[i]);
+    }
+  }
   std::fprintf(stderr, "  closure_calls: %" PRIu64 "\n", closureCalls);
   std::fprintf(stderr, "  native_calls: %" PRIu64 "\n", nativeCalls);
   std::fprintf(stderr, "  class_calls: %" PRIu64 "\n", classCalls);
@@ -192,16 +377,46 @@ void Vm::printStats() const {
   std::fprintf(stderr, "  method_cache_misses: %" PRIu64 "\n", methodCacheMisses);
   std::fprintf(stderr, "  field_cache_hits: %" PRIu64 "\n", fieldCacheHits);
   std::fprintf(stderr, "  field_cache_misses: %" PRIu64 "\n", fieldCacheMisses);
+  std::fprintf(stderr, "  quickenings: %" PRIu64 "\n", quickenings);
+  std::fprintf(stderr, "  deoptimizations: %" PRIu64 "\n", deoptimizations);
+  printInlineCacheSites(heap);
   std::fprintf(stderr, "  opcodes:\n");
   for (int i = 0; i < OP_COUNT; i++) {
     if (opcodeCounts[i] == 0)
       continue;
-    std::fprintf(stderr, "    %-20s %" PRIu64 "\n", opcodeName(i),
+    std::fprintf(stderr, "    %-26s %" PRIu64 "\n", opcodeName(i),
             opcodeCounts[i]);
   }
+
+  bool ranRegisters = false;
+  for (int i = 0; i < ROP_COUNT; i++) {
+    if (registerOpcodeCounts[i] == 0)
+      continue;
+    if (!ranRegisters) {
+      std::fprintf(stderr, "  register_opcodes:\n");
+      ranRegisters = true;
+    }
+    std::fprintf(stderr, "    %-32s %" PRIu64 "\n", kRegisterOpcodeNames[i],
+                 registerOpcodeCounts[i]);
+  }
+
+  std::vector<std::pair<uint32_t, uint64_t>> pairs;
+  for (size_t i = 0; i < opcodePairCounts.size(); i++) {
+    if (opcodePairCounts[i] != 0) {
+      uint32_t key = (uint32_t)(i / OP_COUNT) << 8 | (uint32_t)(i % OP_COUNT);
+      pairs.emplace_back(key, opcodePairCounts[i]);
+    }
+  }
+  printOpcodeSequences("opcode_pairs", std::move(pairs), 2);
+  printOpcodeSequences(
+      "opcode_triples",
+      std::vector<std::pair<uint32_t, uint64_t>>(opcodeTripleCounts.begin(),
+                                                 opcodeTripleCounts.end()),
+      3);
 }
 #else
 static void recordInstruction(Vm &, uint8_t) {}
+static void recordRegisterInstruction(Vm &, uint8_t) {}
 #endif
 
 #ifdef CPPLOX_ENABLE_VM_STATS
@@ -229,6 +444,14 @@ static void recordFieldCacheMiss(Vm &vm) {
   if (vm.statsEnabled)
     vm.fieldCacheMisses++;
 }
+static void recordQuickening(Vm &vm) {
+  if (vm.statsEnabled)
+    vm.quickenings++;
+}
+static void recordDeoptimization(Vm &vm) {
+  if (vm.statsEnabled)
+    vm.deoptimizations++;
+}
 #else
 static void recordGlobalCacheHit(Vm &) {}
 static void recordGlobalCacheMiss(Vm &) {}
@@ -236,12 +459,48 @@ static void recordMethodCacheHit(Vm &) {}
 static void recordMethodCacheMiss(Vm &) {}
 static void recordFieldCacheHit(Vm &) {}
 static void recordFieldCacheMiss(Vm &) {}
+static void recordQuickening(Vm &) {}
+static void recordDeoptimization(Vm &) {}
 #endif
 
-static Value clockNative(int argCount, Value *args) {
+static Value clockNative(Vm &vm, int argCount, Value *args) {
   return numberValue((double)std::clock() / CLOCKS_PER_SEC);
 }
 
+// Collects now and compacts at the next safepoint; natives run while the
+// interpreter may hold object pointers in locals.
+static Value compactHeapNative(Vm &vm, int argCount, Value *args) {
+  collectGarbage(vm);
+  vm.heap.requestCompaction();
+  return nilValue();
+}
+
+struct NativeDefinition {
+  const char *name;
+  NativeFn function;
+};
+
+static constexpr NativeDefinition kNatives[] = {
+    {"clock", clockNative},
+    {"compactHeap", compactHeapNative},
+};
+
+const char *nativeName(NativeFn function) {
+  for (const NativeDefinition &native : kNatives) {
+    if (native.function == function)
+      return native.name;
+  }
+  return nullptr;
+}
+
+NativeFn findNative(std::string_view name) {
+  for (const NativeDefinition &native : kNatives) {
+    if (name == native.name)
+      return native.function;
+  }
+  return nullptr;
+}
+
 Vm::Vm() { initialize(); }
 
 Vm::~Vm() { shutdown(); }
@@ -255,6 +514,11 @@ template <typename... Parts> static void runtimeError(Vm &vm, Parts &&...parts)
   (std::cerr << ... << parts) << '\n';
 
   for (int i = vm.frameCount - 1; i >= 0; i--) {
+    if (i == vm.frameCount - 1 - kTraceEndFrames && i >= kTraceEndFrames) {
+      std::cerr << "... " << i - kTraceEndFrames + 1 << " more\n";
+      i = kTraceEndFrames;
+      continue;
+    }
     CallFrame *frame = &vm.frames[i];
 
     ObjFunction *function = frame->closure->function;
@@ -279,7 +543,17 @@ static void defineNative(Vm &vm, const char *name, NativeFn function) {
 
 void Vm::initialize() {
   Vm &vm = *this;
+  vm.frames.resize(kInitialFrames);
+  vm.frameCapacity = kInitialFrames;
+  vm.maxFrames = kDefaultMaxFrames;
+  vm.stack.resize(kInitialStack);
+  vm.stackLimit = vm.stack.data() + kInitialStack - kStackHeadroom;
   resetStack(vm);
+  vm.registerTier = false;
+  vm.minRopeLength = kMinRopeLength;
+  vm.optimizeBytecode = true;
+  vm.lazyFunctions = false;
+  vm.profiler = nullptr;
 #ifdef CPPLOX_ENABLE_VM_STATS
   vm.statsEnabled = false;
   resetStats();
@@ -292,7 +566,9 @@ void Vm::initialize() {
   vm.initString = nullptr;
   vm.initString = vm.copyString("init", 4);
 
-  defineNative(vm, "clock", clockNative);
+  for (const NativeDefinition &native : kNatives) {
+    defineNative(vm, native.name, native.function);
+  }
 }
 
 void Vm::shutdown() {
@@ -311,34 +587,99 @@ Value Vm::pop() {
   return *stackTop;
 }
 
-void Vm::addCompilerRoot(ObjFunction *function) {
-  compilerRoots.push_back(function);
-}
+void Vm::addCompilerRoot(Obj *object) { compilerRoots.push_back(object); }
 
 void Vm::popCompilerRoot() { compilerRoots.pop_back(); }
 
 void Vm::markCompilerRoots() {
-  for (ObjFunction *function : compilerRoots) {
-    markObject(*this, function);
+  for (Obj *object : compilerRoots) {
+    markObject(*this, object);
   }
 }
 
+void Vm::setRegisterTier(bool enabled) { registerTier = enabled; }
+
+void Vm::setLazyIntern(bool enabled) {
+  minRopeLength = enabled ? 0 : kMinRopeLength;
+}
+
+void Vm::setOptimizeBytecode(bool enabled) { optimizeBytecode = enabled; }
+
+void Vm::setLazyFunctions(bool enabled) { lazyFunctions = enabled; }
+
+void Vm::setMaxFrames(int limit) {
+  maxFrames = limit;
+  frameCapacity = std::min(static_cast<int>(frames.size()), limit);
+}
+
 static Value peek(Vm &vm, int distance) {
   return vm.stackTop[-1 - distance];
 }
 
+// Moves the value stack to a buffer at least twice the size, with room for
+// slots more values above stackTop, and rebases every pointer into it.
+static void growStack(Vm &vm, int slots) {
+  size_t needed = static_cast<size_t>(vm.stackTop - vm.stack.data()) +
+                  static_cast<size_t>(slots) + kStackHeadroom;
+  std::vector<Value> grown(std::max(vm.stack.size() * 2, needed));
+  std::copy(vm.stack.begin(), vm.stack.end(), grown.begin());
+  Value *oldBase = vm.stack.data();
+  auto rebase = [&](Value *slot) { return grown.data() + (slot - oldBase); };
+
+  vm.stackTop = rebase(vm.stackTop);
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = rebase(vm.frames[i].slots);
+  }
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != nullptr;
+       upvalue = upvalue->next) {
+    upvalue->location = rebase(upvalue->location);
+  }
+  vm.stack.swap(grown);
+  vm.stackLimit = vm.stack.data() + vm.stack.size() - kStackHeadroom;
+}
+
+static bool growFrames(Vm &vm, int slots) {
+  if (vm.frameCount == vm.frameCapacity) {
+    if (vm.frameCount >= vm.maxFrames) {
+      runtimeError(vm, "Stack overflow.");
+      return false;
+    }
+    vm.frameCapacity = std::min(vm.frameCapacity * 2, vm.maxFrames);
+    if (static_cast<size_t>(vm.frameCapacity) > vm.frames.size())
+      vm.frames.resize(static_cast<size_t>(vm.frameCapacity));
+  }
+  if (vm.stackTop + slots > vm.stackLimit) {
+    growStack(vm, slots);
+  }
+  return true;
+}
+
+// Makes room for one more frame and for slots plus kStackHeadroom values
+// above stackTop.
+static bool reserveFrame(Vm &vm, int slots) {
+  if (vm.frameCount == vm.frameCapacity || vm.stackTop + slots > vm.stackLimit)
+      [[unlikely]] {
+    return growFrames(vm, slots);
+  }
+  return true;
+}
+
 static bool call(Vm &vm, ObjClosure *closure, int argCount) {
   if (argCount != closure->function->arity) {
     runtimeError(vm, "Expected ", closure->function->arity,
                  " arguments but got ", argCount, ".");
     return false;
   }
-
-  if (vm.frameCount == kMaxFrames) {
-    runtimeError(vm, "Stack overflow.");
+  ObjFunction *function = closure->function;
+  if (!function->lazySource.empty() && !compileLazyFunction(vm, function))
+      [[unlikely]] {
+    runtimeError(vm, "Could not compile ", function->name->chars, "().");
     return false;
   }
 
+  if (!reserveFrame(vm, function->maxStack))
+    return false;
+
   CallFrame *frame = &vm.frames[vm.frameCount++];
 
   frame->closure = closure;
@@ -386,7 +727,7 @@ static bool callValue(Vm &vm, Value callee, int argCount) {
       if (vm.statsEnabled)
         vm.nativeCalls++;
 #endif
-      Value result = native(argCount, vm.stackTop - argCount);
+      Value result = native(vm, argCount, vm.stackTop - argCount);
       vm.stackTop -= argCount + 1;
       vm.push(result);
       return true;
@@ -407,13 +748,14 @@ static bool getFieldSlot(ObjClass *klass, ObjString *name, int *slot) {
   return true;
 }
 
-static int ensureFieldSlot(ObjClass *klass, ObjString *name) {
+static int ensureFieldSlot(Vm &vm, ObjClass *klass, ObjString *name) {
   int slot;
   if (getFieldSlot(klass, name, &slot))
     return slot;
 
   slot = klass->fieldSlotCount++;
   klass->fieldSlots.set(name, numberValue(slot));
+  vm.heap.shade(name);
   klass->fieldVersion++;
   return slot;
 }
@@ -422,17 +764,19 @@ static bool readInstanceField(ObjInstance *instance, int slot, Value *value) {
   return instance->fields.read(slot, value);
 }
 
-static void writeInstanceField(ObjInstance *instance, int slot, Value value) {
+static void writeInstanceField(Vm &vm, ObjInstance *instance, int slot,
+                               Value value) {
   instance->fields.write(slot, value);
+  vm.heap.writeBarrier(instance, value);
 }
 
 static bool findMethodCached(Vm &vm, ObjClass *klass, ObjString *name,
                              InlineCache *cache, Value *method) {
-  if (cache != nullptr && cache->kind == CACHE_METHOD && cache->key == name &&
-      cache->ownerClass == klass &&
-      cache->tableVersion == klass->methods.version()) {
+  ClassCacheEntry *way = cache != nullptr ? cache->find(klass) : nullptr;
+  if (way != nullptr && way->kind == CACHE_METHOD &&
+      way->tableVersion == klass->methods.version()) {
     recordMethodCacheHit(vm);
-    *method = cache->value;
+    *method = way->value;
     return true;
   }
 
@@ -442,14 +786,15 @@ static bool findMethodCached(Vm &vm, ObjClass *klass, ObjString *name,
     return false;
   }
 
-  if (cache != nullptr) {
-    cache->kind = CACHE_METHOD;
-    cache->key = name;
-    cache->ownerClass = klass;
-    cache->value = *method;
-    cache->tableVersion = klass->methods.version();
-    cache->secondaryVersion = 0;
-    cache->entryIndex = -2;
+  way = cache != nullptr ? cache->claim(klass) : nullptr;
+  if (way != nullptr) {
+    way->kind = CACHE_METHOD;
+    way->value = *method;
+    vm.heap.shade(klass);
+    vm.heap.shade(asObj(*method));
+    way->tableVersion = klass->methods.version();
+    way->secondaryVersion = 0;
+    way->entryIndex = -2;
   }
   return true;
 }
@@ -475,19 +820,19 @@ static bool invoke(Vm &vm, ObjString *name, int argCount, InlineCache *cache) {
   }
 
   ObjInstance *instance = asInstance(receiver);
-  if (cache != nullptr && cache->kind == CACHE_METHOD && cache->key == name &&
-      cache->ownerClass == instance->klass &&
-      cache->tableVersion == instance->klass->methods.version() &&
-      cache->secondaryVersion == instance->klass->fieldVersion) {
-    if (cache->entryIndex == -1) {
+  ClassCacheEntry *way = cache != nullptr ? cache->find(instance->klass) : nullptr;
+  if (way != nullptr && way->kind == CACHE_METHOD &&
+      way->tableVersion == instance->klass->methods.version() &&
+      way->secondaryVersion == instance->klass->fieldVersion) {
+    if (way->entryIndex == -1) {
       recordMethodCacheHit(vm);
-      return call(vm, asClosure(cache->value), argCount);
+      return call(vm, asClosure(way->value), argCount);
     }
-    if (cache->entryIndex >= 0) {
+    if (way->entryIndex >= 0) {
       Value ignored;
-      if (!readInstanceField(instance, cache->entryIndex, &ignored)) {
+      if (!readInstanceField(instance, way->entryIndex, &ignored)) {
         recordMethodCacheHit(vm);
-        return call(vm, asClosure(cache->value), argCount);
+        return call(vm, asClosure(way->value), argCount);
       }
     }
   }
@@ -502,9 +847,10 @@ static bool invoke(Vm &vm, ObjString *name, int argCount, InlineCache *cache) {
 
   if (!findMethodCached(vm, instance->klass, name, cache, &value))
     return false;
-  if (cache != nullptr) {
-    cache->secondaryVersion = instance->klass->fieldVersion;
-    cache->entryIndex = fieldSlot >= 0 ? fieldSlot : -1;
+  way = cache != nullptr ? cache->find(instance->klass) : nullptr;
+  if (way != nullptr) {
+    way->secondaryVersion = instance->klass->fieldVersion;
+    way->entryIndex = fieldSlot >= 0 ? fieldSlot : -1;
   }
   return call(vm, asClosure(value), argCount);
 }
@@ -519,9 +865,6 @@ static bool bindMethodCached(Vm &vm, ObjClass *klass, ObjString *name,
   vm.push(objectValue(bound));
   return true;
 }
-static bool bindMethod(Vm &vm, ObjClass *klass, ObjString *name) {
-  return bindMethodCached(vm, klass, name, nullptr);
-}
 static ObjUpvalue *captureUpvalue(Vm &vm, Value *local) {
   ObjUpvalue *prevUpvalue = nullptr;
   ObjUpvalue *upvalue = vm.openUpvalues;
@@ -550,13 +893,46 @@ static void closeUpvalues(Vm &vm, Value *last) {
     ObjUpvalue *upvalue = vm.openUpvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    vm.heap.writeBarrier(upvalue, upvalue->closed);
     vm.openUpvalues = upvalue->next;
   }
 }
+// A tail call has just pushed the callee's frame. The caller has nothing left
+// to do but return the result, so the callee's slots slide down over the
+// caller's and its frame takes the caller's place.
+static void replaceCallerFrame(Vm &vm) {
+  CallFrame *callee = &vm.frames[vm.frameCount - 1];
+  CallFrame *caller = &vm.frames[vm.frameCount - 2];
+  closeUpvalues(vm, caller->slots);
+
+  size_t count = static_cast<size_t>(vm.stackTop - callee->slots);
+  std::memmove(caller->slots, callee->slots, count * sizeof(Value));
+  vm.stackTop = caller->slots + count;
+  caller->closure = callee->closure;
+  caller->ip = callee->ip;
+  vm.frameCount--;
+}
+// Minor collections and compaction move objects, so they only run where no
+// C++ local holds a Value or object pointer: at loop back-edges and calls.
+// Profiler samples are taken here too.
+static void serviceSafepoint(Vm &vm, const uint8_t *ip) {
+  if (Profiler::sampleDue.exchange(false, std::memory_order_relaxed) &&
+      vm.profiler != nullptr)
+    vm.profiler->sample(vm, ip);
+  vm.heap.clearSafepointRequest();
+  if (vm.heap.hasSafepointWork())
+    collectAtSafepoint(vm);
+}
+static void safepoint(Vm &vm, const uint8_t *ip) {
+  if (vm.heap.hasSafepointWork()) [[unlikely]]
+    serviceSafepoint(vm, ip);
+}
 static void defineMethod(Vm &vm, ObjString *name) {
   Value method = peek(vm, 0);
   ObjClass *klass = asClass(peek(vm, 1));
   klass->methods.set(name, method);
+  vm.heap.shade(name);
+  vm.heap.writeBarrier(klass, method);
   if (name == vm.initString) {
     klass->initializer = asClosure(method);
   }
@@ -565,28 +941,137 @@ static void defineMethod(Vm &vm, ObjString *name) {
 static bool isFalsey(Value value) {
   return isNil(value) || (isBool(value) && !asBool(value));
 }
+// A string or rope operand, with a flattened rope standing for its string.
+static Obj *concatenationOperand(Value value) {
+  Obj *object = asObj(value);
+  if (object->type == OBJ_ROPE &&
+      static_cast<ObjRope *>(object)->flat != nullptr)
+    return static_cast<ObjRope *>(object)->flat;
+  return object;
+}
+static int textLength(const Obj *object) {
+  return object->type == OBJ_ROPE ? static_cast<const ObjRope *>(object)->length
+                                  : static_cast<const ObjString *>(object)->length;
+}
+// Short results are copied and interned; longer ones, or all of them with
+// --lazy-intern, become ropes, so building a string piece by piece no longer
+// copies it on every step.
 static void concatenate(Vm &vm) {
-  ObjString *b = asString(peek(vm, 0));
-  ObjString *a = asString(peek(vm, 1));
-
-  int length = a->length + b->length;
-  char *chars = allocate<char>(vm, length + 1);
-  std::memcpy(chars, a->chars, a->length);
-  std::memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-
-  ObjString *result = vm.takeString(chars, length);
+  Obj *bObject = concatenationOperand(peek(vm, 0));
+  Obj *aObject = concatenationOperand(peek(vm, 1));
+
+  int length = textLength(aObject) + textLength(bObject);
+  Obj *result;
+  if (length < vm.minRopeLength && aObject->type == OBJ_STRING &&
+      bObject->type == OBJ_STRING) {
+    ObjString *a = static_cast<ObjString *>(aObject);
+    ObjString *b = static_cast<ObjString *>(bObject);
+    char *chars = allocate<char>(vm, length + 1);
+    std::memcpy(chars, a->chars, a->length);
+    std::memcpy(chars + a->length, b->chars, b->length);
+    chars[length] = '\0';
+    result = vm.takeString(chars, length);
+  } else {
+    result = vm.newRope(aObject, bObject, length);
+  }
   vm.pop();
   vm.pop();
   vm.push(objectValue(result));
 }
+// Interned strings are equal only if they are the same object. A rope is
+// flattened, and so interned, the first time it is compared with text of the
+// same length. Both values must be reachable.
+static inline bool valuesEqual(Vm &vm, Value a, Value b) {
+  if (valuesEqual(a, b))
+    return true;
+  if ((!isRope(a) && !isRope(b)) || !isStringOrRope(a) || !isStringOrRope(b) ||
+      textLength(asObj(a)) != textLength(asObj(b)))
+    return false;
+  auto flatten = [&vm](Value value) {
+    return isRope(value) ? vm.flattenRope(asRope(value)) : asString(value);
+  };
+  ObjString *aString = flatten(a);
+  return aString == flatten(b);
+}
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(Vm &vm, CallFrame *frame, uint8_t *ip) {
+  std::printf("          ");
+  for (Value *slot = vm.stack.data(); slot < vm.stackTop; slot++) {
+    std::printf("[ ");
+    printValue(*slot);
+    std::printf(" ]");
+  }
+  std::printf("\n");
+
+  disassembleInstruction(
+      &frame->closure->function->chunk,
+      (int)(ip - frame->closure->function->chunk.codeData()));
+}
+static void traceRegisterExecution(Vm &vm, CallFrame *frame, uint8_t *ip) {
+  std::printf("          ");
+  for (Value *slot = frame->slots; slot < vm.stackTop; slot++) {
+    std::printf("[ ");
+    printValue(*slot);
+    std::printf(" ]");
+  }
+  std::printf("\n");
+
+  disassembleRegisterInstruction(
+      &frame->closure->function->chunk,
+      (int)(ip - frame->closure->function->chunk.codeData()));
+}
+#else
+static void traceExecution(Vm &, CallFrame *, uint8_t *) {}
+static void traceRegisterExecution(Vm &, CallFrame *, uint8_t *) {}
+#endif
+
+// With computed goto every handler ends in its own indirect jump through
+// dispatchTable instead of funnelling back through the switch. The switch is
+// still used for the first instruction and is the portable fallback.
+#if defined(CPPLOX_ENABLE_COMPUTED_GOTO) &&                                    \
+    (defined(__GNUC__) || defined(__clang__))
+#define CPPLOX_COMPUTED_GOTO 1
+#endif
+
+#define VM_FETCH()                                                             \
+  do {                                                                         \
+    traceExecution(vm, frame, ip);                                             \
+    instruction = readByte();                                                  \
+    recordInstruction(vm, instruction);                                        \
+  } while (false)
+
+#ifdef CPPLOX_COMPUTED_GOTO
+#define VM_CASE(opcode)                                                        \
+  case opcode:                                                                 \
+  target_##opcode:
+#define VM_NEXT()                                                              \
+  do {                                                                         \
+    VM_FETCH();                                                                \
+    goto *dispatchTable[instruction];                                          \
+  } while (false)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#else
+#define VM_CASE(opcode) case opcode:
+#define VM_NEXT() break
+#endif
+
 static InterpretResult run(Vm &vm) {
   CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  // The instruction pointer lives in a local so it can stay in a register;
+  // it is written back to the frame before anything that may push a frame or
+  // report a runtime error.
+  uint8_t *ip = frame->ip;
 
-  auto readByte = [&]() -> uint8_t { return *frame->ip++; };
+  auto readByte = [&]() -> uint8_t { return *ip++; };
   auto readShort = [&]() -> uint16_t {
-    frame->ip += 2;
-    return static_cast<uint16_t>((frame->ip[-2] << 8) | frame->ip[-1]);
+    ip += 2;
+    return static_cast<uint16_t>((ip[-2] << 8) | ip[-1]);
+  };
+  auto storeIp = [&]() { frame->ip = ip; };
+  auto loadFrame = [&]() {
+    frame = &vm.frames[vm.frameCount - 1];
+    ip = frame->ip;
   };
   auto readConstant = [&]() -> Value {
     return frame->closure->function->chunk.constantAt(readByte());
@@ -598,6 +1083,7 @@ static InterpretResult run(Vm &vm) {
     Value bValue = vm.stackTop[-1];
     Value aValue = vm.stackTop[-2];
     if (!isNumber(bValue) || !isNumber(aValue)) {
+      storeIp();
       runtimeError(vm, "Operands must be numbers.");
       return false;
     }
@@ -606,131 +1092,307 @@ static InterpretResult run(Vm &vm) {
     return true;
   };
 
-  for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-    std::printf("          ");
-    for (Value *slot = vm.stack.data(); slot < vm.stackTop; slot++) {
-      std::printf("[ ");
-      printValue(*slot);
-      std::printf(" ]");
+  // Quickening rewrites the opcode byte at `opcode` in place. Chunks are
+  // shared by every closure over the function, so a rewrite is seen by all of
+  // them, and a failed guard puts the generic opcode back.
+  auto quicken = [&](uint8_t *opcode, uint8_t specialized) {
+    *opcode = specialized;
+    recordQuickening(vm);
+  };
+  auto deoptimize = [&](uint8_t *opcode, uint8_t generic) {
+    *opcode = generic;
+    recordDeoptimization(vm);
+  };
+
+  // Shared by OP_GET_PROPERTY and OP_GET_LOCAL_PROPERTY; replaces the
+  // receiver on top of the stack with the property value. A field access
+  // quickens the instruction at `opcode` to `fieldSlotOpcode`, unless `opcode` is
+  // null because the quickened form has just been given up on.
+  auto getProperty = [&](uint8_t constant, uint8_t *opcode,
+                         uint8_t fieldSlotOpcode) -> bool {
+    if (!isInstance(peek(vm, 0))) {
+      storeIp();
+      runtimeError(vm, "Only instances have properties.");
+      return false;
+    }
+
+    ObjInstance *instance = asInstance(peek(vm, 0));
+    Chunk *chunk = &frame->closure->function->chunk;
+    ObjString *name = asString(chunk->constantAt(constant));
+    InlineCache *cache = &chunk->inlineCache(constant);
+
+    ClassCacheEntry *way = cache->find(instance->klass);
+    if (way != nullptr && way->kind == CACHE_FIELD &&
+        way->secondaryVersion == instance->klass->fieldVersion) {
+      Value fieldValue;
+      if (readInstanceField(instance, way->entryIndex, &fieldValue)) {
+        recordFieldCacheHit(vm);
+        if (opcode != nullptr)
+          quicken(opcode, fieldSlotOpcode);
+        vm.stackTop[-1] = fieldValue;
+        return true;
+      }
+    }
+
+    recordFieldCacheMiss(vm);
+    int fieldSlot = -1;
+    Value fieldValue;
+    if (getFieldSlot(instance->klass, name, &fieldSlot) &&
+        readInstanceField(instance, fieldSlot, &fieldValue)) {
+      way = cache->claim(instance->klass);
+      if (way != nullptr) {
+        way->kind = CACHE_FIELD;
+        vm.heap.shade(instance->klass);
+        way->entryIndex = fieldSlot;
+        way->tableVersion = 0;
+        way->secondaryVersion = instance->klass->fieldVersion;
+        way->value = nilValue();
+        if (opcode != nullptr)
+          quicken(opcode, fieldSlotOpcode);
+      }
+      vm.stackTop[-1] = fieldValue;
+      return true;
+    }
+
+    storeIp();
+    return bindMethodCached(vm, instance->klass, name, cache);
+  };
+  // The guard of OP_GET_FIELD_SLOT: the receiver has a class and field
+  // layout one of the site's cache ways was filled for.
+  auto readCachedField = [&](uint8_t constant) -> bool {
+    Value receiver = vm.stackTop[-1];
+    if (!isInstance(receiver))
+      return false;
+    ObjInstance *instance = asInstance(receiver);
+    ClassCacheEntry *way =
+        frame->closure->function->chunk.inlineCache(constant).find(
+            instance->klass);
+    Value fieldValue;
+    if (way == nullptr || way->kind != CACHE_FIELD ||
+        way->secondaryVersion != instance->klass->fieldVersion ||
+        !readInstanceField(instance, way->entryIndex, &fieldValue))
+      return false;
+    recordFieldCacheHit(vm);
+    vm.stackTop[-1] = fieldValue;
+    return true;
+  };
+  auto addValues = [&]() -> bool {
+    Value bValue = vm.stackTop[-1];
+    Value aValue = vm.stackTop[-2];
+    if (isStringOrRope(bValue) && isStringOrRope(aValue)) {
+      concatenate(vm);
+    } else if (isNumber(bValue) && isNumber(aValue)) {
+      vm.stackTop[-2] = numberValue(asNumber(aValue) + asNumber(bValue));
+      vm.stackTop--;
+    } else {
+      storeIp();
+      runtimeError(vm, "Operands must be two numbers or two strings.");
+      return false;
     }
-    std::printf("\n");
+    return true;
+  };
 
-    disassembleInstruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.codeData()));
+#ifdef CPPLOX_COMPUTED_GOTO
+  // Indexed by opcode byte, so the order must follow the Opcode enum.
+  static void *const dispatchTable[] = {
+      &&target_OP_CONSTANT,
+      &&target_OP_CONSTANT_0,
+      &&target_OP_CONSTANT_1,
+      &&target_OP_CONSTANT_2,
+      &&target_OP_CONSTANT_3,
+      &&target_OP_CONSTANT_4,
+      &&target_OP_CONSTANT_5,
+      &&target_OP_CONSTANT_6,
+      &&target_OP_CONSTANT_7,
+      &&target_OP_NIL,
+      &&target_OP_TRUE,
+      &&target_OP_FALSE,
+      &&target_OP_POP,
+      &&target_OP_GET_LOCAL,
+      &&target_OP_GET_LOCAL_0,
+      &&target_OP_GET_LOCAL_1,
+      &&target_OP_GET_LOCAL_2,
+      &&target_OP_GET_LOCAL_3,
+      &&target_OP_GET_LOCAL_4,
+      &&target_OP_GET_LOCAL_5,
+      &&target_OP_GET_LOCAL_6,
+      &&target_OP_GET_LOCAL_7,
+      &&target_OP_SET_LOCAL,
+      &&target_OP_SET_LOCAL_0,
+      &&target_OP_SET_LOCAL_1,
+      &&target_OP_SET_LOCAL_2,
+      &&target_OP_SET_LOCAL_3,
+      &&target_OP_SET_LOCAL_4,
+      &&target_OP_SET_LOCAL_5,
+      &&target_OP_SET_LOCAL_6,
+      &&target_OP_SET_LOCAL_7,
+      &&target_OP_GET_GLOBAL,
+      &&target_OP_DEFINE_GLOBAL,
+      &&target_OP_SET_GLOBAL,
+      &&target_OP_GET_UPVALUE,
+      &&target_OP_SET_UPVALUE,
+      &&target_OP_GET_PROPERTY,
+      &&target_OP_SET_PROPERTY,
+      &&target_OP_GET_SUPER,
+      &&target_OP_EQUAL,
+      &&target_OP_GREATER,
+      &&target_OP_LESS,
+      &&target_OP_ADD,
+      &&target_OP_SUBTRACT,
+      &&target_OP_MULTIPLY,
+      &&target_OP_DIVIDE,
+      &&target_OP_NOT,
+      &&target_OP_NEGATE,
+      &&target_OP_PRINT,
+      &&target_OP_JUMP,
+      &&target_OP_JUMP_IF_FALSE,
+      &&target_OP_LOOP,
+      &&target_OP_CALL,
+      &&target_OP_INVOKE,
+      &&target_OP_SUPER_INVOKE,
+      &&target_OP_CLOSURE,
+      &&target_OP_CLOSE_UPVALUE,
+      &&target_OP_RETURN,
+      &&target_OP_CLASS,
+      &&target_OP_INHERIT,
+      &&target_OP_METHOD,
+      &&target_OP_GET_LOCAL_PROPERTY,
+      &&target_OP_ADD_LOCAL_CONSTANT,
+      &&target_OP_SUBTRACT_LOCAL_CONSTANT,
+      &&target_OP_LESS_LOCAL_CONSTANT,
+      &&target_OP_EQUAL_JUMP_IF_FALSE,
+      &&target_OP_GREATER_JUMP_IF_FALSE,
+      &&target_OP_LESS_JUMP_IF_FALSE,
+      &&target_OP_TAIL_CALL,
+      &&target_OP_TAIL_INVOKE,
+      &&target_OP_TAIL_SUPER_INVOKE,
+      &&target_OP_NOT_EQUAL,
+      &&target_OP_NOT_GREATER,
+      &&target_OP_NOT_LESS,
+      &&target_OP_NOT_EQUAL_JUMP_IF_FALSE,
+      &&target_OP_NOT_GREATER_JUMP_IF_FALSE,
+      &&target_OP_NOT_LESS_JUMP_IF_FALSE,
+      &&target_OP_ADD_NUM,
+      &&target_OP_ADD_STR,
+      &&target_OP_GET_FIELD_SLOT,
+      &&target_OP_GET_LOCAL_FIELD_SLOT,
+  };
+  static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == OP_COUNT,
+                "dispatch table must cover every opcode");
 #endif
 
-    uint8_t instruction = readByte();
-    recordInstruction(vm, instruction);
+  uint8_t instruction;
+  for (;;) {
+    VM_FETCH();
     switch (instruction) {
-    case OP_CONSTANT: {
+    VM_CASE(OP_CONSTANT) {
       Value constant = readConstant();
 
       pushValue(constant);
-      break;
+      VM_NEXT();
     }
-    case OP_CONSTANT_0:
-    case OP_CONSTANT_1:
-    case OP_CONSTANT_2:
-    case OP_CONSTANT_3:
-    case OP_CONSTANT_4:
-    case OP_CONSTANT_5:
-    case OP_CONSTANT_6:
-    case OP_CONSTANT_7: {
+    VM_CASE(OP_CONSTANT_0)
+    VM_CASE(OP_CONSTANT_1)
+    VM_CASE(OP_CONSTANT_2)
+    VM_CASE(OP_CONSTANT_3)
+    VM_CASE(OP_CONSTANT_4)
+    VM_CASE(OP_CONSTANT_5)
+    VM_CASE(OP_CONSTANT_6)
+    VM_CASE(OP_CONSTANT_7) {
       Value *constants = frame->closure->function->chunk.constantsData();
       pushValue(constants[instruction - OP_CONSTANT_0]);
-      break;
+      VM_NEXT();
     }
-    case OP_NIL:
+    VM_CASE(OP_NIL)
       pushValue(nilValue());
-      break;
-    case OP_TRUE:
+      VM_NEXT();
+    VM_CASE(OP_TRUE)
       pushValue(boolValue(true));
-      break;
-    case OP_FALSE:
+      VM_NEXT();
+    VM_CASE(OP_FALSE)
       pushValue(boolValue(false));
-      break;
-    case OP_POP:
+      VM_NEXT();
+    VM_CASE(OP_POP)
       vm.stackTop--;
-      break;
-    case OP_GET_LOCAL: {
+      VM_NEXT();
+    VM_CASE(OP_GET_LOCAL) {
       uint8_t slot = readByte();
 
       pushValue(frame->slots[slot]);
-      break;
+      VM_NEXT();
     }
-    case OP_GET_LOCAL_0:
+    VM_CASE(OP_GET_LOCAL_0)
       pushValue(frame->slots[0]);
-      break;
-    case OP_GET_LOCAL_1:
+      VM_NEXT();
+    VM_CASE(OP_GET_LOCAL_1)
       pushValue(frame->slots[1]);
-      break;
-    case OP_GET_LOCAL_2:
+      VM_NEXT();
+    VM_CASE(OP_GET_LOCAL_2)
       pushValue(frame->slots[2]);
-      break;
-    case OP_GET_LOCAL_3:
+      VM_NEXT();
+    VM_CASE(OP_GET_LOCAL_3)
       pushValue(frame->slots[3]);
-      break;
-    case OP_GET_LOCAL_4:
+      VM_NEXT();
+    VM_CASE(OP_GET_LOCAL_4)
       pushValue(frame->slots[4]);
-      break;
-    case OP_GET_LOCAL_5:
+      VM_NEXT();
+    VM_CASE(OP_GET_LOCAL_5)
       pushValue(frame->slots[5]);
-      break;
-    case OP_GET_LOCAL_6:
+      VM_NEXT();
+    VM_CASE(OP_GET_LOCAL_6)
       pushValue(frame->slots[6]);
-      break;
-    case OP_GET_LOCAL_7:
+      VM_NEXT();
+    VM_CASE(OP_GET_LOCAL_7)
       pushValue(frame->slots[7]);
-      break;
-    case OP_SET_LOCAL: {
+      VM_NEXT();
+    VM_CASE(OP_SET_LOCAL) {
       uint8_t slot = readByte();
 
       frame->slots[slot] = peek(vm, 0);
-      break;
+      VM_NEXT();
     }
-    case OP_SET_LOCAL_0:
+    VM_CASE(OP_SET_LOCAL_0)
       frame->slots[0] = vm.stackTop[-1];
-      break;
-    case OP_SET_LOCAL_1:
+      VM_NEXT();
+    VM_CASE(OP_SET_LOCAL_1)
       frame->slots[1] = vm.stackTop[-1];
-      break;
-    case OP_SET_LOCAL_2:
+      VM_NEXT();
+    VM_CASE(OP_SET_LOCAL_2)
       frame->slots[2] = vm.stackTop[-1];
-      break;
-    case OP_SET_LOCAL_3:
+      VM_NEXT();
+    VM_CASE(OP_SET_LOCAL_3)
       frame->slots[3] = vm.stackTop[-1];
-      break;
-    case OP_SET_LOCAL_4:
+      VM_NEXT();
+    VM_CASE(OP_SET_LOCAL_4)
       frame->slots[4] = vm.stackTop[-1];
-      break;
-    case OP_SET_LOCAL_5:
+      VM_NEXT();
+    VM_CASE(OP_SET_LOCAL_5)
       frame->slots[5] = vm.stackTop[-1];
-      break;
-    case OP_SET_LOCAL_6:
+      VM_NEXT();
+    VM_CASE(OP_SET_LOCAL_6)
       frame->slots[6] = vm.stackTop[-1];
-      break;
-    case OP_SET_LOCAL_7:
+      VM_NEXT();
+    VM_CASE(OP_SET_LOCAL_7)
       frame->slots[7] = vm.stackTop[-1];
-      break;
-    case OP_GET_GLOBAL: {
+      VM_NEXT();
+    VM_CASE(OP_GET_GLOBAL) {
       uint8_t constant = readByte();
       Chunk *chunk = &frame->closure->function->chunk;
       ObjString *name = asString(chunk->constantAt(constant));
       InlineCache *cache = &chunk->inlineCache(constant);
 
       Entry *entry = cache->entry;
-      if (cache->kind == CACHE_GLOBAL && cache->key == name &&
+      if (cache->key == name &&
           cache->tableVersion == vm.globals.version() && entry != nullptr) {
         recordGlobalCacheHit(vm);
         pushValue(entry->value);
-        break;
+        VM_NEXT();
       }
 
       recordGlobalCacheMiss(vm);
       entry = vm.globals.getEntry(name);
       if (entry == nullptr) {
+        storeIp();
         runtimeError(vm, "Undefined variable '", name->chars, "'.");
         return INTERPRET_RUNTIME_ERROR;
       }
@@ -738,39 +1400,38 @@ static InterpretResult run(Vm &vm) {
       cache->key = name;
       cache->entry = entry;
       cache->tableVersion = vm.globals.version();
-      cache->kind = CACHE_GLOBAL;
       pushValue(entry->value);
-      break;
+      VM_NEXT();
     }
-    case OP_DEFINE_GLOBAL: {
+    VM_CASE(OP_DEFINE_GLOBAL) {
       uint8_t constant = readByte();
       Chunk *chunk = &frame->closure->function->chunk;
       ObjString *name = asString(chunk->constantAt(constant));
       vm.globals.set(name, vm.stackTop[-1]);
+      vm.heap.globalWriteBarrier(vm.stackTop[-1]);
       InlineCache *cache = &chunk->inlineCache(constant);
       cache->key = name;
       cache->entry = vm.globals.getEntry(name);
       cache->tableVersion = vm.globals.version();
-      cache->kind = CACHE_GLOBAL;
       vm.stackTop--;
-      break;
+      VM_NEXT();
     }
-    case OP_SET_GLOBAL: {
+    VM_CASE(OP_SET_GLOBAL) {
       uint8_t constant = readByte();
       Chunk *chunk = &frame->closure->function->chunk;
       ObjString *name = asString(chunk->constantAt(constant));
       InlineCache *cache = &chunk->inlineCache(constant);
 
       Entry *entry = cache->entry;
-      if (!(cache->kind == CACHE_GLOBAL && cache->key == name &&
+      if (!(cache->key == name &&
             cache->tableVersion == vm.globals.version() && entry != nullptr)) {
         recordGlobalCacheMiss(vm);
         entry = vm.globals.getEntry(name);
         if (entry == nullptr) {
+          storeIp();
           runtimeError(vm, "Undefined variable '", name->chars, "'.");
           return INTERPRET_RUNTIME_ERROR;
         }
-        cache->kind = CACHE_GLOBAL;
         cache->key = name;
         cache->entry = entry;
         cache->tableVersion = vm.globals.version();
@@ -779,194 +1440,213 @@ static InterpretResult run(Vm &vm) {
       }
 
       entry->value = vm.stackTop[-1];
-      break;
+      vm.heap.globalWriteBarrier(entry->value);
+      VM_NEXT();
     }
-    case OP_GET_UPVALUE: {
+    VM_CASE(OP_GET_UPVALUE) {
       uint8_t slot = readByte();
       pushValue(*frame->closure->upvalues[slot]->location);
-      break;
+      VM_NEXT();
     }
-    case OP_SET_UPVALUE: {
-      uint8_t slot = readByte();
-      *frame->closure->upvalues[slot]->location = vm.stackTop[-1];
-      break;
+    VM_CASE(OP_SET_UPVALUE) {
+      ObjUpvalue *upvalue = frame->closure->upvalues[readByte()];
+      *upvalue->location = vm.stackTop[-1];
+      vm.heap.writeBarrier(upvalue, vm.stackTop[-1]);
+      VM_NEXT();
     }
-    case OP_GET_PROPERTY: {
-      if (!isInstance(peek(vm, 0))) {
-        runtimeError(vm, "Only instances have properties.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-
-      ObjInstance *instance = asInstance(peek(vm, 0));
+    VM_CASE(OP_GET_PROPERTY) {
       uint8_t constant = readByte();
-      Chunk *chunk = &frame->closure->function->chunk;
-      ObjString *name = asString(chunk->constantAt(constant));
-      InlineCache *cache = &chunk->inlineCache(constant);
-
-      if (cache->kind == CACHE_FIELD && cache->key == name &&
-          cache->ownerClass == instance->klass &&
-          cache->secondaryVersion == instance->klass->fieldVersion &&
-          cache->entryIndex >= 0) {
-        Value fieldValue;
-        if (readInstanceField(instance, cache->entryIndex, &fieldValue)) {
-          recordFieldCacheHit(vm);
-          vm.stackTop[-1] = fieldValue;
-          break;
-        }
-      }
-
-      recordFieldCacheMiss(vm);
-      int fieldSlot = -1;
-      Value fieldValue;
-      if (getFieldSlot(instance->klass, name, &fieldSlot) &&
-          readInstanceField(instance, fieldSlot, &fieldValue)) {
-        cache->kind = CACHE_FIELD;
-        cache->key = name;
-        cache->ownerClass = instance->klass;
-        cache->entry = nullptr;
-        cache->entryIndex = fieldSlot;
-        cache->tableVersion = 0;
-        cache->secondaryVersion = instance->klass->fieldVersion;
-        vm.stackTop[-1] = fieldValue;
-        break;
-      }
-
-      if (!bindMethodCached(vm, instance->klass, name, cache)) {
+      if (!getProperty(constant, ip - 2, OP_GET_FIELD_SLOT))
         return INTERPRET_RUNTIME_ERROR;
-      }
-      break;
+      VM_NEXT();
     }
-    case OP_SET_PROPERTY: {
+    VM_CASE(OP_SET_PROPERTY) {
       if (!isInstance(peek(vm, 1))) {
+        storeIp();
         runtimeError(vm, "Only instances have fields.");
         return INTERPRET_RUNTIME_ERROR;
       }
 
       ObjInstance *instance = asInstance(peek(vm, 1));
-      int fieldSlot = ensureFieldSlot(instance->klass, readString());
-      writeInstanceField(instance, fieldSlot, peek(vm, 0));
+      int fieldSlot = ensureFieldSlot(vm, instance->klass, readString());
+      writeInstanceField(vm, instance, fieldSlot, peek(vm, 0));
       Value value = popValue();
       popValue();
       pushValue(value);
-      break;
+      VM_NEXT();
     }
-    case OP_GET_SUPER: {
-      ObjString *name = readString();
+    VM_CASE(OP_GET_SUPER) {
+      uint8_t constant = readByte();
+      Chunk *chunk = &frame->closure->function->chunk;
+      ObjString *name = asString(chunk->constantAt(constant));
       ObjClass *superclass = asClass(popValue());
 
-      if (!bindMethod(vm, superclass, name)) {
+      storeIp();
+      if (!bindMethodCached(vm, superclass, name,
+                            &chunk->inlineCache(constant))) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
+      VM_NEXT();
     }
-    case OP_EQUAL: {
-      bool equal = valuesEqual(vm.stackTop[-2], vm.stackTop[-1]);
+    VM_CASE(OP_EQUAL) {
+      bool equal = valuesEqual(vm, vm.stackTop[-2], vm.stackTop[-1]);
       vm.stackTop[-2] = boolValue(equal);
       vm.stackTop--;
-      break;
+      VM_NEXT();
     }
-    case OP_GREATER:
+    VM_CASE(OP_GREATER)
       if (!binaryOp(boolValue, [](double a, double b) { return a > b; }))
         return INTERPRET_RUNTIME_ERROR;
-      break;
-    case OP_LESS:
+      VM_NEXT();
+    VM_CASE(OP_LESS)
       if (!binaryOp(boolValue, [](double a, double b) { return a < b; }))
         return INTERPRET_RUNTIME_ERROR;
-      break;
+      VM_NEXT();
 
-    case OP_ADD: {
+    VM_CASE(OP_ADD) {
       Value bValue = vm.stackTop[-1];
       Value aValue = vm.stackTop[-2];
-      if (isString(bValue) && isString(aValue)) {
-        concatenate(vm);
-      } else if (isNumber(bValue) && isNumber(aValue)) {
-        vm.stackTop[-2] = numberValue(asNumber(aValue) + asNumber(bValue));
-        vm.stackTop--;
-      } else {
-        runtimeError(vm, "Operands must be two numbers or two strings.");
-        return INTERPRET_RUNTIME_ERROR;
+      if (isNumber(aValue) && isNumber(bValue)) {
+        quicken(ip - 1, OP_ADD_NUM);
+      } else if (isStringOrRope(aValue) && isStringOrRope(bValue)) {
+        quicken(ip - 1, OP_ADD_STR);
       }
-      break;
+      if (!addValues())
+        return INTERPRET_RUNTIME_ERROR;
+      VM_NEXT();
     }
-    case OP_SUBTRACT:
+    VM_CASE(OP_SUBTRACT)
       if (!binaryOp(numberValue, [](double a, double b) { return a - b; }))
         return INTERPRET_RUNTIME_ERROR;
-      break;
-    case OP_MULTIPLY:
+      VM_NEXT();
+    VM_CASE(OP_MULTIPLY)
       if (!binaryOp(numberValue, [](double a, double b) { return a * b; }))
         return INTERPRET_RUNTIME_ERROR;
-      break;
-    case OP_DIVIDE:
+      VM_NEXT();
+    VM_CASE(OP_DIVIDE)
       if (!binaryOp(numberValue, [](double a, double b) { return a / b; }))
         return INTERPRET_RUNTIME_ERROR;
-      break;
-    case OP_NOT:
+      VM_NEXT();
+    VM_CASE(OP_NOT)
       vm.stackTop[-1] = boolValue(isFalsey(vm.stackTop[-1]));
-      break;
-    case OP_NEGATE:
+      VM_NEXT();
+    VM_CASE(OP_NEGATE)
       if (!isNumber(vm.stackTop[-1])) {
+        storeIp();
         runtimeError(vm, "Operand must be a number.");
         return INTERPRET_RUNTIME_ERROR;
       }
       vm.stackTop[-1] = numberValue(-asNumber(vm.stackTop[-1]));
-      break;
-    case OP_PRINT: {
+      VM_NEXT();
+    VM_CASE(OP_PRINT) {
       printValue(std::cout, popValue());
       std::cout << '\n';
-      break;
+      VM_NEXT();
     }
-    case OP_JUMP: {
+    VM_CASE(OP_JUMP) {
       uint16_t offset = readShort();
 
-      frame->ip += offset;
-      break;
+      ip += offset;
+      VM_NEXT();
     }
-    case OP_JUMP_IF_FALSE: {
+    VM_CASE(OP_JUMP_IF_FALSE) {
       uint16_t offset = readShort();
 
       if (isFalsey(peek(vm, 0)))
-        frame->ip += offset;
-      break;
+        ip += offset;
+      VM_NEXT();
     }
-    case OP_LOOP: {
+    VM_CASE(OP_LOOP) {
       uint16_t offset = readShort();
 
-      frame->ip -= offset;
-      break;
+      ip -= offset;
+      safepoint(vm, ip);
+      VM_NEXT();
     }
-    case OP_CALL: {
+    VM_CASE(OP_CALL) {
       int argCount = readByte();
+      storeIp();
+      safepoint(vm, ip);
       if (!callValue(vm, peek(vm, argCount), argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      loadFrame();
+      VM_NEXT();
     }
-    case OP_INVOKE: {
+    VM_CASE(OP_INVOKE) {
       uint8_t constant = readByte();
       Chunk *chunk = &frame->closure->function->chunk;
-      ObjString *method = asString(chunk->constantAt(constant));
       int argCount = readByte();
+      storeIp();
+      safepoint(vm, ip);
+      ObjString *method = asString(chunk->constantAt(constant));
       if (!invoke(vm, method, argCount, &chunk->inlineCache(constant))) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      loadFrame();
+      VM_NEXT();
     }
-    case OP_SUPER_INVOKE: {
+    VM_CASE(OP_SUPER_INVOKE) {
       uint8_t constant = readByte();
       Chunk *chunk = &frame->closure->function->chunk;
+      int argCount = readByte();
+      storeIp();
+      safepoint(vm, ip);
       ObjString *method = asString(chunk->constantAt(constant));
+      ObjClass *superclass = asClass(popValue());
+      if (!invokeFromClass(vm, superclass, method, argCount,
+                           &chunk->inlineCache(constant))) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      loadFrame();
+      VM_NEXT();
+    }
+    VM_CASE(OP_TAIL_CALL) {
+      int argCount = readByte();
+      storeIp();
+      safepoint(vm, ip);
+      int frameCount = vm.frameCount;
+      if (!callValue(vm, peek(vm, argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (vm.frameCount > frameCount)
+        replaceCallerFrame(vm);
+      loadFrame();
+      VM_NEXT();
+    }
+    VM_CASE(OP_TAIL_INVOKE) {
+      uint8_t constant = readByte();
+      Chunk *chunk = &frame->closure->function->chunk;
+      int argCount = readByte();
+      storeIp();
+      safepoint(vm, ip);
+      ObjString *method = asString(chunk->constantAt(constant));
+      int frameCount = vm.frameCount;
+      if (!invoke(vm, method, argCount, &chunk->inlineCache(constant))) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (vm.frameCount > frameCount)
+        replaceCallerFrame(vm);
+      loadFrame();
+      VM_NEXT();
+    }
+    VM_CASE(OP_TAIL_SUPER_INVOKE) {
+      uint8_t constant = readByte();
+      Chunk *chunk = &frame->closure->function->chunk;
       int argCount = readByte();
+      storeIp();
+      safepoint(vm, ip);
+      ObjString *method = asString(chunk->constantAt(constant));
       ObjClass *superclass = asClass(popValue());
       if (!invokeFromClass(vm, superclass, method, argCount,
                            &chunk->inlineCache(constant))) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      replaceCallerFrame(vm);
+      loadFrame();
+      VM_NEXT();
     }
-    case OP_CLOSURE: {
+    VM_CASE(OP_CLOSURE) {
       ObjFunction *function = asFunction(readConstant());
       ObjClosure *closure = vm.newClosure(function);
       pushValue(objectValue(closure));
@@ -979,13 +1659,13 @@ static InterpretResult run(Vm &vm) {
           closure->upvalues[i] = frame->closure->upvalues[index];
         }
       }
-      break;
+      VM_NEXT();
     }
-    case OP_CLOSE_UPVALUE:
+    VM_CASE(OP_CLOSE_UPVALUE)
       closeUpvalues(vm, vm.stackTop - 1);
       vm.stackTop--;
-      break;
-    case OP_RETURN: {
+      VM_NEXT();
+    VM_CASE(OP_RETURN) {
 
       Value result = popValue();
       closeUpvalues(vm, frame->slots);
@@ -997,15 +1677,16 @@ static InterpretResult run(Vm &vm) {
 
       vm.stackTop = frame->slots;
       pushValue(result);
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      loadFrame();
+      VM_NEXT();
     }
-    case OP_CLASS:
+    VM_CASE(OP_CLASS)
       pushValue(objectValue(vm.newClass(readString())));
-      break;
-    case OP_INHERIT: {
+      VM_NEXT();
+    VM_CASE(OP_INHERIT) {
       Value superclass = peek(vm, 1);
       if (!isClass(superclass)) {
+        storeIp();
         runtimeError(vm, "Superclass must be a class.");
         return INTERPRET_RUNTIME_ERROR;
       }
@@ -1014,25 +1695,672 @@ static InterpretResult run(Vm &vm) {
       ObjClass *superKlass = asClass(superclass);
       subclass->methods.addAllFrom(superKlass->methods);
       subclass->initializer = superKlass->initializer;
+      vm.heap.shade(superKlass);
       vm.stackTop--;
-      break;
+      VM_NEXT();
     }
-    case OP_METHOD:
+    VM_CASE(OP_METHOD)
       defineMethod(vm, readString());
-      break;
+      VM_NEXT();
+    VM_CASE(OP_GET_LOCAL_PROPERTY) {
+      uint8_t slot = readByte();
+      uint8_t constant = readByte();
+
+      pushValue(frame->slots[slot]);
+      if (!getProperty(constant, ip - 3, OP_GET_LOCAL_FIELD_SLOT))
+        return INTERPRET_RUNTIME_ERROR;
+      VM_NEXT();
+    }
+    VM_CASE(OP_ADD_LOCAL_CONSTANT) {
+      Value aValue = frame->slots[readByte()];
+      Value bValue = readConstant();
+      if (isNumber(aValue) && isNumber(bValue)) {
+        pushValue(numberValue(asNumber(aValue) + asNumber(bValue)));
+        VM_NEXT();
+      }
+      pushValue(aValue);
+      pushValue(bValue);
+      if (!addValues())
+        return INTERPRET_RUNTIME_ERROR;
+      VM_NEXT();
+    }
+    VM_CASE(OP_SUBTRACT_LOCAL_CONSTANT) {
+      pushValue(frame->slots[readByte()]);
+      pushValue(readConstant());
+      if (!binaryOp(numberValue, [](double a, double b) { return a - b; }))
+        return INTERPRET_RUNTIME_ERROR;
+      VM_NEXT();
+    }
+    VM_CASE(OP_LESS_LOCAL_CONSTANT) {
+      pushValue(frame->slots[readByte()]);
+      pushValue(readConstant());
+      if (!binaryOp(boolValue, [](double a, double b) { return a < b; }))
+        return INTERPRET_RUNTIME_ERROR;
+      VM_NEXT();
+    }
+    VM_CASE(OP_EQUAL_JUMP_IF_FALSE) {
+      uint16_t offset = readShort();
+      bool equal = valuesEqual(vm, vm.stackTop[-2], vm.stackTop[-1]);
+      vm.stackTop[-2] = boolValue(equal);
+      vm.stackTop--;
+      if (!equal)
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(OP_GREATER_JUMP_IF_FALSE) {
+      uint16_t offset = readShort();
+      if (!binaryOp(boolValue, [](double a, double b) { return a > b; }))
+        return INTERPRET_RUNTIME_ERROR;
+      if (isFalsey(peek(vm, 0)))
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(OP_LESS_JUMP_IF_FALSE) {
+      uint16_t offset = readShort();
+      if (!binaryOp(boolValue, [](double a, double b) { return a < b; }))
+        return INTERPRET_RUNTIME_ERROR;
+      if (isFalsey(peek(vm, 0)))
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(OP_NOT_EQUAL) {
+      bool equal = valuesEqual(vm, vm.stackTop[-2], vm.stackTop[-1]);
+      vm.stackTop[-2] = boolValue(!equal);
+      vm.stackTop--;
+      VM_NEXT();
+    }
+    VM_CASE(OP_NOT_GREATER)
+      if (!binaryOp(boolValue, [](double a, double b) { return !(a > b); }))
+        return INTERPRET_RUNTIME_ERROR;
+      VM_NEXT();
+    VM_CASE(OP_NOT_LESS)
+      if (!binaryOp(boolValue, [](double a, double b) { return !(a < b); }))
+        return INTERPRET_RUNTIME_ERROR;
+      VM_NEXT();
+    VM_CASE(OP_NOT_EQUAL_JUMP_IF_FALSE) {
+      uint16_t offset = readShort();
+      bool equal = valuesEqual(vm, vm.stackTop[-2], vm.stackTop[-1]);
+      vm.stackTop[-2] = boolValue(!equal);
+      vm.stackTop--;
+      if (equal)
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(OP_NOT_GREATER_JUMP_IF_FALSE) {
+      uint16_t offset = readShort();
+      if (!binaryOp(boolValue, [](double a, double b) { return !(a > b); }))
+        return INTERPRET_RUNTIME_ERROR;
+      if (isFalsey(peek(vm, 0)))
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(OP_NOT_LESS_JUMP_IF_FALSE) {
+      uint16_t offset = readShort();
+      if (!binaryOp(boolValue, [](double a, double b) { return !(a < b); }))
+        return INTERPRET_RUNTIME_ERROR;
+      if (isFalsey(peek(vm, 0)))
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(OP_ADD_NUM) {
+      Value bValue = vm.stackTop[-1];
+      Value aValue = vm.stackTop[-2];
+      if (isNumber(aValue) && isNumber(bValue)) {
+        vm.stackTop[-2] = numberValue(asNumber(aValue) + asNumber(bValue));
+        vm.stackTop--;
+        VM_NEXT();
+      }
+      deoptimize(ip - 1, OP_ADD);
+      if (!addValues())
+        return INTERPRET_RUNTIME_ERROR;
+      VM_NEXT();
+    }
+    VM_CASE(OP_ADD_STR)
+      if (isStringOrRope(vm.stackTop[-1]) && isStringOrRope(vm.stackTop[-2])) {
+        concatenate(vm);
+        VM_NEXT();
+      }
+      deoptimize(ip - 1, OP_ADD);
+      if (!addValues())
+        return INTERPRET_RUNTIME_ERROR;
+      VM_NEXT();
+    VM_CASE(OP_GET_FIELD_SLOT) {
+      uint8_t constant = readByte();
+      if (readCachedField(constant))
+        VM_NEXT();
+      deoptimize(ip - 2, OP_GET_PROPERTY);
+      if (!getProperty(constant, nullptr, OP_GET_FIELD_SLOT))
+        return INTERPRET_RUNTIME_ERROR;
+      VM_NEXT();
+    }
+    VM_CASE(OP_GET_LOCAL_FIELD_SLOT) {
+      uint8_t slot = readByte();
+      uint8_t constant = readByte();
+
+      pushValue(frame->slots[slot]);
+      if (readCachedField(constant))
+        VM_NEXT();
+      deoptimize(ip - 3, OP_GET_LOCAL_PROPERTY);
+      if (!getProperty(constant, nullptr, OP_GET_LOCAL_FIELD_SLOT))
+        return INTERPRET_RUNTIME_ERROR;
+      VM_NEXT();
+    }
+    }
+  }
+}
+
+// Pushes a register-tier frame whose slot 0 is the callee and whose
+// parameters are already in place. Registers past the parameters are cleared
+// so the collector never sees stale values below stackTop.
+static bool callRegisters(Vm &vm, ObjClosure *closure, Value *slots,
+                          int argCount) {
+  ObjFunction *function = closure->function;
+  if (argCount != function->arity) {
+    runtimeError(vm, "Expected ", function->arity, " arguments but got ",
+                 argCount, ".");
+    return false;
+  }
+
+  size_t base = static_cast<size_t>(slots - vm.stack.data());
+  if (!reserveFrame(vm, function->registerCount))
+    return false;
+  slots = vm.stack.data() + base;
+
+  CallFrame *frame = &vm.frames[vm.frameCount++];
+  frame->closure = closure;
+  frame->ip = function->chunk.codeData();
+  frame->slots = slots;
+
+  Value *end = slots + function->registerCount;
+  for (Value *slot = slots + argCount + 1; slot < end; slot++) {
+    *slot = nilValue();
+  }
+  vm.stackTop = end;
+  return true;
+}
+
+#undef VM_FETCH
+#define VM_FETCH()                                                             \
+  do {                                                                         \
+    traceRegisterExecution(vm, frame, ip);                                     \
+    instruction = readByte();                                                  \
+    recordRegisterInstruction(vm, instruction);                                \
+  } while (false)
+
+// The global a register instruction names, looked up when the site's inline
+// cache misses. ip is only stored to report an undefined variable.
+static Entry *refillRegisterGlobal(Vm &vm, CallFrame *frame, uint8_t *ip,
+                                   uint8_t constant) {
+  Chunk &chunk = frame->closure->function->chunk;
+  ObjString *name = asString(chunk.constantAt(constant));
+  recordGlobalCacheMiss(vm);
+  Entry *entry = vm.globals.getEntry(name);
+  if (entry == nullptr) {
+    frame->ip = ip;
+    runtimeError(vm, "Undefined variable '", name->chars, "'.");
+    return nullptr;
+  }
+  InlineCache *cache = &chunk.inlineCache(constant);
+  cache->key = name;
+  cache->entry = entry;
+  cache->tableVersion = vm.globals.version();
+  return entry;
+}
+
+// The cache hit path of a register instruction's global.
+//
+// This and the other register helpers below take ip by value instead of
+// being lambdas in runRegisters. A lambda shared by several handlers is not
+// always inlined, and capturing ip by reference would then keep ip in memory
+// for the whole loop.
+static Entry *registerGlobalEntry(Vm &vm, CallFrame *frame,
+                                  const Value *constants, uint8_t *ip,
+                                  uint8_t constant) {
+  InlineCache *cache = &frame->closure->function->chunk.inlineCache(constant);
+  if (cache->key == asString(constants[constant]) &&
+      cache->tableVersion == vm.globals.version() &&
+      cache->entry != nullptr) [[likely]] {
+    recordGlobalCacheHit(vm);
+    return cache->entry;
+  }
+  return refillRegisterGlobal(vm, frame, ip, constant);
+}
+
+static bool registerNumberOperands(Vm &vm, CallFrame *frame, uint8_t *ip,
+                                   Value a, Value b) {
+  if (isNumber(a) && isNumber(b))
+    return true;
+  frame->ip = ip;
+  runtimeError(vm, "Operands must be numbers.");
+  return false;
+}
+static bool registerAdd(Vm &vm, CallFrame *frame, uint8_t *ip, Value a,
+                        Value b, Value *result) {
+  if (isNumber(a) && isNumber(b)) {
+    *result = numberValue(asNumber(a) + asNumber(b));
+  } else if (isStringOrRope(a) && isStringOrRope(b)) {
+    vm.push(a);
+    vm.push(b);
+    concatenate(vm);
+    *result = vm.pop();
+  } else {
+    frame->ip = ip;
+    runtimeError(vm, "Operands must be two numbers or two strings.");
+    return false;
+  }
+  return true;
+}
+
+// Run loop for code from compileRegisters(). Operands name frame slots
+// directly, so values move between registers without going through
+// vm.stackTop; stackTop only marks the end of the current frame for the
+// collector.
+static InterpretResult runRegisters(Vm &vm) {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  uint8_t *ip = frame->ip;
+  Value *slots = frame->slots;
+  Value *constants = frame->closure->function->chunk.constantsData();
+
+  auto readByte = [&]() -> uint8_t { return *ip++; };
+  auto readShort = [&]() -> uint16_t {
+    ip += 2;
+    return static_cast<uint16_t>((ip[-2] << 8) | ip[-1]);
+  };
+  auto storeIp = [&]() { frame->ip = ip; };
+  auto loadFrame = [&]() {
+    frame = &vm.frames[vm.frameCount - 1];
+    ip = frame->ip;
+    slots = frame->slots;
+    constants = frame->closure->function->chunk.constantsData();
+  };
+#ifdef CPPLOX_COMPUTED_GOTO
+  // Indexed by opcode byte, so the order must follow RegisterOpcode.
+  static void *const dispatchTable[] = {
+      &&target_ROP_MOVE,
+      &&target_ROP_LOAD_CONSTANT,
+      &&target_ROP_LOAD_NIL,
+      &&target_ROP_LOAD_TRUE,
+      &&target_ROP_LOAD_FALSE,
+      &&target_ROP_GET_GLOBAL,
+      &&target_ROP_DEFINE_GLOBAL,
+      &&target_ROP_SET_GLOBAL,
+      &&target_ROP_EQUAL,
+      &&target_ROP_GREATER,
+      &&target_ROP_LESS,
+      &&target_ROP_ADD,
+      &&target_ROP_SUBTRACT,
+      &&target_ROP_MULTIPLY,
+      &&target_ROP_DIVIDE,
+      &&target_ROP_ADD_CONSTANT,
+      &&target_ROP_SUBTRACT_CONSTANT,
+      &&target_ROP_NOT,
+      &&target_ROP_NEGATE,
+      &&target_ROP_PRINT,
+      &&target_ROP_JUMP,
+      &&target_ROP_LOOP,
+      &&target_ROP_JUMP_IF_FALSE,
+      &&target_ROP_JUMP_IF_TRUE,
+      &&target_ROP_JUMP_IF_NOT_EQUAL,
+      &&target_ROP_JUMP_IF_EQUAL,
+      &&target_ROP_JUMP_IF_NOT_LESS,
+      &&target_ROP_JUMP_IF_LESS,
+      &&target_ROP_JUMP_IF_NOT_GREATER,
+      &&target_ROP_JUMP_IF_GREATER,
+      &&target_ROP_JUMP_IF_NOT_LESS_CONSTANT,
+      &&target_ROP_JUMP_IF_NOT_GREATER_CONSTANT,
+      &&target_ROP_CALL_GLOBAL,
+      &&target_ROP_CALL,
+      &&target_ROP_CLOSURE,
+      &&target_ROP_RETURN,
+  };
+  static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == ROP_COUNT,
+                "dispatch table must cover every register opcode");
+#endif
+
+  uint8_t instruction;
+  for (;;) {
+    VM_FETCH();
+    switch (instruction) {
+    VM_CASE(ROP_MOVE) {
+      uint8_t a = readByte();
+      slots[a] = slots[readByte()];
+      VM_NEXT();
+    }
+    VM_CASE(ROP_LOAD_CONSTANT) {
+      uint8_t a = readByte();
+      slots[a] = constants[readByte()];
+      VM_NEXT();
+    }
+    VM_CASE(ROP_LOAD_NIL)
+      slots[readByte()] = nilValue();
+      VM_NEXT();
+    VM_CASE(ROP_LOAD_TRUE)
+      slots[readByte()] = boolValue(true);
+      VM_NEXT();
+    VM_CASE(ROP_LOAD_FALSE)
+      slots[readByte()] = boolValue(false);
+      VM_NEXT();
+    VM_CASE(ROP_GET_GLOBAL) {
+      uint8_t a = readByte();
+      uint8_t constant = readByte();
+      Entry *entry = registerGlobalEntry(vm, frame, constants, ip, constant);
+      if (entry == nullptr)
+        return INTERPRET_RUNTIME_ERROR;
+      slots[a] = entry->value;
+      VM_NEXT();
+    }
+    VM_CASE(ROP_DEFINE_GLOBAL) {
+      uint8_t a = readByte();
+      uint8_t constant = readByte();
+      ObjString *name = asString(constants[constant]);
+      vm.globals.set(name, slots[a]);
+      vm.heap.globalWriteBarrier(slots[a]);
+      InlineCache *cache = &frame->closure->function->chunk.inlineCache(constant);
+      cache->key = name;
+      cache->entry = vm.globals.getEntry(name);
+      cache->tableVersion = vm.globals.version();
+      VM_NEXT();
+    }
+    VM_CASE(ROP_SET_GLOBAL) {
+      uint8_t a = readByte();
+      uint8_t constant = readByte();
+      Entry *entry = registerGlobalEntry(vm, frame, constants, ip, constant);
+      if (entry == nullptr)
+        return INTERPRET_RUNTIME_ERROR;
+      entry->value = slots[a];
+      vm.heap.globalWriteBarrier(slots[a]);
+      VM_NEXT();
+    }
+    VM_CASE(ROP_EQUAL) {
+      uint8_t a = readByte();
+      Value b = slots[readByte()];
+      Value c = slots[readByte()];
+      slots[a] = boolValue(valuesEqual(vm, b, c));
+      VM_NEXT();
+    }
+    VM_CASE(ROP_GREATER) {
+      uint8_t a = readByte();
+      Value b = slots[readByte()];
+      Value c = slots[readByte()];
+      if (!registerNumberOperands(vm, frame, ip, b, c))
+        return INTERPRET_RUNTIME_ERROR;
+      slots[a] = boolValue(asNumber(b) > asNumber(c));
+      VM_NEXT();
+    }
+    VM_CASE(ROP_LESS) {
+      uint8_t a = readByte();
+      Value b = slots[readByte()];
+      Value c = slots[readByte()];
+      if (!registerNumberOperands(vm, frame, ip, b, c))
+        return INTERPRET_RUNTIME_ERROR;
+      slots[a] = boolValue(asNumber(b) < asNumber(c));
+      VM_NEXT();
+    }
+    VM_CASE(ROP_ADD) {
+      uint8_t a = readByte();
+      Value b = slots[readByte()];
+      Value c = slots[readByte()];
+      if (!registerAdd(vm, frame, ip, b, c, &slots[a]))
+        return INTERPRET_RUNTIME_ERROR;
+      VM_NEXT();
+    }
+    VM_CASE(ROP_SUBTRACT) {
+      uint8_t a = readByte();
+      Value b = slots[readByte()];
+      Value c = slots[readByte()];
+      if (!registerNumberOperands(vm, frame, ip, b, c))
+        return INTERPRET_RUNTIME_ERROR;
+      slots[a] = numberValue(asNumber(b) - asNumber(c));
+      VM_NEXT();
+    }
+    VM_CASE(ROP_MULTIPLY) {
+      uint8_t a = readByte();
+      Value b = slots[readByte()];
+      Value c = slots[readByte()];
+      if (!registerNumberOperands(vm, frame, ip, b, c))
+        return INTERPRET_RUNTIME_ERROR;
+      slots[a] = numberValue(asNumber(b) * asNumber(c));
+      VM_NEXT();
+    }
+    VM_CASE(ROP_DIVIDE) {
+      uint8_t a = readByte();
+      Value b = slots[readByte()];
+      Value c = slots[readByte()];
+      if (!registerNumberOperands(vm, frame, ip, b, c))
+        return INTERPRET_RUNTIME_ERROR;
+      slots[a] = numberValue(asNumber(b) / asNumber(c));
+      VM_NEXT();
+    }
+    VM_CASE(ROP_ADD_CONSTANT) {
+      uint8_t a = readByte();
+      Value b = slots[readByte()];
+      Value c = constants[readByte()];
+      if (!registerAdd(vm, frame, ip, b, c, &slots[a]))
+        return INTERPRET_RUNTIME_ERROR;
+      VM_NEXT();
+    }
+    VM_CASE(ROP_SUBTRACT_CONSTANT) {
+      uint8_t a = readByte();
+      Value b = slots[readByte()];
+      Value c = constants[readByte()];
+      if (!registerNumberOperands(vm, frame, ip, b, c))
+        return INTERPRET_RUNTIME_ERROR;
+      slots[a] = numberValue(asNumber(b) - asNumber(c));
+      VM_NEXT();
+    }
+    VM_CASE(ROP_NOT) {
+      uint8_t a = readByte();
+      slots[a] = boolValue(isFalsey(slots[readByte()]));
+      VM_NEXT();
+    }
+    VM_CASE(ROP_NEGATE) {
+      uint8_t a = readByte();
+      Value b = slots[readByte()];
+      if (!isNumber(b)) {
+        storeIp();
+        runtimeError(vm, "Operand must be a number.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      slots[a] = numberValue(-asNumber(b));
+      VM_NEXT();
+    }
+    VM_CASE(ROP_PRINT)
+      printValue(std::cout, slots[readByte()]);
+      std::cout << '\n';
+      VM_NEXT();
+    VM_CASE(ROP_JUMP) {
+      uint16_t offset = readShort();
+      ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(ROP_LOOP) {
+      uint16_t offset = readShort();
+      ip -= offset;
+      safepoint(vm, ip);
+      VM_NEXT();
+    }
+    VM_CASE(ROP_JUMP_IF_FALSE) {
+      Value a = slots[readByte()];
+      uint16_t offset = readShort();
+      if (isFalsey(a))
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(ROP_JUMP_IF_TRUE) {
+      Value a = slots[readByte()];
+      uint16_t offset = readShort();
+      if (!isFalsey(a))
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(ROP_JUMP_IF_NOT_EQUAL) {
+      Value b = slots[readByte()];
+      Value c = slots[readByte()];
+      uint16_t offset = readShort();
+      if (!valuesEqual(vm, b, c))
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(ROP_JUMP_IF_EQUAL) {
+      Value b = slots[readByte()];
+      Value c = slots[readByte()];
+      uint16_t offset = readShort();
+      if (valuesEqual(vm, b, c))
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(ROP_JUMP_IF_NOT_LESS) {
+      Value b = slots[readByte()];
+      Value c = slots[readByte()];
+      uint16_t offset = readShort();
+      if (!registerNumberOperands(vm, frame, ip, b, c))
+        return INTERPRET_RUNTIME_ERROR;
+      if (!(asNumber(b) < asNumber(c)))
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(ROP_JUMP_IF_LESS) {
+      Value b = slots[readByte()];
+      Value c = slots[readByte()];
+      uint16_t offset = readShort();
+      if (!registerNumberOperands(vm, frame, ip, b, c))
+        return INTERPRET_RUNTIME_ERROR;
+      if (asNumber(b) < asNumber(c))
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(ROP_JUMP_IF_NOT_GREATER) {
+      Value b = slots[readByte()];
+      Value c = slots[readByte()];
+      uint16_t offset = readShort();
+      if (!registerNumberOperands(vm, frame, ip, b, c))
+        return INTERPRET_RUNTIME_ERROR;
+      if (!(asNumber(b) > asNumber(c)))
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(ROP_JUMP_IF_GREATER) {
+      Value b = slots[readByte()];
+      Value c = slots[readByte()];
+      uint16_t offset = readShort();
+      if (!registerNumberOperands(vm, frame, ip, b, c))
+        return INTERPRET_RUNTIME_ERROR;
+      if (asNumber(b) > asNumber(c))
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(ROP_JUMP_IF_NOT_LESS_CONSTANT) {
+      Value b = slots[readByte()];
+      Value c = constants[readByte()];
+      uint16_t offset = readShort();
+      if (!registerNumberOperands(vm, frame, ip, b, c))
+        return INTERPRET_RUNTIME_ERROR;
+      if (!(asNumber(b) < asNumber(c)))
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(ROP_JUMP_IF_NOT_GREATER_CONSTANT) {
+      Value b = slots[readByte()];
+      Value c = constants[readByte()];
+      uint16_t offset = readShort();
+      if (!registerNumberOperands(vm, frame, ip, b, c))
+        return INTERPRET_RUNTIME_ERROR;
+      if (!(asNumber(b) > asNumber(c)))
+        ip += offset;
+      VM_NEXT();
+    }
+    VM_CASE(ROP_CALL_GLOBAL) {
+      uint8_t constant = readByte();
+      Entry *entry = registerGlobalEntry(vm, frame, constants, ip, constant);
+      if (entry == nullptr)
+        return INTERPRET_RUNTIME_ERROR;
+      // The rest of the instruction is a ROP_CALL's operands.
+      slots[ip[0]] = entry->value;
+      goto callOperands;
+    }
+    VM_CASE(ROP_CALL)
+    callOperands : {
+      uint8_t a = readByte();
+      int argCount = readByte();
+      storeIp();
+      safepoint(vm, ip);
+      Value callee = slots[a];
+      if (isClosure(callee)) {
+#ifdef CPPLOX_ENABLE_VM_STATS
+        if (vm.statsEnabled)
+          vm.closureCalls++;
+#endif
+        if (!callRegisters(vm, asClosure(callee), slots + a, argCount))
+          return INTERPRET_RUNTIME_ERROR;
+        loadFrame();
+      } else if (isNative(callee)) {
+#ifdef CPPLOX_ENABLE_VM_STATS
+        if (vm.statsEnabled)
+          vm.nativeCalls++;
+#endif
+        slots[a] = asNative(callee)(vm, argCount, slots + a + 1);
+      } else {
+        runtimeError(vm, "Can only call functions and classes.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      VM_NEXT();
+    }
+    VM_CASE(ROP_CLOSURE) {
+      uint8_t a = readByte();
+      ObjFunction *function = asFunction(constants[readByte()]);
+      slots[a] = objectValue(vm.newClosure(function));
+      VM_NEXT();
+    }
+    VM_CASE(ROP_RETURN) {
+      Value result = slots[readByte()];
+      vm.frameCount--;
+      if (vm.frameCount == 0) {
+        vm.stackTop = vm.stack.data();
+        return INTERPRET_OK;
+      }
+
+      // The callee's slot 0 is the caller's call register.
+      slots[0] = result;
+      loadFrame();
+      vm.stackTop = slots + frame->closure->function->registerCount;
+      VM_NEXT();
+    }
     }
   }
 }
 
+#ifdef CPPLOX_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+#undef VM_NEXT
+#undef VM_CASE
+#undef VM_FETCH
+
 InterpretResult Vm::interpret(std::string_view source) {
   Vm &vm = *this;
 
+  if (vm.registerTier) {
+    ObjFunction *registerFunction = compileRegisters(vm, source);
+    if (registerFunction != nullptr) {
+      vm.push(objectValue(registerFunction));
+      ObjClosure *closure = vm.newClosure(registerFunction);
+      vm.stackTop[-1] = objectValue(closure);
+      if (!callRegisters(vm, closure, vm.stackTop - 1, 0))
+        return INTERPRET_RUNTIME_ERROR;
+      return runRegisters(vm);
+    }
+  }
+
   ObjFunction *function = compile(vm, source);
   if (function == nullptr)
     return INTERPRET_COMPILE_ERROR;
+  return interpret(function);
+}
 
-  vm.push(objectValue(function));
+InterpretResult Vm::interpret(ObjFunction *function) {
+  Vm &vm = *this;
 
+  vm.push(objectValue(function));
   ObjClosure *closure = vm.newClosure(function);
   vm.pop();
   vm.push(objectValue(closure));
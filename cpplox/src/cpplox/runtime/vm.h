@@ -1,18 +1,35 @@
 #pragma once
 
 #include <array>
+#include <deque>
+#include <string>
 #include <string_view>
 #include <vector>
+#ifdef CPPLOX_ENABLE_VM_STATS
+#include <unordered_map>
+#endif
 
 #include "memory.h"
 #include "object.h"
+#include "register_ops.h"
 #include "table.h"
 #include "value.h"
 
 namespace cpplox {
 
-inline constexpr int kMaxFrames = 64;
-inline constexpr int kMaxStack = kMaxFrames * kUint8Count;
+class Profiler;
+
+inline constexpr int kDefaultMaxFrames = 64 * 1024;
+// A runtime error trace deeper than twice this many frames prints only the
+// innermost and outermost kTraceEndFrames, so a runaway recursion doesn't
+// write a line per frame.
+inline constexpr int kTraceEndFrames = 16;
+inline constexpr int kInitialFrames = 16;
+// A call grows the value stack until the callee's maxStack values plus
+// kStackHeadroom fit above stackTop, so handlers can push unchecked. The
+// headroom covers the temporaries a handler or native pushes for itself.
+inline constexpr int kStackHeadroom = 4 * kUint8Count;
+inline constexpr int kInitialStack = 2 * kStackHeadroom;
 
 enum class InterpretResult : uint8_t {
   Ok,
@@ -41,6 +58,8 @@ public:
   Vm &operator=(const Vm &) = delete;
 
   InterpretResult interpret(std::string_view source);
+  // Runs an already compiled script, such as one loaded from a .loxc file.
+  InterpretResult interpret(ObjFunction *function);
   void push(Value value);
   Value pop();
 
@@ -50,12 +69,22 @@ public:
   ObjFunction *newFunction();
   ObjInstance *newInstance(ObjClass *klass);
   ObjNative *newNative(NativeFn function);
+  // Both halves must stay reachable, e.g. on the stack, until this returns.
+  ObjRope *newRope(Obj *left, Obj *right, int length);
+  // Returns the rope's text as an interned string, building it on first use.
+  // The rope must be reachable.
+  ObjString *flattenRope(ObjRope *rope);
   ObjString *takeString(char *chars, int length);
   ObjString *copyString(const char *chars, int length);
   ObjUpvalue *newUpvalue(Value *slot);
-  void addCompilerRoot(ObjFunction *function);
+  void addCompilerRoot(Obj *object);
   void popCompilerRoot();
   void markCompilerRoots();
+  void setRegisterTier(bool enabled);
+  void setMaxFrames(int limit);
+  void setLazyIntern(bool enabled);
+  void setOptimizeBytecode(bool enabled);
+  void setLazyFunctions(bool enabled);
 
 #ifdef CPPLOX_ENABLE_VM_STATS
   void setStatsEnabled(bool enabled);
@@ -63,22 +92,50 @@ public:
   void printStats() const;
 #endif
 
-  std::array<CallFrame, kMaxFrames> frames;
+  // Both grow on demand. Growing the value stack moves it, so nothing may hold
+  // a pointer into it across a call except frames, open upvalues and stackTop,
+  // which growStack() rebases.
+  std::vector<CallFrame> frames;
   int frameCount;
+  int frameCapacity;
+  int maxFrames;
 
-  std::array<Value, kMaxStack> stack;
+  std::vector<Value> stack;
   Value *stackTop;
+  // A call made with stackTop past this grows the stack first.
+  Value *stackLimit;
   Table globals;
   Table strings;
   ObjString *initString;
   ObjUpvalue *openUpvalues;
 
   Heap heap;
-  std::vector<ObjFunction *> compilerRoots;
+  // Objects being built outside the interpreter: functions under compilation
+  // and objects restored from a snapshot.
+  std::vector<Obj *> compilerRoots;
+  // Run scripts on the register tier when the register compiler accepts them.
+  bool registerTier;
+  // Concatenations at least this long become ropes, interned only when
+  // compared; --lazy-intern lowers it to zero.
+  int minRopeLength;
+  // Run the peephole optimizer over every chunk the compiler finishes;
+  // --no-optimize turns it off.
+  bool optimizeBytecode;
+  // Compile top-level function bodies on their first call (--lazy-functions).
+  // Scripts with skipped bodies stay here so the bodies can still be read.
+  bool lazyFunctions;
+  std::deque<std::string> retainedSources;
+  // Samples the call stack at safepoints while --profile is on.
+  Profiler *profiler;
 #ifdef CPPLOX_ENABLE_VM_STATS
   bool statsEnabled;
   uint64_t instructionsExecuted;
   std::array<uint64_t, OP_COUNT> opcodeCounts;
+  std::array<uint64_t, ROP_COUNT> registerOpcodeCounts;
+  std::vector<uint64_t> opcodePairCounts;
+  std::unordered_map<uint32_t, uint64_t> opcodeTripleCounts;
+  std::array<uint8_t, 2> recentOpcodes;
+  int recentOpcodeCount;
   uint64_t maxStackDepth;
   uint64_t closureCalls;
   uint64_t nativeCalls;
@@ -91,6 +148,8 @@ public:
   uint64_t methodCacheMisses;
   uint64_t fieldCacheHits;
   uint64_t fieldCacheMisses;
+  uint64_t quickenings;
+  uint64_t deoptimizations;
 #endif
 
 private:
@@ -98,4 +157,8 @@ private:
   void shutdown();
 };
 
+// The built-in natives, which heap snapshots refer to by name.
+const char *nativeName(NativeFn function);
+NativeFn findNative(std::string_view name);
+
 } // namespace cpplox
@@ -0,0 +1,86 @@
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+#ifdef _WIN32
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "binary_io.h"
+
+namespace cpplox {
+
+uint64_t checksum(const void *data, size_t size) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+MappedFile::MappedFile(const std::string &path) {
+#ifdef _WIN32
+  std::ifstream file(path, std::ios::binary);
+  if (file) {
+    contents_.assign(std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>());
+    data_ = contents_.data();
+    size_ = contents_.size();
+  }
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat status;
+  if (fstat(fd, &status) == 0 && status.st_size > 0) {
+    void *mapped = mmap(nullptr, static_cast<size_t>(status.st_size),
+                        PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped != MAP_FAILED) {
+      data_ = static_cast<const uint8_t *>(mapped);
+      size_ = static_cast<size_t>(status.st_size);
+    }
+  }
+  close(fd);
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+  if (data_ != nullptr)
+    munmap(const_cast<uint8_t *>(data_), size_);
+#endif
+}
+
+bool writeFileAtomically(const std::string &path,
+                         const std::string &contents) {
+  std::string temporary =
+      path + "." + std::to_string(std::random_device{}()) + ".tmp";
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    if (!file)
+      return false;
+    file.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+    if (!file) {
+      file.close();
+      std::remove(temporary.c_str());
+      return false;
+    }
+  }
+#ifdef _WIN32
+  std::remove(path.c_str());
+#endif
+  if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+} // namespace cpplox
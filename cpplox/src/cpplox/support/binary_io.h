@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace cpplox {
+
+// Little helpers for cpplox's on-disk formats, which are written and read by
+// the same build on the same machine, so values are stored in native layout.
+class BinaryWriter {
+public:
+  template <typename T> void put(T value) {
+    const char *bytes = reinterpret_cast<const char *>(&value);
+    buffer_.append(bytes, sizeof(T));
+  }
+  void putBytes(const void *bytes, size_t size) {
+    buffer_.append(static_cast<const char *>(bytes), size);
+  }
+  size_t size() const { return buffer_.size(); }
+  // Overwrites a value put earlier, such as a length written before its data.
+  template <typename T> void patch(size_t offset, T value) {
+    std::memcpy(buffer_.data() + offset, &value, sizeof(T));
+  }
+  const std::string &buffer() const { return buffer_; }
+
+private:
+  std::string buffer_;
+};
+
+// Every read is bounds-checked; after the first failure ok() stays false and
+// reads return zeros.
+class BinaryReader {
+public:
+  BinaryReader(const uint8_t *data, size_t size)
+      : start_(data), cursor_(data), end_(data + size) {}
+
+  template <typename T> T get() {
+    T value{};
+    if (const uint8_t *bytes = take(sizeof(T)))
+      std::memcpy(&value, bytes, sizeof(T));
+    return value;
+  }
+  const uint8_t *take(size_t size) {
+    if (!ok_ || static_cast<size_t>(end_ - cursor_) < size) {
+      ok_ = false;
+      return nullptr;
+    }
+    const uint8_t *bytes = cursor_;
+    cursor_ += size;
+    return bytes;
+  }
+  size_t offset() const { return static_cast<size_t>(cursor_ - start_); }
+  void seek(size_t offset) {
+    if (offset > static_cast<size_t>(end_ - start_)) {
+      ok_ = false;
+      return;
+    }
+    cursor_ = start_ + offset;
+  }
+  bool ok() const { return ok_; }
+  bool atEnd() const { return cursor_ == end_; }
+
+private:
+  const uint8_t *start_;
+  const uint8_t *cursor_;
+  const uint8_t *end_;
+  bool ok_ = true;
+};
+
+// A whole file mapped read-only; data() is nullptr when it could not be
+// opened. Windows builds read the file into memory instead.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+#ifdef _WIN32
+  std::vector<uint8_t> contents_;
+#endif
+};
+
+// FNV-1a over size bytes. The file formats store it for their payload, so a
+// file damaged on disk is rejected before any of it is trusted.
+uint64_t checksum(const void *data, size_t size);
+
+// Writes through a temporary file renamed into place, so a concurrent reader
+// never maps a half-written file.
+bool writeFileAtomically(const std::string &path, const std::string &contents);
+
+} // namespace cpplox
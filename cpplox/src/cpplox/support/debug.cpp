@@ -2,6 +2,7 @@
 
 #include "debug.h"
 #include "object.h"
+#include "register_ops.h"
 #include "value.h"
 
 namespace cpplox {
@@ -44,6 +45,15 @@ static int byteInstruction(const char *name, Chunk *chunk, int offset) {
   std::printf("%-16s %4d\n", name, slot);
   return offset + 2;
 }
+static int localConstantInstruction(const char *name, Chunk *chunk,
+                                    int offset) {
+  uint8_t slot = chunk->byteAt(offset + 1);
+  uint8_t constant = chunk->byteAt(offset + 2);
+  std::printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constantAt(constant));
+  std::printf("'\n");
+  return offset + 3;
+}
 static int jumpInstruction(const char *name, int sign, Chunk *chunk,
                            int offset) {
   uint16_t jump = (uint16_t)(chunk->byteAt(offset + 1) << 8);
@@ -198,10 +208,149 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_INHERIT", offset);
   case OP_METHOD:
     return constantInstruction("OP_METHOD", chunk, offset);
+  case OP_GET_LOCAL_PROPERTY:
+    return localConstantInstruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+  case OP_ADD_LOCAL_CONSTANT:
+    return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+  case OP_SUBTRACT_LOCAL_CONSTANT:
+    return localConstantInstruction("OP_SUBTRACT_LOCAL_CONSTANT", chunk,
+                                    offset);
+  case OP_LESS_LOCAL_CONSTANT:
+    return localConstantInstruction("OP_LESS_LOCAL_CONSTANT", chunk, offset);
+  case OP_EQUAL_JUMP_IF_FALSE:
+    return jumpInstruction("OP_EQUAL_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_GREATER_JUMP_IF_FALSE:
+    return jumpInstruction("OP_GREATER_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_LESS_JUMP_IF_FALSE:
+    return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
+  case OP_TAIL_INVOKE:
+    return invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
+  case OP_TAIL_SUPER_INVOKE:
+    return invokeInstruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
+  case OP_NOT_EQUAL:
+    return simpleInstruction("OP_NOT_EQUAL", offset);
+  case OP_NOT_GREATER:
+    return simpleInstruction("OP_NOT_GREATER", offset);
+  case OP_NOT_LESS:
+    return simpleInstruction("OP_NOT_LESS", offset);
+  case OP_NOT_EQUAL_JUMP_IF_FALSE:
+    return jumpInstruction("OP_NOT_EQUAL_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_NOT_GREATER_JUMP_IF_FALSE:
+    return jumpInstruction("OP_NOT_GREATER_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_NOT_LESS_JUMP_IF_FALSE:
+    return jumpInstruction("OP_NOT_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_ADD_NUM:
+    return simpleInstruction("OP_ADD_NUM", offset);
+  case OP_ADD_STR:
+    return simpleInstruction("OP_ADD_STR", offset);
+  case OP_GET_FIELD_SLOT:
+    return constantInstruction("OP_GET_FIELD_SLOT", chunk, offset);
+  case OP_GET_LOCAL_FIELD_SLOT:
+    return localConstantInstruction("OP_GET_LOCAL_FIELD_SLOT", chunk, offset);
   default:
     std::printf("Unknown opcode %d\n", instruction);
     return offset + 1;
   }
 }
 
+void disassembleRegisterChunk(Chunk *chunk, const char *name) {
+  std::printf("== %s (registers) ==\n", name);
+
+  for (int offset = 0; offset < chunk->size();) {
+    offset = disassembleRegisterInstruction(chunk, offset);
+  }
+}
+static void printConstantOperand(Chunk *chunk, uint8_t constant) {
+  std::printf(" k%d '", constant);
+  printValue(chunk->constantAt(constant));
+  std::printf("'");
+}
+int disassembleRegisterInstruction(Chunk *chunk, int offset) {
+  std::printf("%04d ", offset);
+  if (offset > 0 && chunk->lineAt(offset) == chunk->lineAt(offset - 1)) {
+    std::printf("   | ");
+  } else {
+    std::printf("%4d ", chunk->lineAt(offset));
+  }
+
+  uint8_t instruction = chunk->byteAt(offset);
+  if (instruction >= ROP_COUNT) {
+    std::printf("Unknown register opcode %d\n", instruction);
+    return offset + 1;
+  }
+  std::printf("%-32s", kRegisterOpcodeNames[instruction]);
+
+  auto operand = [&](int index) { return chunk->byteAt(offset + index); };
+  auto jumpTarget = [&](int index, int sign) {
+    int jump = operand(index) << 8 | operand(index + 1);
+    return offset + index + 2 + sign * jump;
+  };
+
+  switch (instruction) {
+  case ROP_LOAD_NIL:
+  case ROP_LOAD_TRUE:
+  case ROP_LOAD_FALSE:
+  case ROP_PRINT:
+  case ROP_RETURN:
+    std::printf(" r%d\n", operand(1));
+    return offset + 2;
+  case ROP_MOVE:
+  case ROP_NOT:
+  case ROP_NEGATE:
+    std::printf(" r%d r%d\n", operand(1), operand(2));
+    return offset + 3;
+  case ROP_LOAD_CONSTANT:
+  case ROP_GET_GLOBAL:
+  case ROP_DEFINE_GLOBAL:
+  case ROP_SET_GLOBAL:
+  case ROP_CLOSURE:
+    std::printf(" r%d", operand(1));
+    printConstantOperand(chunk, operand(2));
+    std::printf("\n");
+    return offset + 3;
+  case ROP_ADD_CONSTANT:
+  case ROP_SUBTRACT_CONSTANT:
+    std::printf(" r%d r%d", operand(1), operand(2));
+    printConstantOperand(chunk, operand(3));
+    std::printf("\n");
+    return offset + 4;
+  case ROP_JUMP:
+    std::printf(" -> %d\n", jumpTarget(1, 1));
+    return offset + 3;
+  case ROP_LOOP:
+    std::printf(" -> %d\n", jumpTarget(1, -1));
+    return offset + 3;
+  case ROP_JUMP_IF_FALSE:
+  case ROP_JUMP_IF_TRUE:
+    std::printf(" r%d -> %d\n", operand(1), jumpTarget(2, 1));
+    return offset + 4;
+  case ROP_JUMP_IF_NOT_LESS_CONSTANT:
+  case ROP_JUMP_IF_NOT_GREATER_CONSTANT:
+    std::printf(" r%d", operand(1));
+    printConstantOperand(chunk, operand(2));
+    std::printf(" -> %d\n", jumpTarget(3, 1));
+    return offset + 5;
+  case ROP_JUMP_IF_NOT_EQUAL:
+  case ROP_JUMP_IF_EQUAL:
+  case ROP_JUMP_IF_NOT_LESS:
+  case ROP_JUMP_IF_LESS:
+  case ROP_JUMP_IF_NOT_GREATER:
+  case ROP_JUMP_IF_GREATER:
+    std::printf(" r%d r%d -> %d\n", operand(1), operand(2), jumpTarget(3, 1));
+    return offset + 5;
+  case ROP_CALL:
+    std::printf(" r%d (%d args)\n", operand(1), operand(2));
+    return offset + 3;
+  case ROP_CALL_GLOBAL:
+    printConstantOperand(chunk, operand(1));
+    std::printf(" r%d (%d args)\n", operand(2), operand(3));
+    return offset + 4;
+  default:
+    std::printf(" r%d r%d r%d\n", operand(1), operand(2), operand(3));
+    return offset + 4;
+  }
+}
+
 } // namespace cpplox
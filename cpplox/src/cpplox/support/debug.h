@@ -6,6 +6,8 @@ namespace cpplox {
 
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
+void disassembleRegisterChunk(Chunk *chunk, const char *name);
+int disassembleRegisterInstruction(Chunk *chunk, int offset);
 
 } // namespace cpplox
 
@@ -1,11 +1,21 @@
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <iterator>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
 
+#include "bytecode_file.h"
+#include "compiler.h"
+#include "profiler.h"
 #include "scanner.h"
+#include "snapshot.h"
 #include "vm.h"
 
 using namespace cpplox;
@@ -23,8 +33,7 @@ std::string readFile(std::string_view path) {
                      std::istreambuf_iterator<char>());
 }
 
-int runSource(Vm &vm, const std::string &source) {
-  InterpretResult result = vm.interpret(source);
+int resultCode(InterpretResult result) {
   if (result == INTERPRET_COMPILE_ERROR)
     return 65;
   if (result == INTERPRET_RUNTIME_ERROR)
@@ -32,9 +41,38 @@ int runSource(Vm &vm, const std::string &source) {
   return 0;
 }
 
-int runFile(Vm &vm, std::string_view path) {
+int runSource(Vm &vm, const std::string &source) {
+  return resultCode(vm.interpret(source));
+}
+
+// Loads script.loxc when it matches the source, otherwise compiles and writes
+// it. With execute false this only warms the cache.
+int runCached(Vm &vm, std::string_view path, const std::string &source,
+              bool execute) {
+  std::string cachePath = bytecodePath(path);
+  uint64_t sourceHash = hashSource(source);
+  ObjFunction *function =
+      readBytecodeFile(vm, cachePath, sourceHash, vm.optimizeBytecode);
+  if (function == nullptr) {
+    function = compile(vm, source);
+    if (function == nullptr)
+      return 65;
+    if (!writeBytecodeFile(cachePath, function, sourceHash,
+                           vm.optimizeBytecode)) {
+      std::cerr << "Could not write file \"" << cachePath << "\".\n";
+      if (!execute)
+        return 74;
+    }
+  }
+  return execute ? resultCode(vm.interpret(function)) : 0;
+}
+
+int runFile(Vm &vm, std::string_view path, bool cache, bool execute) {
   try {
-    return runSource(vm, readFile(path));
+    std::string source = readFile(path);
+    if (cache)
+      return runCached(vm, path, source, execute);
+    return runSource(vm, source);
   } catch (const std::runtime_error &error) {
     std::cerr << error.what() << '\n';
     return 74;
@@ -53,6 +91,85 @@ void repl(Vm &vm) {
   }
 }
 
+bool parseCount(std::string_view text, size_t *count) {
+  const char *end = text.data() + text.size();
+  auto [rest, error] = std::from_chars(text.data(), end, *count);
+  return error == std::errc() && rest == end && *count > 0;
+}
+
+// A byte count with an optional K, M or G suffix.
+bool parseSize(std::string_view text, size_t *size) {
+  size_t scale = 1;
+  if (!text.empty()) {
+    switch (text.back()) {
+    case 'K':
+    case 'k':
+      scale = size_t{1} << 10;
+      break;
+    case 'M':
+    case 'm':
+      scale = size_t{1} << 20;
+      break;
+    case 'G':
+    case 'g':
+      scale = size_t{1} << 30;
+      break;
+    }
+    if (scale != 1)
+      text.remove_suffix(1);
+  }
+  if (!parseCount(text, size) || *size > SIZE_MAX / scale)
+    return false;
+  *size *= scale;
+  return true;
+}
+
+// Applies one pacing setting, given as --gc-NAME=VALUE or in the environment
+// as CPPLOX_GC_NAME (upper case, underscores).
+bool setGcPolicy(GcPolicy *policy, std::string_view name,
+                 std::string_view value) {
+  if (name == "initial-heap")
+    return parseSize(value, &policy->initialHeap);
+  if (name == "max-heap")
+    return parseSize(value, &policy->maxHeap);
+  if (name == "grow-factor") {
+    const char *end = value.data() + value.size();
+    auto [rest, error] = std::from_chars(value.data(), end, policy->growFactor);
+    return error == std::errc() && rest == end && policy->growFactor > 1;
+  }
+  if (name == "target-cpu") {
+    size_t percent;
+    if (!parseCount(value, &percent) || percent >= 100)
+      return false;
+    policy->targetCpu = static_cast<double>(percent) / 100;
+    policy->adaptive = true;
+    return true;
+  }
+  if (name == "adaptive") {
+    policy->adaptive = value != "0";
+    return true;
+  }
+  return false;
+}
+
+bool readGcEnvironment(GcPolicy *policy) {
+  static constexpr std::pair<const char *, std::string_view> kVariables[] = {
+      {"CPPLOX_GC_INITIAL_HEAP", "initial-heap"},
+      {"CPPLOX_GC_MAX_HEAP", "max-heap"},
+      {"CPPLOX_GC_GROW_FACTOR", "grow-factor"},
+      {"CPPLOX_GC_TARGET_CPU", "target-cpu"},
+      {"CPPLOX_GC_ADAPTIVE", "adaptive"},
+  };
+  for (const auto &[variable, name] : kVariables) {
+    const char *value = std::getenv(variable);
+    if (value != nullptr && !setGcPolicy(policy, name, value)) {
+      std::cerr << "Invalid " << variable << "=\"" << value << "\".\n";
+      return false;
+    }
+  }
+  return true;
+}
+
 std::string_view tokenTypeName(TokenType type) {
   switch (type) {
   case TOKEN_LEFT_PAREN:
@@ -213,7 +330,28 @@ int main(int argc, const char *argv[]) {
   Vm vm;
   bool scan = false;
   bool stats = false;
+  bool registers = false;
+  bool lazyIntern = false;
+  bool optimize = true;
+  bool lazyFunctions = false;
+  bool incrementalGC = false;
+  bool compactGC = false;
+  bool cache = false;
+  bool compileOnly = false;
+  size_t sliceBudget = kDefaultSliceBudget;
+  size_t markThreads = 1;
+  size_t maxFrames = kDefaultMaxFrames;
   const char *path = nullptr;
+  std::string_view loadSnapshot;
+  std::string_view saveSnapshot;
+  bool profile = false;
+  std::string_view profilePath;
+  size_t profileInterval = kDefaultProfileInterval;
+  bool gcTelemetry = false;
+  std::string_view gcTelemetryPath;
+  GcPolicy gcPolicy;
+  if (!readGcEnvironment(&gcPolicy))
+    return 64;
 
   for (int i = 1; i < argc; i++) {
     std::string_view arg(argv[i]);
@@ -221,14 +359,107 @@ int main(int argc, const char *argv[]) {
       scan = true;
     } else if (arg == "--stats") {
       stats = true;
-    } else if (path == nullptr) {
+    } else if (arg == "--registers") {
+      registers = true;
+    } else if (arg == "--lazy-intern") {
+      lazyIntern = true;
+    } else if (arg == "--no-optimize") {
+      optimize = false;
+    } else if (arg == "--lazy-functions") {
+      lazyFunctions = true;
+    } else if (arg == "--cache") {
+      cache = true;
+    } else if (arg == "--compile-only") {
+      compileOnly = true;
+    } else if (arg.starts_with("--load-snapshot=") && arg.size() > 16) {
+      loadSnapshot = arg.substr(16);
+    } else if (arg.starts_with("--save-snapshot=") && arg.size() > 16) {
+      saveSnapshot = arg.substr(16);
+    } else if (arg == "--profile") {
+      profile = true;
+    } else if (arg.starts_with("--profile=") && arg.size() > 10) {
+      profile = true;
+      profilePath = arg.substr(10);
+    } else if (arg.starts_with("--profile-interval=") &&
+               parseCount(arg.substr(19), &profileInterval)) {
+      profile = true;
+    } else if (arg == "--gc-telemetry") {
+      gcTelemetry = true;
+    } else if (arg.starts_with("--gc-telemetry=") && arg.size() > 15) {
+      gcTelemetry = true;
+      gcTelemetryPath = arg.substr(15);
+    } else if (arg == "--gc-adaptive") {
+      gcPolicy.adaptive = true;
+    } else if (arg.starts_with("--gc-") &&
+               arg.find('=') != std::string_view::npos &&
+               setGcPolicy(&gcPolicy, arg.substr(5, arg.find('=') - 5),
+                           arg.substr(arg.find('=') + 1))) {
+    } else if (arg == "--gc-incremental") {
+      incrementalGC = true;
+    } else if (arg.starts_with("--gc-threads=") &&
+               parseCount(arg.substr(13), &markThreads)) {
+    } else if (arg.starts_with("--max-frames=") &&
+               parseCount(arg.substr(13), &maxFrames)) {
+    } else if (arg == "--gc-compact") {
+      compactGC = true;
+    } else if (arg.starts_with("--gc-slice=") &&
+               parseCount(arg.substr(11), &sliceBudget)) {
+      incrementalGC = true;
+    } else if (path == nullptr && !arg.starts_with("--")) {
       path = argv[i];
     } else {
-      std::cerr << "Usage: cpplox [--stats] [--scan] [path]\n";
+      std::cerr << "Usage: cpplox [--stats] [--registers] [--lazy-intern] "
+                   "[--no-optimize] [--lazy-functions] [--max-frames=N] "
+                   "[--gc-incremental] [--gc-slice=N] [--gc-threads=N] "
+                   "[--gc-compact] [--gc-initial-heap=SIZE] "
+                   "[--gc-grow-factor=F] [--gc-max-heap=SIZE] [--gc-adaptive] "
+                   "[--gc-target-cpu=PCT] [--gc-telemetry[=FILE]] [--cache] "
+                   "[--compile-only] [--load-snapshot=FILE] "
+                   "[--save-snapshot=FILE] "
+                   "[--profile[=FILE]] [--profile-interval=US] [--scan] "
+                   "[path]\n";
       return 64;
     }
   }
 
+  // Each REPL line is compiled on its own and may call functions from earlier
+  // lines, which could then have been compiled for the other tier.
+  if (registers && path == nullptr) {
+    std::cerr << "Usage: cpplox [--stats] --registers path\n";
+    return 64;
+  }
+  // The register tier compiles from source, so it never reads the cache.
+  if (compileOnly && (path == nullptr || registers || scan)) {
+    std::cerr << "Usage: cpplox --compile-only path\n";
+    return 64;
+  }
+  // A snapshot's functions run on the stack tier, and register code calling
+  // them, or them calling register code, would run the other tier's bytecode.
+  if (registers && (!loadSnapshot.empty() || !saveSnapshot.empty())) {
+    std::cerr << "Usage: cpplox --registers cannot be combined with "
+                 "--load-snapshot or --save-snapshot\n";
+    return 64;
+  }
+  // Skipped function bodies live only in the source, which neither the cache
+  // nor a snapshot stores.
+  if (lazyFunctions && (cache || compileOnly || !saveSnapshot.empty())) {
+    std::cerr << "Usage: cpplox --lazy-functions cannot be combined with "
+                 "--cache, --compile-only or --save-snapshot\n";
+    return 64;
+  }
+  vm.setRegisterTier(registers);
+  vm.setLazyIntern(lazyIntern);
+  vm.setOptimizeBytecode(optimize);
+  vm.setLazyFunctions(lazyFunctions);
+  vm.setMaxFrames(static_cast<int>(
+      std::min(maxFrames, static_cast<size_t>(INT_MAX))));
+  vm.heap.setIncremental(incrementalGC);
+  vm.heap.setSliceBudget(sliceBudget);
+  vm.heap.setPolicy(gcPolicy);
+  vm.heap.setAutoCompact(compactGC);
+  vm.heap.setMarkThreads(markThreads);
+  vm.heap.setTelemetry(gcTelemetry);
+
 #ifdef CPPLOX_ENABLE_VM_STATS
   vm.setStatsEnabled(stats);
   vm.resetStats();
@@ -239,6 +470,18 @@ int main(int argc, const char *argv[]) {
   }
 #endif
 
+  if (!loadSnapshot.empty() &&
+      !readSnapshot(vm, std::string(loadSnapshot))) {
+    std::cerr << "Could not load snapshot \"" << loadSnapshot << "\".\n";
+    return 74;
+  }
+
+  Profiler profiler(profileInterval);
+  if (profile) {
+    vm.profiler = &profiler;
+    profiler.start(vm.heap);
+  }
+
   int exitCode = 0;
   if (scan) {
     if (path == nullptr) {
@@ -249,7 +492,37 @@ int main(int argc, const char *argv[]) {
   } else if (path == nullptr) {
     repl(vm);
   } else {
-    exitCode = runFile(vm, path);
+    exitCode = runFile(vm, path, (cache && !registers) || compileOnly,
+                       !compileOnly);
+  }
+
+  if (profile) {
+    profiler.stop();
+    profiler.printReport();
+    if (!profilePath.empty() &&
+        !profiler.writeFoldedStacks(std::string(profilePath))) {
+      std::cerr << "Could not write file \"" << profilePath << "\".\n";
+      exitCode = 74;
+    }
+  }
+
+  if (exitCode == 0 && !saveSnapshot.empty() &&
+      !writeSnapshot(vm, std::string(saveSnapshot))) {
+    std::cerr << "Could not write snapshot \"" << saveSnapshot << "\".\n";
+    exitCode = 74;
+  }
+
+  if (gcTelemetry) {
+    if (gcTelemetryPath.empty()) {
+      printGcTelemetry(vm.heap, stderr);
+    } else if (std::FILE *file =
+                   std::fopen(std::string(gcTelemetryPath).c_str(), "w")) {
+      printGcTelemetry(vm.heap, file);
+      std::fclose(file);
+    } else {
+      std::cerr << "Could not write file \"" << gcTelemetryPath << "\".\n";
+      exitCode = 74;
+    }
   }
 
 #ifdef CPPLOX_ENABLE_VM_STATS
@@ -3,9 +3,10 @@
 from __future__ import annotations
 
 import re
+import shlex
 from pathlib import Path
 
-from .models import Expectations, Implementation
+from .models import Expectations, Implementation, SetupStep
 
 
 def normalize_output(stream: str | bytes | None) -> str:
@@ -29,6 +30,9 @@ def parse_expectations(path: Path, impl: Implementation) -> Expectations:
     saw_parse_error = False
     saw_runtime_error = False
     saw_expect_line = False
+    expected_exit: int | None = None
+    arguments: tuple[str, ...] | None = None
+    setup: list[SetupStep] = []
 
     for raw_line in path.read_text(encoding="utf-8").splitlines():
         comment_start = raw_line.find("//")
@@ -38,6 +42,23 @@ def parse_expectations(path: Path, impl: Implementation) -> Expectations:
         comment = raw_line[comment_start:].strip()
         text = _strip_nested_comment_markers(comment)
 
+        # Implementation-specific tests may run with their own arguments, after
+        # preparing files with earlier runs.
+        directive_match = re.match(r"^(args|before|copy):\s*(.*)$", text)
+        if directive_match:
+            words = tuple(shlex.split(directive_match.group(2)))
+            if directive_match.group(1) == "args":
+                arguments = words
+            else:
+                kind = "run" if directive_match.group(1) == "before" else "copy"
+                setup.append(SetupStep(kind=kind, arguments=words))
+            continue
+
+        exit_match = re.match(r"^expect exit:\s*(\d+)$", text, re.IGNORECASE)
+        if exit_match:
+            expected_exit = int(exit_match.group(1))
+            continue
+
         expect_match = re.match(r"^expect:\s*(.*)$", text, re.IGNORECASE)
         if expect_match:
             expected_stdout.append(expect_match.group(1).strip())
@@ -70,7 +91,9 @@ def parse_expectations(path: Path, impl: Implementation) -> Expectations:
             saw_parse_error = True
             stderr_fragments.append(text)
 
-    if saw_parse_error:
+    if expected_exit is not None:
+        exit_code = expected_exit
+    elif saw_parse_error:
         exit_code = 65
     elif saw_runtime_error:
         exit_code = 70
@@ -82,4 +105,6 @@ def parse_expectations(path: Path, impl: Implementation) -> Expectations:
         stderr_fragments=tuple(stderr_fragments),
         exit_code=exit_code,
         check_stdout=saw_expect_line,
+        arguments=arguments,
+        setup=tuple(setup),
     )
@@ -13,6 +13,7 @@ class FailureKind(enum.Enum):
     EXIT_CODE = "EXIT_CODE"
     STDOUT = "STDOUT"
     STDERR = "STDERR"
+    SETUP = "SETUP"
 
 
 @dataclass(frozen=True)
@@ -52,12 +53,22 @@ class Implementation:
         return tuple(values)
 
 
+@dataclass(frozen=True)
+class SetupStep:
+    """A `// copy:` or `// before:` directive run ahead of the test itself."""
+
+    kind: str
+    arguments: tuple[str, ...]
+
+
 @dataclass(frozen=True)
 class Expectations:
     stdout: str
     stderr_fragments: tuple[str, ...]
     exit_code: int
     check_stdout: bool
+    arguments: tuple[str, ...] | None = None
+    setup: tuple[SetupStep, ...] = ()
 
 
 @dataclass
@@ -3,14 +3,17 @@
 from __future__ import annotations
 
 import fnmatch
+import shutil
 import subprocess
+import tempfile
 import time
 from pathlib import Path
 
 from .expectations import normalize_output, parse_expectations
-from .models import FailureKind, Implementation, SuiteReport, TestResult
+from .models import Expectations, FailureKind, Implementation, SuiteReport, TestResult
 from .paths import BENCHMARK_TIMEOUT_SECONDS, REPO_ROOT, TEST_DIR
 from .processes import resolve_executable
+from .registry import IMPLEMENTATIONS
 
 
 def discover_tests(filter_pattern: str | None = None) -> list[Path]:
@@ -39,6 +42,11 @@ def relative_test_path(path: Path) -> str:
 
 
 def should_skip(path: Path, impl: Implementation, strict: bool) -> str | None:
+    # test/<name>/ holds tests of one implementation's own flags and limits.
+    owner = path.relative_to(TEST_DIR).parts[0]
+    if owner in IMPLEMENTATIONS and owner != impl.name:
+        return f"{owner}-specific test"
+
     category = path.parent.name
     if category == "scanning" and not impl.supports_scan:
         return None if strict else "implementation has no scanner dump mode"
@@ -52,8 +60,21 @@ def should_skip(path: Path, impl: Implementation, strict: bool) -> str | None:
     return None
 
 
-def command_for_test(impl: Implementation, executable: Path, path: Path) -> list[str]:
+def expand_placeholders(words: tuple[str, ...], path: Path, scratch: Path) -> list[str]:
+    values = {"test": str(path), "dir": str(path.parent), "tmp": str(scratch)}
+    return [word.format(**values) for word in words]
+
+
+def command_for_test(
+    impl: Implementation,
+    executable: Path,
+    path: Path,
+    expectations: Expectations,
+    scratch: Path,
+) -> list[str]:
     command = [str(executable)]
+    if expectations.arguments is not None:
+        return command + expand_placeholders(expectations.arguments, path, scratch)
     category = path.parent.name
     if category == "scanning":
         command.append("--scan")
@@ -63,6 +84,41 @@ def command_for_test(impl: Implementation, executable: Path, path: Path) -> list
     return command
 
 
+def run_setup(
+    executable: Path,
+    path: Path,
+    expectations: Expectations,
+    scratch: Path,
+    timeout: int,
+) -> str | None:
+    """Runs the test's `// copy:` and `// before:` steps, returning any error."""
+    for step in expectations.setup:
+        words = expand_placeholders(step.arguments, path, scratch)
+        if step.kind == "copy":
+            if len(words) != 2:
+                return f"copy: expected a source and a destination, got {words}"
+            shutil.copyfile(words[0], words[1])
+            continue
+
+        command = [str(executable), *words]
+        try:
+            completed = subprocess.run(
+                command,
+                cwd=REPO_ROOT,
+                capture_output=True,
+                text=True,
+                timeout=timeout,
+            )
+        except subprocess.TimeoutExpired:
+            return f"before: {' '.join(command)} exceeded {timeout} seconds"
+        if completed.returncode != 0:
+            return (
+                f"before: {' '.join(command)} exited {completed.returncode}\n"
+                f"{normalize_output(completed.stderr)}"
+            )
+    return None
+
+
 def timeout_for(path: Path, base_timeout: int) -> int:
     if path.parent.name == "benchmark":
         return max(base_timeout, BENCHMARK_TIMEOUT_SECONDS)
@@ -92,26 +148,34 @@ def run_one_test(
         result.failure_kind = FailureKind.UNSUPPORTED_MODE
         return result
 
-    try:
-        started = time.perf_counter()
-        completed = subprocess.run(
-            command_for_test(impl, executable, path),
-            cwd=REPO_ROOT,
-            capture_output=True,
-            text=True,
-            timeout=timeout_for(path, timeout),
-        )
-        result.duration_seconds = time.perf_counter() - started
-        result.stdout = normalize_output(completed.stdout)
-        result.stderr = normalize_output(completed.stderr)
-        result.exit_code = completed.returncode
-    except subprocess.TimeoutExpired as exc:
-        result.duration_seconds = timeout_for(path, timeout)
-        result.stdout = normalize_output(exc.stdout)
-        result.stderr = f"TIMEOUT: exceeded {timeout_for(path, timeout)} seconds"
-        result.exit_code = -1
-        result.failure_kind = FailureKind.TIMEOUT
-        return result
+    with tempfile.TemporaryDirectory(prefix="lox-test-") as scratch_name:
+        scratch = Path(scratch_name)
+        setup_error = run_setup(executable, path, expectations, scratch, timeout)
+        if setup_error:
+            result.stderr = setup_error
+            result.failure_kind = FailureKind.SETUP
+            return result
+
+        try:
+            started = time.perf_counter()
+            completed = subprocess.run(
+                command_for_test(impl, executable, path, expectations, scratch),
+                cwd=REPO_ROOT,
+                capture_output=True,
+                text=True,
+                timeout=timeout_for(path, timeout),
+            )
+            result.duration_seconds = time.perf_counter() - started
+            result.stdout = normalize_output(completed.stdout)
+            result.stderr = normalize_output(completed.stderr)
+            result.exit_code = completed.returncode
+        except subprocess.TimeoutExpired as exc:
+            result.duration_seconds = timeout_for(path, timeout)
+            result.stdout = normalize_output(exc.stdout)
+            result.stderr = f"TIMEOUT: exceeded {timeout_for(path, timeout)} seconds"
+            result.exit_code = -1
+            result.failure_kind = FailureKind.TIMEOUT
+            return result
 
     if result.exit_code != expectations.exit_code:
         result.failure_kind = FailureKind.EXIT_CODE